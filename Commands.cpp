@@ -15,9 +15,16 @@
 *
 */
 #include "VCRExtMain.h"
+#include "Snapshot.h"
+#include "Waiter.h"
+#include "Worker.h"
+#include "Spawn.h"
+#include "Metrics.h"
 #include <windows.h>
-#include <Tlhelp32.h>
 #include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
 
 /*
 	Command version
@@ -32,10 +39,302 @@ DECLARE(version,0,"") {
 	ret = "1.1";
 }
 FINISH
+/*
+	Kills the processes of snap marked in del, depending on level their
+	children as well. The calling process and the system processes will
+	never be killed as children. Returns the number of killed processes.
+ */
+static int killMarked(const ProcSnapshot &snap, std::vector<char> &del, int level) {
+	size_t i, n = snap.Procs.size();
+	DWORD self = GetCurrentProcessId();
+	int count = 0;
+	HANDLE hd;
+
+	// Level 1 marks the children of the matching processes, level 2 their whole subtrees
+	if (level > 0) {
+		std::vector<char> roots(del);
+		std::vector<size_t> order;
+		ProcTree tree;
+
+		tree.build(snap);
+		for (i = 0; i < n; i++) {
+			if (!roots[i])
+				continue;
+			order.clear();
+			if (level == 1)
+				order.assign(tree.Children.begin() + tree.First[i], tree.Children.begin() + tree.First[i + 1]);
+			else
+				tree.postorder(i, order);
+			for (size_t o = 0; o < order.size(); o++) {
+				DWORD pid = snap.Procs[order[o]].Pid;
+
+				if (pid > 4 && pid != self)
+					del[order[o]] = 1;
+			}
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (del[i]) {
+			if (hd = openProcess(snap.Procs[i], PROCESS_TERMINATE)) {
+				if (TerminateProcess(hd, 0)) {
+					countMetric(extMetrics.Killed);
+					count++;
+				}
+				CloseHandle(hd);
+			}
+		}
+	}
+	return count;
+}
+/*
+	Kills the processes with process id id or executable name name, depending
+	on level their children as well. Uses no Tcl objects, therefore it can be
+	called by a worker thread. Returns the number of killed processes.
+ */
+static int killProcesses(DWORD id, const char *name, int level) {
+	ProcSnapshot snap;
+
+	if (snap.take()) {
+		size_t i, n = snap.Procs.size();
+		std::vector<char> del(n, 0);
+
+		for (i = 0; i < n; i++) {
+			if (id && snap.Procs[i].Pid == id)
+				del[i] = 1;
+			else if (*name)
+				del[i] = snap.prefixed(snap.Procs[i], name);
+		}
+		return killMarked(snap, del, level);
+	}
+	return 0;
+}
+static bool moreCpu(const ProcEntry *a, const ProcEntry *b) {
+	return a->Cpu > b->Cpu;
+}
+static bool moreRss(const ProcEntry *a, const ProcEntry *b) {
+	return a->Rss > b->Rss;
+}
+/*
+	Kills the top processes by working set or CPU time among the processes
+	whose executable name matches pattern, depending on level their children
+	as well. Only the top processes will be selected by a partial sort. The
+	calling process and the system processes will never be selected. Can be
+	called by any thread. Returns the number of killed processes.
+ */
+static int killTop(size_t top, bool cpu, const char *pattern, int level) {
+	ProcSnapshot snap;
+
+	if (top > 0 && snap.take()) {
+		std::vector<const ProcEntry*> cand;
+		std::vector<char> del(snap.Procs.size(), 0);
+		DWORD self = GetCurrentProcessId();
+
+		for (size_t i = 0; i < snap.Procs.size(); i++) {
+			const ProcEntry &p = snap.Procs[i];
+
+			if (p.Pid > 4 && p.Pid != self && Tcl_StringCaseMatch(snap.name(p), pattern, 1))
+				cand.push_back(&p);
+		}
+		if (top < cand.size()) {
+			std::nth_element(cand.begin(), cand.begin() + top, cand.end(), cpu ? moreCpu : moreRss);
+			cand.resize(top);
+		}
+		for (size_t i = 0; i < cand.size(); i++)
+			del[cand[i] - &snap.Procs[0]] = 1;
+		return killMarked(snap, del, level);
+	}
+	return 0;
+}
+/*
+	Job for kill -async
+ */
+class KillJob : public AsyncJob {
+	DWORD Id;
+	std::string Name;
+	int Level, Count;
+	size_t Top;
+	bool Cpu;
+public:
+	// top > 0: Kill top processes by cpu or working set among the processes matching name
+	KillJob(Tcl_Interp *ip, Tcl_Obj *callback, DWORD id, const char *name, int level, size_t top = 0, bool cpu = false) : AsyncJob(ip, callback), Name(name) {
+		Id = id;
+		Level = level;
+		Count = 0;
+		Top = top;
+		Cpu = cpu;
+	}
+	void run() {
+		Count = Top ? killTop(Top, Cpu, Name.c_str(), Level) : killProcesses(Id, Name.c_str(), Level);
+	}
+	Tcl_Obj *result() {
+		return Tcl_NewIntObj(Count);
+	}
+};
+/*
+	Low memory watch of kill -lowmemory, one per interpreter. The wait
+	callback of the system thread pool kills the top processes once and
+	queues an event to the interpreter thread. Fired tells whether the
+	callback has been invoked.
+ */
+struct LowMemoryWatch {
+	HANDLE Wait;
+	volatile LONG Fired;
+	Tcl_Interp *Ip;
+	Tcl_ThreadId Owner;
+	Tcl_Obj *Callback;
+	std::string Pattern;
+	size_t Top;
+	bool Cpu;
+	int Level, Count;
+};
+struct LowMemoryEvent {
+	Tcl_Event Header;			// Must be the first member
+	LowMemoryWatch *Watch;
+};
+
+/*
+	The callback may re-arm the watch, which deletes lw. Therefore lw must
+	not be used after the callback has been evaluated.
+ */
+static int lowMemoryEvent(Tcl_Event *ev, int) {
+	LowMemoryWatch *lw = ((LowMemoryEvent*)ev)->Watch;
+	Tcl_Interp *ip = lw->Ip;
+
+	if (!Tcl_InterpDeleted(ip)) {
+		Tcl_Obj *cmd = Tcl_DuplicateObj(lw->Callback);
+
+		Tcl_IncrRefCount(cmd);
+		Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewIntObj(lw->Count));
+		Tcl_Preserve(ip);
+		if (Tcl_EvalObjEx(ip, cmd, TCL_EVAL_GLOBAL) == TCL_ERROR)
+			Tcl_BackgroundError(ip);
+		Tcl_Release(ip);
+		Tcl_DecrRefCount(cmd);
+	}
+	return 1;
+}
+static int dropLowMemory(Tcl_Event *ev, ClientData cd) {
+	return ev->proc == lowMemoryEvent && ((LowMemoryEvent*)ev)->Watch == (LowMemoryWatch*)cd;
+}
+static VOID CALLBACK lowMemory(PVOID arg, BOOLEAN) {
+	LowMemoryWatch *lw = (LowMemoryWatch*)arg;
+	LowMemoryEvent *ev;
+
+	if (InterlockedExchange(&lw->Fired, 1))
+		return;
+	lw->Count = killTop(lw->Top, lw->Cpu, lw->Pattern.c_str(), lw->Level);
+	ev = (LowMemoryEvent*)Tcl_Alloc(sizeof *ev);
+	ev->Header.proc = lowMemoryEvent;
+	ev->Header.nextPtr = NULL;
+	ev->Watch = lw;
+	Tcl_ThreadQueueEvent(lw->Owner, &ev->Header, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(lw->Owner);
+}
+#define LOWMEMORYKEY "VCRExt::lowmemory"
+static AssocDataDesc lowMemoryData(LOWMEMORYKEY);
+static void freeLowMemoryWatch(ClientData cd, Tcl_Interp *) {
+	LowMemoryWatch *lw = (LowMemoryWatch*)cd;
+
+	if (lw) {
+		// INVALID_HANDLE_VALUE: Wait until a running callback has been finished
+		if (lw->Wait)
+			UnregisterWaitEx(lw->Wait, INVALID_HANDLE_VALUE);
+		Tcl_DeleteEvents(dropLowMemory, lw);
+		Tcl_DecrRefCount(lw->Callback);
+		delete lw;
+	}
+}
+/*
+	Replaces the low memory watch of the interpreter. top 0 removes it.
+ */
+static void watchLowMemory(Tcl_Interp *ip, Tcl_Obj *callback, size_t top, bool cpu, const char *pattern, int level) {
+	static HANDLE notification = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+	LowMemoryWatch *lw;
+
+	freeLowMemoryWatch(Tcl_GetAssocData(ip, LOWMEMORYKEY, NULL), ip);
+	Tcl_SetAssocData(ip, LOWMEMORYKEY, freeLowMemoryWatch, NULL);
+	if (top == 0)
+		return;
+	if (notification == NULL)
+		throw ValueException(ValueException::ValueExceptionLimit, "Memory resource notification not available");
+	lw = new LowMemoryWatch;
+	lw->Fired = 0;
+	lw->Ip = ip;
+	lw->Owner = Tcl_GetCurrentThread();
+	lw->Callback = callback;
+	Tcl_IncrRefCount(callback);
+	lw->Pattern = pattern;
+	lw->Top = top;
+	lw->Cpu = cpu;
+	lw->Level = level;
+	lw->Count = 0;
+	if (!RegisterWaitForSingleObject(&lw->Wait, notification, lowMemory, lw, INFINITE, WT_EXECUTEONLYONCE | WT_EXECUTELONGFUNCTION)) {
+		lw->Wait = NULL;
+		freeLowMemoryWatch(lw, ip);
+		throw ValueException(ValueException::ValueExceptionLimit, "Memory resource notification not available");
+	}
+	Tcl_SetAssocData(ip, LOWMEMORYKEY, freeLowMemoryWatch, lw);
+}
+/*
+	kill ?-async callback? -top n -by rss|cpu -among pattern ?-lowmemory? ?level?
+	Parses the options behind -async, starting at position i.
+ */
+static void killTopCmd(Tcl_Interp *ip, Tcl_Obj *callback, int i, int cnt, Tcl_Obj *CONST objs[]) {
+	int top = -1, level = 0;
+	bool cpu = false, lowmem = false;
+	const char *pattern = NULL;
+
+	for (; i < cnt; i++) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-top") == 0 && i + 1 < cnt) {
+			if ((top = Int(objs[++i])) < 0)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (top >= 0)");
+		}
+		else if (strcmp(opt, "-by") == 0 && i + 1 < cnt) {
+			String by(objs[++i]);
+
+			if (strcmp(by, "cpu") == 0)
+				cpu = true;
+			else if (strcmp(by, "rss") == 0)
+				cpu = false;
+			else
+				throw ValueException(ValueException::ValueExceptionLimit, "Invalid resource (rss, cpu)");
+		}
+		else if (strcmp(opt, "-among") == 0 && i + 1 < cnt)
+			pattern = Tcl_GetString(objs[++i]);
+		else if (strcmp(opt, "-lowmemory") == 0)
+			lowmem = true;
+		else if (i == cnt - 1 && ((const char*)opt)[0] != '-') {
+			if ((level = Int(objs[i])) < 0 || level > 2)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (0 - 2)");
+		}
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-top, -by, -among, -lowmemory)");
+	}
+	if (top < 0 || pattern == NULL)
+		throw ValueException(ValueException::ValueExceptionLimit, "Options -top and -among required");
+	if (lowmem) {
+		if (callback == NULL && top > 0)
+			throw ValueException(ValueException::ValueExceptionLimit, "Option -lowmemory requires -async");
+		watchLowMemory(ip, callback, top, cpu, pattern, level);
+	}
+	else if (callback) {
+		KillJob *job = new KillJob(ip, callback, 0, pattern, level, top, cpu);
+
+		if (!submitJob(job)) {
+			delete job;
+			throw ValueException(ValueException::ValueExceptionLimit, "Worker pool not available");
+		}
+	}
+	else
+		Tcl_SetObjResult(ip, Tcl_NewIntObj(killTop(top, cpu, pattern, level)));
+}
 /*
 	Command kill
 	Syntax:
-		kill id level
+		kill ?-async callback? id level
+		kill ?-async callback? -top n -by rss|cpu -among pattern ?-lowmemory? ?level?
 	Function:
 		Kills specified process. Id is either a process id or the name
 		of an executable file, e.g. notepad.exe. Level 0 specifies 
@@ -43,70 +342,55 @@ FINISH
 		processes and all processes invoked by these processes will be
 		killed, 2 the specified processes and all processes invoked by
 		by these processes recursively.
+		With option -top, the n processes with the largest working set
+		or CPU time among the processes whose executable name matches
+		pattern will be killed. With option -lowmemory, they will be
+		killed once when the system signals low memory, -async is
+		required then. -top 0 -lowmemory cancels the pending watch.
+		With option -async, the processes will be killed by a worker
+		thread and callback will be invoked with the result appended.
 	Returns:
-		Number of processes that have been killed.
+		Number of processes that have been killed, nothing with -async.
  */
-DECLARE(kill, 2, "id level") {
-	ARG(Int, level, 2);
-	RES(Int, res);
+DECLARE(kill, -1, "?-async callback? id level") {
+	int i = 1;
+	Tcl_Obj *callback = asyncOption(i, cnt, objs);
+
+	if (i < cnt && strcmp(Tcl_GetString(objs[i]), "-top") == 0) {
+		killTopCmd(ip, callback, i, cnt, objs);
+		return TCL_OK;
+	}
+	if (cnt != i + 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "?-async callback? id level");
+		return TCL_ERROR;
+	}
+	ARG(Int, level, i + 1);
 	Int id(0);
 	String name("");
-	int count = 0;
+
 	if (level < 0 || level > 2)
 		throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (0 - 2)");
+	try {
+		ARG(Int, s1, i);
+		id = s1;
+	}
+	catch (ValueException) {
+		ARG(String, s1, i);
+		name = s1;
+	}
+	if (callback) {
+		KillJob *job = new KillJob(ip, callback, (int)id, name, level);
 
-	HANDLE hd = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
-
-	if (hd != INVALID_HANDLE_VALUE) {
-		try {
-			ARG(Int, s1, 1);
-			id = s1;
+		if (!submitJob(job)) {
+			delete job;
+			throw ValueException(ValueException::ValueExceptionLimit, "Worker pool not available");
 		}
-		catch (ValueException) {
-			ARG(String, s1, 1);
-			name = s1;
-		}
-		int res, i = 0, j, k;
-		PROCESSENTRY32 ent;
-		struct procvallist { int pid, ppid, del; } *procs;
+	}
+	else {
+		RES(Int, res);
 
-		ent.dwSize = sizeof ent;
-		for (res = Process32First(hd, &ent); res; res = Process32Next(hd, &ent))
-			i++;
-		procs = new procvallist[i];
-		for (i = 0, res = Process32First(hd, &ent); res; i++, res = Process32Next(hd, &ent)) {
-			procs[i].pid = ent.th32ProcessID;
-			procs[i].ppid = ent.th32ParentProcessID;
-			if (id && ent.th32ProcessID == id)
-				procs[i].del = 1;
-			else if (*((const char*)name)) {
-				for (j = 0; ((const char*)name)[j] == (char)ent.szExeFile[j] && ent.szExeFile[j]; j++);
-				procs[i].del = ent.szExeFile[j] == 0;
-			}
-			else
-				procs[i].del = 0;
-		}
-		for (j = 0; level && j < i; ) {
-			for (k = 0; k < i; k++) {
-				if (!procs[j].del && procs[k].del && procs[j].ppid == procs[k].pid) {
-					procs[j].del = 1;
-					break;
-				}
-			}
-			j += (k < i && level > 1) ? -j : 1;
-		}
-		CloseHandle(hd);
-		for (j = 0; j < i; j++) {
-			if (procs[j].del) {
-				if (hd = OpenProcess(PROCESS_TERMINATE, FALSE, procs[j].pid)) {
-					if (TerminateProcess(hd, 0))
-						count++;
-					CloseHandle(hd);
-				}
-			}
-		}
+		res = killProcesses((int)id, name, level);
 	}
-	res = count;
 }
 FINISH
 /*
@@ -138,27 +422,37 @@ FINISH
 /*
 	Command regservice
 	Syntax:
-		regservice name description command starttype
+		regservice ?-shared? name description command starttype
 	Function:
-		Register program as a service
+		Register program as a service. With option -shared, the service
+		will be registered as a service that shares its process with
+		other services, see command serve.
 	Returns:
 		0: program registered
 		other: WIN32 error code when trying to register program
  */
-DECLARE(regservice, 4, "name description command starttype") {
-	ARG(String, name, 1);
-	ARG(String, desc, 2);
-	ARG(String, cmd, 3);
-	ARG(Int, type, 4);
+DECLARE(regservice, -1, "?-shared? name description command starttype") {
 	RES(Int, res);
 	SC_HANDLE hd, hds;
+	int shared = cnt == 6 && strcmp(String(objs[1]), "-shared") == 0;
+
+	if (cnt != 5 + shared) {
+		if (cnt == 6)
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-shared)");
+		Tcl_WrongNumArgs(ip, 1, objs, "?-shared? name description command starttype");
+		return TCL_ERROR;
+	}
+	ARG(String, name, 1 + shared);
+	ARG(String, desc, 2 + shared);
+	ARG(String, cmd, 3 + shared);
+	ARG(Int, type, 4 + shared);
 
 	if (type < 2 || type > 4)
 		throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (2 - 4");
 
 	if((hd = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS)) == NULL)
 		res = GetLastError();
-	else if ((hds = CreateServiceA(hd, name, desc, SC_MANAGER_ALL_ACCESS, SERVICE_WIN32_OWN_PROCESS, type, SERVICE_ERROR_IGNORE, cmd, NULL, NULL, NULL, NULL, "")) == NULL) {
+	else if ((hds = CreateServiceA(hd, name, desc, SC_MANAGER_ALL_ACCESS, shared ? SERVICE_WIN32_SHARE_PROCESS : SERVICE_WIN32_OWN_PROCESS, type, SERVICE_ERROR_IGNORE, cmd, NULL, NULL, NULL, NULL, "")) == NULL) {
 		CloseServiceHandle(hd);
 		res = GetLastError();
 	}
@@ -198,171 +492,721 @@ DECLARE(unregservice, 1, "name") {
 }
 FINISH
 /*
-	Service functions and structures
+	Service functions and structures. Each service served by this process
+	is described by one VcrExtSrv object, stored in a process-wide hash
+	table with the service name as key and in a list owned by the
+	interpreter that invoked serve. Control codes will be queued per
+	service and handled in the thread of that interpreter. One dispatcher
+	thread serves all services. Service objects remain valid while the
+	dispatcher is running, even if their interpreter has been deleted.
+	A stopped service will be removed from the hash table (retired), in
+	console mode at once, otherwise when the dispatcher returns. It will
+	be freed then, or by its interpreter if that still exists.
  */
-static struct VcrExtSrv {
+struct ControlEntry {
+	SLIST_ENTRY Link;			// Must be the first member
+	DWORD Control;
+	ULONGLONG Queued;			// Time stamp of receipt
+};
+struct VcrExtSrv {
+	SLIST_HEADER queue;			// Lock-free queue of ControlEntry, filled by handler
+	char *name;
+	wchar_t *wname;
 	Value *command;
-	Tcl_Interp *ip;
+	Tcl_Interp *ip;				// NULL if interpreter has been deleted
 	Tcl_AsyncHandler ah;
-	HANDLE ehd, thd;
-	DWORD type;
+	HANDLE stopped, progress;
+	bool batch;
+	bool retired;				// Removed from sd.services, owned by the list of ip
+	CRITICAL_SECTION lock;		// Protects state, ip and ah
 	SERVICE_STATUS_HANDLE shd;
 	SERVICE_STATUS state;
-	SERVICE_TABLE_ENTRY entry;
-	VcrExtSrv() { entry.lpServiceName = NULL; command = NULL; }
+};
+static struct VcrExtDispatcher {
+	enum { Idle, Starting, Scm, Console };
+	CRITICAL_SECTION lock;		// Protects services and mode
+	Tcl_HashTable services;		// Service name -> VcrExtSrv*
+	bool initialized;
+	int mode;
+	HANDLE ehd;
+	SERVICE_TABLE_ENTRY *table;
+	DWORD error;
+	VcrExtDispatcher() { InitializeCriticalSection(&lock); initialized = false; mode = Idle; ehd = NULL; table = NULL; }
 } sd;
+// The dispatcher thread runs until all services have been stopped, the extension stays loaded meanwhile
+static const char *servicesBusy() {
+	bool idle;
+
+	EnterCriticalSection(&sd.lock);
+	idle = sd.mode == VcrExtDispatcher::Idle;
+	LeaveCriticalSection(&sd.lock);
+	return idle ? NULL : "Services are being served";
+}
+static ExitDesc servicesExit(NULL, servicesBusy);
+static VcrExtSrv *newService(const char *name, int mask, const char *cmd, bool batch) {
+	VcrExtSrv *srv = new VcrExtSrv;
+	size_t len = strlen(name) + 1;
+
+	InitializeSListHead(&srv->queue);
+	srv->name = strcpy(new char[len], name);
+	srv->wname = new wchar_t[len];
+	mbstowcs(srv->wname, name, len);
+	srv->command = new String(String(cmd) + " ");
+	srv->ip = NULL;
+	srv->ah = NULL;
+	srv->batch = batch;
+	srv->retired = false;
+	srv->stopped = CreateEvent(NULL, TRUE, FALSE, NULL);
+	srv->progress = CreateEvent(NULL, FALSE, FALSE, NULL);
+	InitializeCriticalSection(&srv->lock);
+	srv->shd = NULL;
+	memset(&srv->state, 0, sizeof srv->state);
+	srv->state.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+	srv->state.dwCurrentState = SERVICE_START_PENDING;
+	srv->state.dwControlsAccepted = mask;
+	return srv;
+}
+static void freeService(VcrExtSrv *srv) {
+	ControlEntry *act, *next;
+
+	for (act = (ControlEntry*)InterlockedFlushSList(&srv->queue); act; act = next) {
+		next = (ControlEntry*)act->Link.Next;
+		_aligned_free(act);
+	}
+	if (srv->stopped)
+		CloseHandle(srv->stopped);
+	if (srv->progress)
+		CloseHandle(srv->progress);
+	DeleteCriticalSection(&srv->lock);
+	delete srv->command;
+	delete [] srv->wname;
+	delete [] srv->name;
+	delete srv;
+}
 /*
-	AsyncHandler to handle asynchronous events in stored tcl interpreter
+	Returns the service with the given name, NULL if not served. Must be
+	called while sd.lock is held.
  */
-static int asynchand(ClientData, Tcl_Interp *, int rc) {
-	Tcl_InterpState is = Tcl_SaveInterpState(sd.ip, rc);
-	String cmd(**sd.command);
+static VcrExtSrv *findService(const char *name) {
+	Tcl_HashEntry *ent = sd.initialized ? Tcl_FindHashEntry(&sd.services, name) : NULL;
 
-	cmd = cmd + String(Int(sd.type));
-	Tcl_EvalObjEx(sd.ip, cmd, TCL_EVAL_DIRECT|TCL_EVAL_GLOBAL);
-	SetEvent(sd.thd);
-	return Tcl_RestoreInterpState(sd.ip, is);
+	return ent ? (VcrExtSrv*)Tcl_GetHashValue(ent) : NULL;
 }
 /*
-	Service thread, used to avoid blocking of main thread while service
-	is running
+	Removes the service from the hash table, so its name can be served
+	again. It will be freed if its interpreter has been deleted. Must be
+	called while sd.lock is held.
  */
-static DWORD WINAPI thmain(LPVOID) {
-	sd.state.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
-	sd.state.dwCurrentState = SERVICE_START_PENDING;
-	sd.ah = Tcl_AsyncCreate(asynchand, NULL);
-	if (!StartServiceCtrlDispatcher(&sd.entry))
-		sd.type = GetLastError();
-	delete [] sd.entry.lpServiceName;
-	CloseHandle(sd.ehd);
-	Tcl_AsyncDelete(sd.ah);
-	CloseHandle(sd.thd);
-	sd.ehd = sd.thd = NULL;
-	sd.entry.lpServiceName = NULL;
-	return 0;
+static void retireService(VcrExtSrv *srv) {
+	Tcl_DeleteHashEntry(Tcl_FindHashEntry(&sd.services, srv->name));
+	if (srv->ip == NULL)
+		freeService(srv);
+	else
+		srv->retired = true;
 }
 /*
-	Service event handler, marks asynchronous event and waits until command
-	has been finished by asynchronous handler.
+	Frees the retired services of an interpreter. Must be called by the
+	thread of the interpreter while sd.lock is held.
  */
-static DWORD WINAPI handler(DWORD type, DWORD, LPVOID, LPVOID) {
-	if (type == SERVICE_CONTROL_INTERROGATE) {
-		return NO_ERROR;
+static void reapServices(std::vector<VcrExtSrv*> *list) {
+	for (size_t i = 0; i < list->size(); ) {
+		VcrExtSrv *srv = (*list)[i];
+
+		if (srv->retired) {
+			Tcl_AsyncDelete(srv->ah);
+			freeService(srv);
+			list->erase(list->begin() + i);
+		}
+		else
+			i++;
+	}
+}
+/*
+	Retires service stopped, if any, in console mode and ends console mode
+	when all services have been stopped: The dispatcher thread waits for
+	sd.ehd. Services of deleted interpreters do not count, they will never
+	be stopped.
+ */
+static void consoleStopped(VcrExtSrv *stopped) {
+	Tcl_HashSearch search;
+	Tcl_HashEntry *ent;
+	bool running = false;
+
+	EnterCriticalSection(&sd.lock);
+	if (sd.mode == VcrExtDispatcher::Console) {
+		if (stopped)
+			retireService(stopped);
+		for (ent = Tcl_FirstHashEntry(&sd.services, &search); ent && !running; ent = Tcl_NextHashEntry(&search)) {
+			VcrExtSrv *srv = (VcrExtSrv*)Tcl_GetHashValue(ent);
+
+			EnterCriticalSection(&srv->lock);
+			running = srv->ip && srv->state.dwCurrentState != SERVICE_STOPPED;
+			LeaveCriticalSection(&srv->lock);
+		}
+		if (!running)
+			SetEvent(sd.ehd);
+	}
+	LeaveCriticalSection(&sd.lock);
+}
+/*
+	Per-interpreter list of services. When the interpreter will be deleted,
+	its services will be detached. Services not yet known by the service
+	control manager will be removed.
+ */
+#define SERVICESKEY "VCRExt::services"
+static AssocDataDesc servicesData(SERVICESKEY);
+static void freeServices(ClientData cd, Tcl_Interp *) {
+	std::vector<VcrExtSrv*> *list = (std::vector<VcrExtSrv*>*)cd;
+
+	EnterCriticalSection(&sd.lock);
+	for (size_t i = 0; i < list->size(); i++) {
+		VcrExtSrv *srv = (*list)[i];
+
+		EnterCriticalSection(&srv->lock);
+		if (srv->ah)
+			Tcl_AsyncDelete(srv->ah);
+		srv->ah = NULL;
+		srv->ip = NULL;
+		LeaveCriticalSection(&srv->lock);
+		if (srv->retired)
+			freeService(srv);
+		else if (sd.mode == VcrExtDispatcher::Idle || sd.mode == VcrExtDispatcher::Console)
+			retireService(srv);
+	}
+	consoleStopped(NULL);
+	LeaveCriticalSection(&sd.lock);
+	delete list;
+}
+static std::vector<VcrExtSrv*> *getServices(Tcl_Interp *ip) {
+	std::vector<VcrExtSrv*> *list = (std::vector<VcrExtSrv*>*)Tcl_GetAssocData(ip, SERVICESKEY, NULL);
+
+	if (list == NULL) {
+		list = new std::vector<VcrExtSrv*>;
+		Tcl_SetAssocData(ip, SERVICESKEY, freeServices, list);
+	}
+	return list;
+}
+/*
+	Sets the current service state and reports it to the service control manager
+ */
+static void setState(VcrExtSrv *srv, DWORD state, DWORD waithint) {
+	EnterCriticalSection(&srv->lock);
+	if (srv->state.dwCurrentState != state)
+		srv->state.dwCheckPoint = 0;
+	else if (waithint)
+		srv->state.dwCheckPoint++;
+	srv->state.dwCurrentState = state;
+	srv->state.dwWaitHint = waithint;
+	if (srv->shd)
+		SetServiceStatus(srv->shd, &srv->state);
+	if (state == SERVICE_STOPPED)
+		SetEvent(srv->stopped);
+	LeaveCriticalSection(&srv->lock);
+}
+/*
+	Returns the pending state and the final state for a control code, 0 if the
+	control code doesn't change the service state.
+ */
+static DWORD pendingState(DWORD type) {
+	switch (type) {
+	case SERVICE_CONTROL_CONTINUE:
+		return SERVICE_CONTINUE_PENDING;
+	case SERVICE_CONTROL_PAUSE:
+		return SERVICE_PAUSE_PENDING;
+	case SERVICE_CONTROL_PRESHUTDOWN:
+	case SERVICE_CONTROL_SHUTDOWN:
+	case SERVICE_CONTROL_STOP:
+		return SERVICE_STOP_PENDING;
 	}
-	sd.type = type;
-	Tcl_AsyncMark(sd.ah);
-	WaitForSingleObject(sd.thd, INFINITE);
-	sd.state.dwCheckPoint = sd.state.dwWaitHint = 0;
+	return 0;
+}
+static DWORD finalState(DWORD type) {
 	switch (type) {
 	case SERVICE_CONTROL_CONTINUE:
-		sd.state.dwCurrentState = SERVICE_RUNNING;
-		break;
+		return SERVICE_RUNNING;
 	case SERVICE_CONTROL_PAUSE:
-		sd.state.dwCurrentState = SERVICE_PAUSED;
-		break;
+		return SERVICE_PAUSED;
 	case SERVICE_CONTROL_PRESHUTDOWN:
 	case SERVICE_CONTROL_SHUTDOWN:
 	case SERVICE_CONTROL_STOP:
-		sd.state.dwCurrentState = SERVICE_STOPPED;
+		return SERVICE_STOPPED;
 	}
-	SetServiceStatus(sd.shd, &sd.state);
 	return 0;
 }
 /*
-	Service main function.
+	AsyncHandler to handle asynchronous events in the interpreter of a
+	service. Drains all control codes queued so far. The queue is LIFO,
+	therefore the entries will be reversed first. In batch mode, command
+	will be invoked once with all control codes, otherwise once per
+	control code.
+ */
+static int asynchand(ClientData cd, Tcl_Interp *, int rc) {
+	VcrExtSrv *srv = (VcrExtSrv*)cd;
+	Tcl_InterpState is = Tcl_SaveInterpState(srv->ip, rc);
+	ControlEntry *act, *next, *first = NULL;
+	DWORD state = 0;
+
+	for (act = (ControlEntry*)InterlockedFlushSList(&srv->queue); act; act = next) {
+		next = (ControlEntry*)act->Link.Next;
+		act->Link.Next = (PSLIST_ENTRY)first;
+		first = act;
+	}
+	for (act = first; act; act = next) {
+		String cmd(**srv->command);
+
+		next = (ControlEntry*)act->Link.Next;
+		cmd = cmd + String(Int(act->Control));
+		observeMetric(extMetrics.Dispatch, act->Queued);
+		if (srv->batch) {
+			for (; next; next = (ControlEntry*)next->Link.Next) {
+				cmd = cmd + " " + String(Int(next->Control));
+				observeMetric(extMetrics.Dispatch, next->Queued);
+			}
+		}
+		Tcl_EvalObjEx(srv->ip, cmd, TCL_EVAL_DIRECT|TCL_EVAL_GLOBAL);
+	}
+	for (act = first; act; act = next) {
+		next = (ControlEntry*)act->Link.Next;
+		if (finalState(act->Control))
+			state = finalState(act->Control);
+		observeMetric(extMetrics.Control, act->Queued);
+		_aligned_free(act);
+	}
+	if (state)
+		setState(srv, state, 0);
+	if (state == SERVICE_STOPPED)
+		consoleStopped(srv);
+	return Tcl_RestoreInterpState(srv->ip, is);
+}
+/*
+	Reports the pending state, queues the control code and marks asynchronous
+	event. Returns without waiting for the command. The pending state must be
+	reported first, otherwise it could overwrite the final state reported by
+	asynchand.
  */
-static VOID WINAPI smain(DWORD, LPTSTR *) {
-	if (sd.shd = RegisterServiceCtrlHandlerEx(sd.entry.lpServiceName, handler, NULL)) {
-		sd.state.dwCheckPoint = sd.state.dwWaitHint = 0;
-		sd.state.dwCurrentState = SERVICE_RUNNING;
-		if (SetServiceStatus(sd.shd, &sd.state) ||
-			(sd.state.dwControlsAccepted & SERVICE_ACCEPT_PRESHUTDOWN && (sd.state.dwControlsAccepted &= ~SERVICE_ACCEPT_PRESHUTDOWN, SetServiceStatus(sd.shd, &sd.state))))
+#define PENDINGWAITHINT 30000
+static DWORD queueControl(VcrExtSrv *srv, DWORD type) {
+	ControlEntry *ent;
+
+	if ((ent = (ControlEntry*)_aligned_malloc(sizeof *ent, MEMORY_ALLOCATION_ALIGNMENT)) == NULL)
+		return ERROR_NOT_ENOUGH_MEMORY;
+	ent->Control = type;
+	ent->Queued = nowMicros();
+	if (pendingState(type))
+		setState(srv, pendingState(type), PENDINGWAITHINT);
+	InterlockedPushEntrySList(&srv->queue, &ent->Link);
+	EnterCriticalSection(&srv->lock);
+	if (srv->ah)
+		Tcl_AsyncMark(srv->ah);
+	LeaveCriticalSection(&srv->lock);
+	return NO_ERROR;
+}
+/*
+	Service event handler. The service object has been passed as context
+	during registration.
+ */
+static DWORD WINAPI handler(DWORD type, DWORD, LPVOID, LPVOID context) {
+	if (type == SERVICE_CONTROL_INTERROGATE) {
+		return NO_ERROR;
+	}
+	return queueControl((VcrExtSrv*)context, type);
+}
+/*
+	Console control handler, used in console mode. Maps console events to
+	the service control codes and queues them for all services accepting
+	them. Since the process will be terminated when the handler returns
+	for close and shutdown events, the handler waits until the commands
+	have stopped the services in these cases, but max. CONSOLEWAIT ms.
+	Events not accepted by any service get the default handling.
+	The stop events are duplicated under the lock, since a service can be
+	deleted and its handles closed while the handler waits.
+ */
+#define CONSOLEWAIT 4500
+static BOOL WINAPI console(DWORD event) {
+	bool wait = event == CTRL_CLOSE_EVENT || event == CTRL_SHUTDOWN_EVENT;
+	std::vector<HANDLE> stopped;
+	bool queued = false;
+	Tcl_HashSearch search;
+	Tcl_HashEntry *ent;
+
+	if (event != CTRL_C_EVENT && event != CTRL_BREAK_EVENT && event != CTRL_CLOSE_EVENT && event != CTRL_SHUTDOWN_EVENT)
+		return FALSE;
+	EnterCriticalSection(&sd.lock);
+	for (ent = Tcl_FirstHashEntry(&sd.services, &search); ent; ent = Tcl_NextHashEntry(&search)) {
+		VcrExtSrv *srv = (VcrExtSrv*)Tcl_GetHashValue(ent);
+		DWORD type, accept;
+
+		if (event != CTRL_SHUTDOWN_EVENT)
+			type = SERVICE_CONTROL_STOP, accept = SERVICE_ACCEPT_STOP;
+		else if (srv->state.dwControlsAccepted & SERVICE_ACCEPT_PRESHUTDOWN)
+			type = SERVICE_CONTROL_PRESHUTDOWN, accept = SERVICE_ACCEPT_PRESHUTDOWN;
+		else
+			type = SERVICE_CONTROL_SHUTDOWN, accept = SERVICE_ACCEPT_SHUTDOWN;
+		if ((srv->state.dwControlsAccepted & accept) && srv->ip && queueControl(srv, type) == NO_ERROR) {
+			HANDLE hd;
+
+			queued = true;
+			if (wait && DuplicateHandle(GetCurrentProcess(), srv->stopped, GetCurrentProcess(), &hd, SYNCHRONIZE, FALSE, 0))
+				stopped.push_back(hd);
+		}
+	}
+	LeaveCriticalSection(&sd.lock);
+	if (!queued)
+		return FALSE;
+	if (wait) {
+		ULONGLONG end = GetTickCount64() + CONSOLEWAIT;
+
+		for (size_t i = 0; i < stopped.size(); i++) {
+			ULONGLONG now = GetTickCount64();
+
+			WaitForSingleObject(stopped[i], now < end ? (DWORD)(end - now) : 0);
+			CloseHandle(stopped[i]);
+		}
+	}
+	return TRUE;
+}
+/*
+	Waits until the service has been stopped. Progress updates set by
+	serviceprogress will be reported here, to avoid blocking the interpreter
+	thread. The dispatcher returns after all service main functions returned.
+ */
+static void waitService(VcrExtSrv *srv) {
+	HANDLE hds[2] = { srv->stopped, srv->progress };
+
+	while (WaitForMultipleObjects(2, hds, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+		EnterCriticalSection(&srv->lock);
+		if (srv->shd)
+			SetServiceStatus(srv->shd, &srv->state);
+		LeaveCriticalSection(&srv->lock);
+	}
+}
+/*
+	Service main function, invoked by the service control manager in a new
+	thread for each service. The service will be looked up by its name,
+	passed as first argument.
+ */
+static VOID WINAPI smain(DWORD argc, LPTSTR *argv) {
+	VcrExtSrv *srv = NULL;
+
+	EnterCriticalSection(&sd.lock);
+	for (SERVICE_TABLE_ENTRY *act = sd.table; srv == NULL && act->lpServiceName; act++) {
+		if (argc == 0 || wcscmp(argv[0], act->lpServiceName) == 0) {
+			char *name = new char[wcslen(act->lpServiceName) * 3 + 1];
+
+			wcstombs(name, act->lpServiceName, wcslen(act->lpServiceName) * 3 + 1);
+			srv = findService(name);
+			delete [] name;
+		}
+	}
+	LeaveCriticalSection(&sd.lock);
+	if (srv && (srv->shd = RegisterServiceCtrlHandlerEx(srv->wname, handler, srv))) {
+		srv->state.dwCheckPoint = srv->state.dwWaitHint = 0;
+		srv->state.dwCurrentState = SERVICE_RUNNING;
+		if (SetServiceStatus(srv->shd, &srv->state) ||
+			(srv->state.dwControlsAccepted & SERVICE_ACCEPT_PRESHUTDOWN && (srv->state.dwControlsAccepted &= ~SERVICE_ACCEPT_PRESHUTDOWN, SetServiceStatus(srv->shd, &srv->state))))
+			waitService(srv);
+	}
+}
+/*
+	Service thread, used to avoid blocking of main thread while service
+	is running. Passes all services served so far to the service control
+	dispatcher. If the program has not been started by the service control
+	manager, the services will be served in console mode.
+ */
+static DWORD WINAPI thmain(LPVOID) {
+	Tcl_HashSearch search;
+	Tcl_HashEntry *ent;
+	int i = 0;
+
+	EnterCriticalSection(&sd.lock);
+	sd.table = new SERVICE_TABLE_ENTRY[sd.services.numEntries + 1];
+	for (ent = Tcl_FirstHashEntry(&sd.services, &search); ent; ent = Tcl_NextHashEntry(&search), i++) {
+		VcrExtSrv *srv = (VcrExtSrv*)Tcl_GetHashValue(ent);
+
+		if (sd.services.numEntries > 1)
+			srv->state.dwServiceType = SERVICE_WIN32_SHARE_PROCESS;
+		sd.table[i].lpServiceName = srv->wname;
+		sd.table[i].lpServiceProc = smain;
+	}
+	sd.table[i].lpServiceName = NULL;
+	sd.table[i].lpServiceProc = NULL;
+	sd.mode = VcrExtDispatcher::Scm;
+	LeaveCriticalSection(&sd.lock);
+	if (!StartServiceCtrlDispatcher(sd.table)) {
+		sd.error = GetLastError();
+		if (sd.error == ERROR_FAILED_SERVICE_CONTROLLER_CONNECT && SetConsoleCtrlHandler(console, TRUE)) {
+			EnterCriticalSection(&sd.lock);
+			sd.mode = VcrExtDispatcher::Console;
+			// A signal left over from the end of the previous console mode
+			ResetEvent(sd.ehd);
+			for (ent = Tcl_FirstHashEntry(&sd.services, &search); ent; ent = Tcl_NextHashEntry(&search))
+				((VcrExtSrv*)Tcl_GetHashValue(ent))->state.dwCurrentState = SERVICE_RUNNING;
+			LeaveCriticalSection(&sd.lock);
 			WaitForSingleObject(sd.ehd, INFINITE);
+			SetConsoleCtrlHandler(console, FALSE);
+		}
 	}
+	EnterCriticalSection(&sd.lock);
+	// The services are not served any longer
+	while ((ent = Tcl_FirstHashEntry(&sd.services, &search)) != NULL)
+		retireService((VcrExtSrv*)Tcl_GetHashValue(ent));
+	delete [] sd.table;
+	sd.table = NULL;
+	sd.mode = VcrExtDispatcher::Idle;
+	LeaveCriticalSection(&sd.lock);
+	return 0;
 }
 /*
 	Command serve
 	Syntax:
-		serve name bitmask command
+		serve ?-batch? ?-defer? name bitmask command
 	Function:
 		Enter service. name is the service name or the service to
 		be invoked. bitmask specifies which service events will be
 		created. Each time a service will be requested, command
-		will be invoked with the type flag as its parameter.
+		will be invoked with the type flag as its parameter. With
+		option -batch, all type flags queued while command was busy
+		will be passed to one command invocation. If the program has
+		not been started by the service control manager, console
+		events will be mapped to the corresponding type flags.
+		Several services can be served, each by its own interpreter.
+		All services must be known when the service control dispatcher
+		starts, therefore option -defer only registers the service, the
+		dispatcher will be started by the next serve without -defer.
+		A stopped service can be served again.
 	Returns:
 		0: OK
-		1: Service is just running
+		1: Service is just running or dispatcher is just running
 		2: Not enough memory
 		other: Win32 error code
  */
-DECLARE(serve, 3, "name bitmask command") {
-	ARG(String, name, 1);
-	ARG(Int, mask, 2);
-	ARG(String, cmd, 3);
+DECLARE(serve, -1, "?-batch? ?-defer? name bitmask command") {
 	RES(Int, res);
+	bool batch = false, defer = false;
+	int i;
+
+	for (i = 1; i < cnt - 3; i++) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-batch") == 0)
+			batch = true;
+		else if (strcmp(opt, "-defer") == 0)
+			defer = true;
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-batch, -defer)");
+	}
+	if (cnt < 4) {
+		Tcl_WrongNumArgs(ip, 1, objs, "?-batch? ?-defer? name bitmask command");
+		return TCL_ERROR;
+	}
+	ARG(String, name, cnt - 3);
+	ARG(Int, mask, cnt - 2);
+	ARG(String, cmd, cnt - 1);
 
 	if (mask & ~(SERVICE_ACCEPT_STOP|SERVICE_ACCEPT_PAUSE_CONTINUE|SERVICE_ACCEPT_SHUTDOWN|SERVICE_ACCEPT_PRESHUTDOWN))
 		throw ValueException(ValueException::ValueExceptionLimit, "Invalid bit mask value");
 	res = 1;
-	if (sd.entry.lpServiceName == NULL) {
-		sd.command = new String(cmd + " ");
-		if (sd.entry.lpServiceName = new wchar_t[strlen(name) + 1]) {
-			mbstowcs(sd.entry.lpServiceName, name, strlen(name) + 1);
-			sd.entry.lpServiceProc = smain;
-			sd.state.dwControlsAccepted = mask;
-			if (sd.ehd = CreateEvent(NULL, FALSE,FALSE, NULL)) {
-				if (sd.thd = CreateEvent(NULL, FALSE,FALSE, NULL)) {
-					HANDLE thd;
-					sd.ip = ip;
-					if (thd = CreateThread(NULL, 0, thmain, NULL, 0, NULL)) {
-						CloseHandle(thd);
-						res = 0;
-					}
+	EnterCriticalSection(&sd.lock);
+	if (!sd.initialized) {
+		Tcl_InitHashTable(&sd.services, TCL_STRING_KEYS);
+		sd.ehd = CreateEvent(NULL, FALSE,FALSE, NULL);
+		sd.initialized = true;
+	}
+	reapServices(getServices(ip));
+	if (findService(name) == NULL && (sd.mode == VcrExtDispatcher::Idle || sd.mode == VcrExtDispatcher::Console)) {
+		VcrExtSrv *srv = newService(name, mask, cmd, batch);
+		int isnew;
+
+		if (srv->stopped && srv->progress && sd.ehd) {
+			srv->ip = ip;
+			// The asynchronous handler must be created in the thread of the interpreter
+			srv->ah = Tcl_AsyncCreate(asynchand, srv);
+			Tcl_SetHashValue(Tcl_CreateHashEntry(&sd.services, srv->name, &isnew), srv);
+			getServices(ip)->push_back(srv);
+			if (sd.mode == VcrExtDispatcher::Console) {
+				srv->state.dwCurrentState = SERVICE_RUNNING;
+				res = 0;
+			}
+			else if (defer)
+				res = 0;
+			else {
+				HANDLE thd;
+
+				sd.mode = VcrExtDispatcher::Starting;
+				if (thd = CreateThread(NULL, 0, thmain, NULL, 0, NULL)) {
+					CloseHandle(thd);
+					res = 0;
 				}
+				else
+					sd.mode = VcrExtDispatcher::Idle;
 			}
-			if (res == 1) {
-				res = GetLastError();
-				delete [] sd.entry.lpServiceName;
-				if (sd.ehd)
-					CloseHandle(sd.ehd), sd.ehd = NULL;
-				if (sd.thd)
-					CloseHandle(sd.thd), sd.thd = NULL;
+		}
+		if (res == 1) {
+			res = GetLastError();
+			if (srv->ip) {
+				std::vector<VcrExtSrv*> *list = getServices(ip);
+
+				list->pop_back();
+				Tcl_DeleteHashEntry(Tcl_FindHashEntry(&sd.services, srv->name));
+				Tcl_AsyncDelete(srv->ah);
 			}
+			freeService(srv);
 		}
-		else
-			res = 2;
 	}
+	LeaveCriticalSection(&sd.lock);
 }
 FINISH
+/*
+	Command serviceprogress
+	Syntax:
+		serviceprogress checkpoint waithint ?name?
+	Function:
+		Sets check point and wait hint (in milliseconds) of the state of
+		service name, default is the first service served by the
+		interpreter. The service control manager will be informed by the
+		service thread, the command doesn't wait for it.
+	Returns:
+		0: OK
+		1: No service running
+ */
+DECLARE(serviceprogress, -1, "checkpoint waithint ?name?") {
+	RES(Int, res);
+	VcrExtSrv *srv = NULL;
+
+	if (cnt != 3 && cnt != 4) {
+		Tcl_WrongNumArgs(ip, 1, objs, "checkpoint waithint ?name?");
+		return TCL_ERROR;
+	}
+	ARG(Int, checkpoint, 1);
+	ARG(Int, waithint, 2);
+	std::vector<VcrExtSrv*> *list = getServices(ip);
+
+	if (checkpoint < 0 || waithint < 0)
+		throw ValueException(ValueException::ValueExceptionLimit, "Value out of range");
+	for (size_t i = 0; srv == NULL && i < list->size(); i++) {
+		if (cnt == 3 || strcmp((*list)[i]->name, String(objs[3])) == 0)
+			srv = (*list)[i];
+	}
+	if (srv == NULL)
+		res = 1;
+	else {
+		EnterCriticalSection(&srv->lock);
+		srv->state.dwCheckPoint = (int)checkpoint;
+		srv->state.dwWaitHint = (int)waithint;
+		LeaveCriticalSection(&srv->lock);
+		SetEvent(srv->progress);
+		res = 0;
+	}
+}
+FINISH
+/*
+	Returns the result of execsuspended: List of handles or WIN32 error code
+ */
+static Tcl_Obj *spawnResult(DWORD rc, const PROCESS_INFORMATION &pi, HANDLE jhd) {
+	Tcl_Obj *res[3];
+
+	if (rc)
+		return Tcl_NewIntObj(rc);
+	res[0] = Tcl_NewWideIntObj((Tcl_WideInt)pi.hProcess);
+	res[1] = Tcl_NewWideIntObj((Tcl_WideInt)pi.hThread);
+	res[2] = Tcl_NewWideIntObj((Tcl_WideInt)jhd);
+	return Tcl_NewListObj(jhd ? 3 : 2, res);
+}
+/*
+	Job for execsuspended -async
+ */
+class SpawnJob : public AsyncJob {
+	std::vector<char> CmdLine;
+	bool Job;
+	SchedParams Sched;
+	JobLimits Limits;
+	DWORD Heartbeat;
+	WatchOwner *Owner;
+	DWORD Error;
+	PROCESS_INFORMATION Pi;
+	HANDLE Jhd;
+public:
+	SpawnJob(Tcl_Interp *ip, Tcl_Obj *callback, const char *cl, bool job, const SchedParams &sp, const JobLimits &jl, DWORD heartbeat) : AsyncJob(ip, callback), CmdLine(cl, cl + strlen(cl) + 1), Sched(sp), Limits(jl) {
+		Job = job;
+		Heartbeat = heartbeat;
+		Owner = heartbeat ? watchOwner(ip) : NULL;
+		Error = 0;
+		Jhd = NULL;
+	}
+	void run() {
+		Error = spawnProcess(&CmdLine[0], Job, Sched, Limits, Pi, Jhd, Heartbeat, Owner);
+	}
+	Tcl_Obj *result() {
+		return spawnResult(Error, Pi, Jhd);
+	}
+};
 /*
 	Command execsuspended
 	Syntax:
-		execsuspended command
+		execsuspended ?-job? ?-affinity cpulist? ?-nice n? ?-policy policy? ?-ioprio class? ?-maxmemory bytes? ?-jobmemory bytes? ?-cputime s? ?-cpurate percent? ?-maxprocs n? ?-heartbeat ms? ?-async callback? command
 	Function:
 		Creates a new process which starts in suspended state, command
-		is the command line.
+		is the command line. With option -job, the process will be
+		created in a new process group and assigned to a new job object
+		before it starts. All processes created by the process will belong
+		to the job as well. The options -affinity, -nice, -policy and
+		-ioprio will be applied before the process starts, see setsched.
+		The options -maxmemory (committed bytes per process), -jobmemory
+		(committed bytes of the job), -cputime (user seconds per process),
+		-cpurate (percent of all processors) and -maxprocs (active
+		processes) set limits of the job and imply -job.
+		With option -heartbeat, the process will be watched by the
+		heartbeat watchdog with a timeout of ms milliseconds, see watchdog.
+		With option -async, the process will be created by a worker thread
+		and callback will be invoked with the result appended.
 	Returns:
-		List containig process and thread handle, if successful. Otherwise
-		WIN32 error code.
- */
-DECLARE(execsuspended, 1, "command") {
-	ARG(String, s1, 1);
-	RES(String, res);
-	STARTUPINFOA si;
-	PROCESS_INFORMATION pi;
-	char *cl = new char[strlen(s1) + 1];
-
-	strcpy(cl, s1);
-	memset(&si, 0, sizeof si);
-	memset(&pi, 0, sizeof pi);
-	si.cb = sizeof si;
-	// si.lpDesktop = "WinSta0";
-	pi.dwThreadId = CreateProcessA(NULL, cl, NULL, NULL, False, CREATE_SUSPENDED, NULL, NULL, &si, &pi);
-	delete [] cl;
-	if (!pi.dwThreadId)
-		res = String(Int(GetLastError()));
-	else
-		res = String(PtrValue((Tcl_WideInt) pi.hProcess)) + " " + String(PtrValue((Tcl_WideInt)pi.hThread));
+		List containig process and thread handle and, with option -job,
+		the job handle, if successful. Otherwise WIN32 error code. Nothing
+		with option -async.
+ */
+DECLARE(execsuspended, -1, "?-job? ?-affinity cpulist? ?-nice n? ?-policy policy? ?-ioprio class? ?-maxmemory bytes? ?-jobmemory bytes? ?-cputime s? ?-cpurate percent? ?-maxprocs n? ?-heartbeat ms? ?-async callback? command") {
+	Tcl_Obj *callback = NULL;
+	SchedParams sp;
+	JobLimits jl;
+	int heartbeat = 0;
+	bool job = false;
+	int i;
+
+	if (cnt < 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "?-job? ?-affinity cpulist? ?-nice n? ?-policy policy? ?-ioprio class? ?-maxmemory bytes? ?-jobmemory bytes? ?-cputime s? ?-cpurate percent? ?-maxprocs n? ?-heartbeat ms? ?-async callback? command");
+		return TCL_ERROR;
+	}
+	for (i = 1; i < cnt - 1; ) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-job") == 0)
+			job = true, i++;
+		else if (strcmp(opt, "-heartbeat") == 0 && i + 1 < cnt - 1) {
+			if ((heartbeat = Int(objs[i + 1])) <= 0)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (heartbeat > 0)");
+			i += 2;
+		}
+		else if (!schedOption(i, cnt - 1, objs, sp) && !limitOption(i, cnt - 1, objs, jl) && (callback = asyncOption(i, cnt - 1, objs)) == NULL)
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-job, -affinity, -nice, -policy, -ioprio, -maxmemory, -jobmemory, -cputime, -cpurate, -maxprocs, -heartbeat, -async)");
+	}
+	ARG(String, s1, cnt - 1);
+
+	if (callback) {
+		SpawnJob *sj = new SpawnJob(ip, callback, s1, job, sp, jl, heartbeat);
+
+		if (!submitJob(sj)) {
+			delete sj;
+			throw ValueException(ValueException::ValueExceptionLimit, "Worker pool not available");
+		}
+	}
+	else {
+		std::vector<char> cl((const char*)s1, (const char*)s1 + strlen(s1) + 1);
+		PROCESS_INFORMATION pi;
+		HANDLE jhd;
+		DWORD rc = spawnProcess(&cl[0], job, sp, jl, pi, jhd, heartbeat, heartbeat ? watchOwner(ip) : NULL);
+
+		Tcl_SetObjResult(ip, spawnResult(rc, pi, jhd));
+	}
 }
 FINISH
 /*
@@ -401,41 +1245,356 @@ DECLARE(terminate, 2, "handle exitcode") {
 	ARG(Int, s2, 2);
 	RES(Int, res);
 	
-	if (TerminateProcess((HANDLE)(Tcl_WideInt)s1, s2))
+	if (TerminateProcess((HANDLE)(Tcl_WideInt)s1, s2)) {
+		countMetric(extMetrics.Killed);
+		res = 0;
+	}
+	else
+		res = GetLastError();
+}
+FINISH
+/*
+	Command event
+	Syntax:
+		event create ?-manual? ?-signalled? ?name?
+		event set|reset|pulse handle
+	Function:
+		create creates an event or opens the existing event with name name.
+		Without name, the event can be used within the process only. The
+		event will be reset automatically when a wait has been satisfied,
+		with option -manual only by reset. With option -signalled, a new
+		event will be created in signalled state. set, reset and pulse
+		change the state of the event with handle handle. pulse is
+		unreliable, see PulseEvent, it is provided for existing peers only.
+		The handle can be used by wait and must be closed by close.
+	Returns:
+		create: Event handle, in error case -WIN32 error code
+		set, reset, pulse: 0 on success, otherwise WIN32 error code
+ */
+DECLARE(event, -1, "create|set|reset|pulse ?arg ...?") {
+	if (cnt < 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "create|set|reset|pulse ?arg ...?");
+		return TCL_ERROR;
+	}
+	ARG(String, option, 1);
+
+	if (strcmp(option, "create") == 0) {
+		bool manual = false, signalled = false;
+		const char *name = NULL;
+		HANDLE hd;
+		int i;
+
+		for (i = 2; i < cnt; i++) {
+			String opt(objs[i]);
+
+			if (strcmp(opt, "-manual") == 0)
+				manual = true;
+			else if (strcmp(opt, "-signalled") == 0)
+				signalled = true;
+			else if (i == cnt - 1)
+				name = Tcl_GetString(objs[i]);
+			else
+				throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-manual, -signalled)");
+		}
+		if ((hd = CreateEventA(NULL, manual, signalled, name)) == NULL)
+			Tcl_SetObjResult(ip, Tcl_NewWideIntObj(-(Tcl_WideInt)GetLastError()));
+		else
+			Tcl_SetObjResult(ip, Tcl_NewWideIntObj((Tcl_WideInt)hd));
+	}
+	else if (cnt == 3 && (strcmp(option, "set") == 0 || strcmp(option, "reset") == 0 || strcmp(option, "pulse") == 0)) {
+		ARG(PtrValue, s1, 2);
+		HANDLE hd = (HANDLE)(Tcl_WideInt)s1;
+		BOOL ok = strcmp(option, "set") == 0 ? SetEvent(hd) : strcmp(option, "reset") == 0 ? ResetEvent(hd) : PulseEvent(hd);
+
+		Tcl_SetObjResult(ip, Tcl_NewWideIntObj(ok ? 0 : GetLastError()));
+	}
+	else
+		throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (create, set, reset, pulse)");
+}
+FINISH
+/*
+	Job object freeze information, not declared in winnt.h
+ */
+struct JobFreezeInfo {
+	ULONG Flags;					// Bit 0: Freeze operation
+	BOOLEAN Freeze, Swap;
+	UCHAR Reserved[2];
+	ULONG HighEdgeFilter, LowEdgeFilter;
+};
+#define JobObjectFreezeInformation ((JOBOBJECTINFOCLASS)18)
+typedef LONG (WINAPI *NtSuspendResumeProc)(HANDLE);
+
+/*
+	Freezes or thaws all processes of a job. If the system doesn't support
+	freezing the job as a whole, all processes of the job will be suspended
+	or resumed one by one. In that case, processes created in the job
+	meanwhile will not be frozen. A process id will only be used if the process still
+	belongs to the job, it may have been reused otherwise. If a process
+	cannot be suspended, the processes suspended before will be resumed.
+	Thawing resumes as many processes as possible.
+	Returns 0 on success, WIN32 error code (the first one) otherwise
+ */
+static DWORD freezeJob(HANDLE job, bool freeze) {
+	JobFreezeInfo fi;
+
+	memset(&fi, 0, sizeof fi);
+	fi.Flags = 1;
+	fi.Freeze = freeze;
+	if (SetInformationJobObject(job, JobObjectFreezeInformation, &fi, sizeof fi))
+		return 0;
+
+	HMODULE ntdll = GetModuleHandleA("ntdll.dll");
+	NtSuspendResumeProc suspend = (NtSuspendResumeProc)GetProcAddress(ntdll, "NtSuspendProcess");
+	NtSuspendResumeProc resume = (NtSuspendResumeProc)GetProcAddress(ntdll, "NtResumeProcess");
+	DWORD size = 256, rc = 0, i;
+	JOBOBJECT_BASIC_PROCESS_ID_LIST *list = NULL;
+	std::vector<HANDLE> done;
+
+	if (suspend == NULL || resume == NULL)
+		return GetLastError();
+	do {
+		delete [] (char*)list;
+		list = (JOBOBJECT_BASIC_PROCESS_ID_LIST*) new char[size *= 2];
+		if (QueryInformationJobObject(job, JobObjectBasicProcessIdList, list, size, NULL))
+			rc = list->NumberOfProcessIdsInList < list->NumberOfAssignedProcesses ? ERROR_MORE_DATA : 0;
+		else
+			rc = GetLastError();
+	} while (rc == ERROR_MORE_DATA);
+	if (rc) {
+		delete [] (char*)list;
+		return rc;
+	}
+	for (i = 0; (rc == 0 || !freeze) && i < list->NumberOfProcessIdsInList; i++) {
+		HANDLE hd = OpenProcess(PROCESS_SUSPEND_RESUME | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)list->ProcessIdList[i]);
+		BOOL in = FALSE;
+
+		if (hd == NULL) {
+			// ERROR_INVALID_PARAMETER: The process has exited meanwhile
+			if (GetLastError() != ERROR_INVALID_PARAMETER && rc == 0)
+				rc = GetLastError();
+			continue;
+		}
+		if (!IsProcessInJob(hd, job, &in)) {
+			if (rc == 0)
+				rc = GetLastError();
+			CloseHandle(hd);
+			continue;
+		}
+		// The process id has been reused by a process outside of the job
+		if (!in) {
+			CloseHandle(hd);
+			continue;
+		}
+		if ((freeze ? suspend : resume)(hd) < 0) {
+			if (rc == 0)
+				rc = ERROR_ACCESS_DENIED;
+			CloseHandle(hd);
+		}
+		else
+			done.push_back(hd);
+	}
+	// A half frozen job will be thawed again
+	for (i = 0; i < done.size(); i++) {
+		if (freeze && rc)
+			resume(done[i]);
+		CloseHandle(done[i]);
+	}
+	delete [] (char*)list;
+	return rc;
+}
+/*
+	Command killgroup
+	Syntax:
+		killgroup jhandle exitcode
+	Function:
+		Terminates all processes of the job specified by jhandle, the job
+		handle returned by execsuspended -job. exitcode is the exit code
+		to be used.
+	Returns:
+		0: OK
+		other: WIN32 error code
+ */
+DECLARE(killgroup, 2, "jobhandle exitcode") {
+	ARG(PtrValue, s1, 1);
+	ARG(Int, s2, 2);
+	RES(Int, res);
+
+	if (TerminateJobObject((HANDLE)(Tcl_WideInt)s1, s2))
 		res = 0;
 	else
 		res = GetLastError();
 }
 FINISH
+/*
+	Command freezegroup
+	Syntax:
+		freezegroup jhandle
+	Function:
+		Suspends all processes of the job specified by jhandle, the job
+		handle returned by execsuspended -job.
+	Returns:
+		0: OK
+		other: WIN32 error code
+ */
+DECLARE(freezegroup, 1, "jobhandle") {
+	ARG(PtrValue, s1, 1);
+	RES(Int, res);
+
+	res = (int)freezeJob((HANDLE)(Tcl_WideInt)s1, true);
+}
+FINISH
+/*
+	Command thawgroup
+	Syntax:
+		thawgroup jhandle
+	Function:
+		Resumes all processes of the job specified by jhandle, previously
+		suspended by freezegroup.
+	Returns:
+		0: OK
+		other: WIN32 error code
+ */
+DECLARE(thawgroup, 1, "jobhandle") {
+	ARG(PtrValue, s1, 1);
+	RES(Int, res);
+
+	res = (int)freezeJob((HANDLE)(Tcl_WideInt)s1, false);
+}
+FINISH
+/*
+	Job for wait -async. Waits via the system thread pool, no worker thread
+	will be blocked.
+ */
+class WaitJob : public AsyncJob {
+	HandleWaiter Waiter;
+	HANDLE Wait;
+	DWORD Error;
+	ULONGLONG Started;
+	static VOID CALLBACK done(PVOID arg, BOOLEAN timeout) {
+		if (timeout)
+			((WaitJob*)arg)->Error = WAIT_TIMEOUT;
+		observeMetric(extMetrics.Wait, ((WaitJob*)arg)->Started);
+		((WaitJob*)arg)->complete();
+	}
+public:
+	WaitJob(Tcl_Interp *ip, Tcl_Obj *callback) : AsyncJob(ip, callback) {
+		Wait = NULL;
+		Error = 0;
+	}
+	~WaitJob() {
+		// INVALID_HANDLE_VALUE: Wait until done() has been finished
+		if (Wait)
+			UnregisterWaitEx(Wait, INVALID_HANDLE_VALUE);
+	}
+	void add(HANDLE hd) {
+		Waiter.add(hd);
+	}
+	void start(DWORD timeout) {
+		Started = nowMicros();
+		if (!Waiter.start(true) || !RegisterWaitForSingleObject(&Wait, Waiter.event(), done, this, timeout, WT_EXECUTEONLYONCE)) {
+			Error = GetLastError();
+			Wait = NULL;
+			complete();
+		}
+	}
+	Tcl_Obj *result() {
+		for (size_t i = 0; i < Waiter.size(); i++) {
+			if (Waiter.signalled(i))
+				return Tcl_NewIntObj((int)i);
+		}
+		return Tcl_NewIntObj(-(int)Error);
+	}
+};
 /*
 	Command wait
 	Syntax:
-		wait handle
+		wait ?-async callback? ?-timeout ms? handle
 	Function:
-		Waits until process or thread has been finished, depending on
-		what kind of handle handle is.
+		Waits until process or thread has been finished or event has
+		been set, depending on what kind of handle handle is.
 		In case handle is a list of handles, wait waits until the first
 		handle has been signalled.
+		With option -async, wait returns immediately and callback will
+		be invoked with the result appended. The number of handles is
+		not limited in that case. Within a coroutine, wait without
+		option -async suspends the coroutine instead of the thread
+		(Tcl 8.6 or later). An auto-reset event satisfies its own wait
+		in that case, even if another handle will be reported, so its
+		signal will be consumed.
+		With option -timeout, wait waits max. ms milliseconds.
 	Returns:
-		< 0: -WIN32 error code
+		< 0: -WIN32 error code, -258 (WAIT_TIMEOUT) on timeout
 		other: Index of 1st handle in handle that has been signalled.
+		Nothing with option -async.
  */
-DECLARE(wait, 1, "handle") {
+DECLARE(wait, -1, "?-async callback? ?-timeout ms? handle") {
+	Tcl_Obj *callback = NULL, *cb;
+	DWORD timeout = INFINITE;
+	int arg;
+
+	for (arg = 1; arg < cnt - 1; ) {
+		if ((cb = asyncOption(arg, cnt - 1, objs)) != NULL)
+			callback = cb;
+		else if (strcmp(String(objs[arg]), "-timeout") == 0 && arg + 2 < cnt) {
+			int ms = Int(objs[arg + 1]);
+
+			if (ms < 0)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (timeout)");
+			timeout = ms;
+			arg += 2;
+		}
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-async, -timeout)");
+	}
+	if (cnt != arg + 1) {
+		Tcl_WrongNumArgs(ip, 1, objs, "?-async callback? ?-timeout ms? handle");
+		return TCL_ERROR;
+	}
+	if (callback) {
+		Tcl_Obj **hdos;
+		int count, i;
+
+		if (Tcl_ListObjGetElements(ip, objs[arg], &count, &hdos) == TCL_ERROR)
+			throw ValueException(ValueException::TypeMismatch, "No list object");
+		if (count == 0)
+			throw ValueException(ValueException::ValueExceptionLimit, "Empty handle list");
+
+		WaitJob *job = new WaitJob(ip, callback);
+
+		try {
+			for (i = 0; i < count; i++)
+				job->add((HANDLE)(Tcl_WideInt) PtrValue(*hdos[i]));
+		}
+		catch (ValueException e) {
+			delete job;
+			throw e;
+		}
+		job->start(timeout);
+		return TCL_OK;
+	}
 	RES(Int, res);
+	ULONGLONG start = nowMicros();
+
 	try {
-		ARG(PtrValue, hd, 1);
+		ARG(PtrValue, hd, arg);
 
-		if (WaitForSingleObject((HANDLE)(Tcl_WideInt)hd, INFINITE) == WAIT_FAILED)
+		switch (WaitForSingleObject((HANDLE)(Tcl_WideInt)hd, timeout)) {
+		case WAIT_FAILED:
 			res = -(int)GetLastError();
-		else
+			break;
+		case WAIT_TIMEOUT:
+			res = -WAIT_TIMEOUT;
+			break;
+		default:
 			res = 0;
+		}
 	}
 	catch (ValueException) {
 		// List has been given
 		Tcl_Obj **hdos;
 		int count;
 
-		if (Tcl_ListObjGetElements(ip, objs[1], &count, &hdos) == TCL_ERROR)
+		if (Tcl_ListObjGetElements(ip, objs[arg], &count, &hdos) == TCL_ERROR)
 			throw ValueException(ValueException::TypeMismatch, "No list object");
 		if (count >= MAXIMUM_WAIT_OBJECTS)
 			throw ValueException(ValueException::Overflow, "List too long (max. 64) entries");
@@ -450,12 +1609,16 @@ DECLARE(wait, 1, "handle") {
 			delete [] hds;
 			throw e;
 		}
-		i = WaitForMultipleObjects(count, hds, FALSE, INFINITE) & 0x7f;
+		i = WaitForMultipleObjects(count, hds, FALSE, timeout);
 		delete [] hds;
-		res = i == 0x7f ? -(int)GetLastError() : i;
+		res = i == WAIT_FAILED ? -(int)GetLastError() : i == WAIT_TIMEOUT ? -WAIT_TIMEOUT : i & 0x7f;
 	}
+	observeMetric(extMetrics.Wait, start);
 }
 FINISH
+static int waitNR(ClientData cd, Tcl_Interp *ip, int cnt, Tcl_Obj *CONST objs[]) {
+	return yieldAsync(wait, 1, cd, ip, cnt, objs);
+}
 /* 
 	Command close
 	Syntax:
@@ -511,7 +1674,8 @@ DECLARE(help, -1, "") {
 			ret += "    Syntax:\n";
 			ret += "      VCRExt::close <handle>\n";
 			ret += "    Description:\n";
-			ret += "      This command closes handles previously returned by command execsuspended.\n";
+			ret += "      This command closes handles previously returned by command execsuspended\n";
+			ret += "      or event create.\n";
 			ret += "      <handle> must be either one of the values returned by execsuspended or a\n";
 			ret += "      list of values returned by execsuspended.\n";
 			ret += "      Keep in mind: Not to close any handle returned by execsuspended prevents\n";
@@ -524,17 +1688,105 @@ DECLARE(help, -1, "") {
 			ret += "\n";
 			found = true;
 		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "event") == 0) {
+			ret += "  Command event\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::event create [-manual] [-signalled] [<name>]\n";
+			ret += "      VCRExt::event set|reset|pulse <handle>\n";
+			ret += "    Description:\n";
+			ret += "      Provides events for signalling between processes, e.g. to tell a helper\n";
+			ret += "      process started before that shutdown begins.\n";
+			ret += "      create creates a new event or opens the existing event with name\n";
+			ret += "      <name>, e.g. Local\\myapp.shutdown or Global\\myapp.shutdown. Helper\n";
+			ret += "      processes open the event with the same name. Without <name>, the event\n";
+			ret += "      can be used within the process only. The event will be reset\n";
+			ret += "      automatically whenever a wait has been satisfied, with option -manual\n";
+			ret += "      only by event reset. With option -signalled, a new event will be\n";
+			ret += "      created in signalled state.\n";
+			ret += "      set signals the event, reset resets it and pulse signals it and resets\n";
+			ret += "      it after waking the waiting threads. pulse is unreliable: A waiting\n";
+			ret += "      thread that is temporarily not waiting, e.g. while the system delivers\n";
+			ret += "      an APC to it, misses the pulse. Prefer set with an auto-reset event.\n";
+			ret += "      The handle can be used in the handle lists of wait, like process\n";
+			ret += "      handles, and must be closed by close.\n";
+			ret += "      \n";
+			ret += "      create returns the event handle or the Windows error code with negative\n";
+			ret += "      sign. set, reset and pulse return 0 on success and the Windows error\n";
+			ret += "      code otherwise.\n";
+			ret += "\n";
+			found = true;
+		}
 		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "execsuspended") == 0) {
 			ret += "  Command execsuspended\n";
 			ret += "    Syntax:\n";
-			ret += "      VCRExt::execsuspended <command>\n";
+			ret += "      VCRExt::execsuspended [-job] [-affinity <cpulist>] [-nice <n>]\n";
+			ret += "                            [-policy <policy>] [-ioprio <class>]\n";
+			ret += "                            [-maxmemory <bytes>] [-jobmemory <bytes>]\n";
+			ret += "                            [-cputime <s>] [-cpurate <percent>] [-maxprocs <n>]\n";
+			ret += "                            [-heartbeat <ms>]\n";
+			ret += "                            [-async <callback>] <command>\n";
 			ret += "    Description:\n";
 			ret += "      Creates a new process which starts in suspended state. <command>\n";
 			ret += "      specifies the command line to be executed in the native syntax, e.g\n";
 			ret += "      with \\ as file separator.\n";
+			ret += "      If option -job has been specified, the process will be created in a\n";
+			ret += "      new process group and assigned to a new job object before it starts.\n";
+			ret += "      All processes created by the new process belong to the job as well,\n";
+			ret += "      therefore killgroup, freezegroup and thawgroup can be used to handle\n";
+			ret += "      the whole process tree with one system call.\n";
+			ret += "      The options -affinity, -nice, -policy and -ioprio will be applied\n";
+			ret += "      before the process starts, see setsched for their meaning.\n";
+			ret += "      The options -maxmemory, -jobmemory, -cputime, -cpurate and -maxprocs\n";
+			ret += "      set limits of the job before the process starts and imply -job:\n";
+			ret += "        -maxmemory: Committed memory of each process in bytes\n";
+			ret += "        -jobmemory: Committed memory of all processes of the job in bytes\n";
+			ret += "        -cputime: User mode CPU time of each process in seconds\n";
+			ret += "        -cpurate: CPU rate of the job in percent of all processors\n";
+			ret += "        -maxprocs: Number of active processes of the job\n";
+			ret += "      Allocations beyond the memory limits fail, processes exceeding their\n";
+			ret += "      CPU time will be terminated, further processes beyond -maxprocs cannot\n";
+			ret += "      be created.\n";
+			ret += "      With option -heartbeat, the process will be watched by the heartbeat\n";
+			ret += "      watchdog with a timeout of <ms> milliseconds, see watchdog.\n";
+			ret += "      With option -async, the process will be created by a worker thread\n";
+			ret += "      and execsuspended returns immediately. The result will be appended\n";
+			ret += "      to <callback>, which will be evaluated by the event loop.\n";
 			ret += "      \n";
 			ret += "      Returns a list containing the process handle and the handle of the\n";
-			ret += "      thread in case of success. Otherwise the Windows error code.\n";
+			ret += "      thread in case of success. With option -job, the job handle will be\n";
+			ret += "      appended. Otherwise the Windows error code. Nothing with -async.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "freezegroup") == 0) {
+			ret += "  Command freezegroup\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::freezegroup <jobhandle>\n";
+			ret += "    Description:\n";
+			ret += "      Suspends all processes of the job specified by <jobhandle>, the job\n";
+			ret += "      handle returned by execsuspended -job. If the system cannot freeze the job\n";
+			ret += "      as a whole, the processes of the job will be suspended one by one. In that\n";
+			ret += "      case, processes created in the job meanwhile will not be frozen, and if a\n";
+			ret += "      process cannot be suspended, the processes suspended before will be\n";
+			ret += "      resumed again.\n";
+			ret += "      \n";
+			ret += "      Returns 0 on success and a WIN32 error code otherwise.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "heartbeat") == 0) {
+			ret += "  Command heartbeat\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::heartbeat\n";
+			ret += "    Description:\n";
+			ret += "      Signals the watchdog of the parent process that the calling process is\n";
+			ret += "      alive, by incrementing the counter of its heartbeat slot. The slot will\n";
+			ret += "      be opened with the first call, later calls make no system call. The\n";
+			ret += "      first call removes VCREXT_HEARTBEAT from the environment, processes\n";
+			ret += "      started later do not beat for the calling process. Processes started\n";
+			ret += "      before inherit the slot of the calling process.\n";
+			ret += "      \n";
+			ret += "      Returns the new counter value or -1 if the process is not watched.\n";
 			ret += "\n";
 			found = true;
 		}
@@ -553,10 +1805,14 @@ DECLARE(help, -1, "") {
 		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "kill") == 0) {
 			ret += "  Command kill\n";
 			ret += "    Syntax:\n";
-			ret += "      VCRExt::kill <id> <level>\n";
+			ret += "      VCRExt::kill [-async <callback>] <id> <level>\n";
+			ret += "      VCRExt::kill [-async <callback>] -top <n> -by rss|cpu -among <pattern>\n";
+			ret += "                   [-lowmemory] [<level>]\n";
 			ret += "    Description:\n";
 			ret += "      Kills the process specified by <id>. <id> must be either a process ID\n";
-			ret += "      or the name of a executable file, e.g. tclsh.exe.\n";
+			ret += "      or the name of a executable file, e.g. tclsh.exe. A name selects all\n";
+			ret += "      processes whose executable name is a prefix of it, upper and lower case\n";
+			ret += "      must match. The other commands compare names as described for stop.\n";
 			ret += "      <level> specifies how kill works. Allowed values for <level> are 0, 1\n";
 			ret += "      and 2. Depending on <level>, kill works as follows:\n";
 			ret += "        <level> = 0: Only the specified process will be killed.\n";
@@ -564,15 +1820,119 @@ DECLARE(help, -1, "") {
 			ret += "                     killed.\n";
 			ret += "        <level> = 2: The specified process and all child processes will be\n";
 			ret += "                     killed recursively.\n";
+			ret += "      Processes will be identified by process ID and start time. Therefore,\n";
+			ret += "      a process whose ID has been reused in between will not be killed.\n";
+			ret += "      With option -top, the <n> processes with the largest working set (rss)\n";
+			ret += "      or CPU time (cpu) among the processes whose executable name matches\n";
+			ret += "      the glob pattern <pattern> will be killed, depending on <level>\n";
+			ret += "      (default 0) with their children. The calling process and the system\n";
+			ret += "      processes will never be selected, not even as children.\n";
+			ret += "      With option -lowmemory, these processes will be killed once when the\n";
+			ret += "      system signals low memory. Option -async is required then, the\n";
+			ret += "      callback will be invoked after the processes have been killed. A new\n";
+			ret += "      watch replaces the pending one, -top 0 -lowmemory cancels it.\n";
+			ret += "      With option -async, the processes will be killed by a worker thread\n";
+			ret += "      and kill returns immediately. The result will be appended to\n";
+			ret += "      <callback>, which will be evaluated by the event loop.\n";
+			ret += "      \n";
+			ret += "      Returns the number of processes that have been killed, nothing with\n";
+			ret += "      option -async.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "killgroup") == 0) {
+			ret += "  Command killgroup\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::killgroup <jobhandle> <exitcode>\n";
+			ret += "    Description:\n";
+			ret += "      Terminates all processes of the job specified by <jobhandle>, the job\n";
+			ret += "      handle returned by execsuspended -job. <exitcode> is the exit code of the\n";
+			ret += "      processes to be terminated. Processes created while killgroup is running\n";
+			ret += "      belong to the job as well and will be terminated too.\n";
+			ret += "      \n";
+			ret += "      Returns 0 on success and a WIN32 error code otherwise.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "metrics") == 0) {
+			ret += "  Command metrics\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::metrics listen <path>\n";
+			ret += "      VCRExt::metrics stop\n";
+			ret += "      VCRExt::metrics text\n";
+			ret += "    Description:\n";
+			ret += "      Exposes process-wide metrics of the extension in OpenMetrics text format:\n";
+			ret += "      processes spawned, killed and reaped (exits observed by stop and supervise),\n";
+			ret += "      wait latency, service control counts, dispatch latencies (receipt to\n";
+			ret += "      invocation of the command) and durations (receipt to completion of the\n";
+			ret += "      command) and snapshot enumeration times. Durations are exposed as\n";
+			ret += "      summaries in seconds.\n";
+			ret += "      listen serves the metrics via HTTP on the Unix domain socket <path> (Windows\n";
+			ret += "      10 1803 or later), replacing a previous listener. Requests will be answered\n";
+			ret += "      by a native thread without the interpreter, therefore scraping works while\n";
+			ret += "      the interpreter is busy. stop stops the listener and removes the socket\n";
+			ret += "      file.\n";
+			ret += "      \n";
+			ret += "      listen returns 0 or a Winsock error code, text returns the metrics.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "ps") == 0) {
+			ret += "  Command ps\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::ps [-fields <fieldlist>] [-filter <pattern>]\n";
+			ret += "    Description:\n";
+			ret += "      Lists the running processes. <fieldlist> specifies the fields to be\n";
+			ret += "      returned, any combination of the following values:\n";
+			ret += "        pid:   Process ID,\n";
+			ret += "        ppid:  ID of the parent process,\n";
+			ret += "        name:  Name of the executable file,\n";
+			ret += "        rss:   Working set size in bytes,\n";
+			ret += "        cpu:   Processor time used so far in milliseconds,\n";
+			ret += "        start: Start time in milliseconds since 1970-01-01.\n";
+			ret += "      Default is all fields. If <pattern> has been specified, only processes\n";
+			ret += "      with an executable name matching the glob style <pattern> will be\n";
+			ret += "      listed (case insensitive).\n";
 			ret += "      \n";
-			ret += "      Returns the number of processes that have been killed.\n";
+			ret += "      Returns a dictionary with the specified fields as keys. Each value is\n";
+			ret += "      a list with one element per process.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "recorder") == 0) {
+			ret += "  Command recorder\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::recorder start <path> [-size <bytes>] [-interval <ms>]\n";
+			ret += "      VCRExt::recorder stop\n";
+			ret += "      VCRExt::recorder read <path> [-time <ms>]\n";
+			ret += "      VCRExt::recorder range <path>\n";
+			ret += "    Description:\n";
+			ret += "      Flight recorder of the process table: start records pid, ppid, name and\n";
+			ret += "      start time of all processes every <ms> milliseconds (default 1000) into\n";
+			ret += "      the file <path> of <bytes> bytes (default 16 MB), memory-mapped and used\n";
+			ret += "      as ring of 16 segments. Each segment starts with the whole table, the\n";
+			ret += "      following records hold only the processes created and exited since the\n";
+			ret += "      previous record and will only be written if the table has changed. The\n";
+			ret += "      oldest segment will be overwritten when the ring is full. The history of\n";
+			ret += "      an existing file with the same size will be continued. A running\n";
+			ret += "      recorder will be replaced, stop ends recording and flushes the file.\n";
+			ret += "      read reconstructs the process table at time <ms> (milliseconds since\n";
+			ret += "      1970, default: latest), range returns the recorded time range. Both can\n";
+			ret += "      be used while the file is being recorded, also by other processes.\n";
+			ret += "      \n";
+			ret += "      start returns 0 or a Windows error code. read returns a dictionary with\n";
+			ret += "      key time, the time of the last record up to <ms>, and keys pid, ppid,\n";
+			ret += "      name and start (ms since 1970), each with a list with one element per\n";
+			ret += "      process. range returns a list {first last} with the time of the oldest\n";
+			ret += "      record and of the last snapshot, or an empty list if nothing has been\n";
+			ret += "      recorded.\n";
 			ret += "\n";
 			found = true;
 		}
 		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "regservice") == 0) {
 			ret += "  Command regservice\n";
 			ret += "    Syntax:\n";
-			ret += "      VCRExt::regservice <name> <description> <command> <starttype>\n";
+			ret += "      VCRExt::regservice [-shared] <name> <description> <command> <starttype>\n";
 			ret += "    Description:\n";
 			ret += "      Registers a service with name <name> and a describing text specified\n";
 			ret += "      by <description>. The command that invokes the service will be passed\n";
@@ -583,6 +1943,8 @@ DECLARE(help, -1, "") {
 			ret += "        3: On-demand service, will be started by the service control\n";
 			ret += "           manager when a process invokes the StartService function.\n";
 			ret += "        4: Disabled service, will not be started.\n";
+			ret += "      With option -shared, the service will be registered as a service that\n";
+			ret += "      shares its process with other services, see serve.\n";
 			ret += "      \n";
 			ret += "      Returns 0 on success and the Windows error code otherwise.\n";
 			ret += "\n";
@@ -601,10 +1963,35 @@ DECLARE(help, -1, "") {
 			ret += "\n";
 			found = true;
 		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "sampler") == 0) {
+			ret += "  Command sampler\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::sampler start -targets <list> [-interval <ms>] [-capacity <n>]\n";
+			ret += "      VCRExt::sampler read\n";
+			ret += "      VCRExt::sampler stop\n";
+			ret += "    Description:\n";
+			ret += "      Samples CPU usage, working set and I/O counters of processes in a\n";
+			ret += "      native thread, without starting external tools.\n";
+			ret += "      start resolves <list> like command stop and samples the processes\n";
+			ret += "      every <ms> milliseconds (default 1000) into a ring buffer of <n> records\n";
+			ret += "      (default 4096). Samples will be dropped while the ring buffer is full.\n";
+			ret += "      Processes started later will not be sampled. A running sampler will be\n";
+			ret += "      replaced, samples not read yet are lost.\n";
+			ret += "      read drains the ring buffer. stop ends sampling, the remaining samples\n";
+			ret += "      can still be read.\n";
+			ret += "      \n";
+			ret += "      start returns the number of sampled processes. read returns a dictionary\n";
+			ret += "      with one list per column: time (ms since 1970), pid, cpu (percent of one\n";
+			ret += "      processor since the previous sample), rss (working set in bytes), read\n";
+			ret += "      and write (bytes transferred), and under key dropped the number of\n";
+			ret += "      samples dropped since the previous read. stop returns nothing.\n";
+			ret += "\n";
+			found = true;
+		}
 		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "serve") == 0) {
 			ret += "  Command serve\n";
 			ret += "    Syntax:\n";
-			ret += "      VCRExt::serve <name> <bitmask> <command>\n";
+			ret += "      VCRExt::serve [-batch] [-defer] <name> <bitmask> <command>\n";
 			ret += "    Description:\n";
 			ret += "      Starts the service control dispatcher in a new thread. <name>\n";
 			ret += "      specifies the name of the service as specified in regservice,\n";
@@ -624,12 +2011,209 @@ DECLARE(help, -1, "") {
 			ret += "        0x3:  The service shall be continued,\n";
 			ret += "        0x5:  The service shall stop due to system shutdown,\n";
 			ret += "        0xF:  The service shall stop due to system shutdown (prioritized).\n";
+			ret += "      Control codes will be queued and the service control manager will be\n";
+			ret += "      informed about the pending state immediately. <command> will be invoked\n";
+			ret += "      as soon as the interpreter handles asynchronous events. If option\n";
+			ret += "      -batch has been specified, all control codes queued in the meantime\n";
+			ret += "      will be appended to one invocation of <command>. The service state\n";
+			ret += "      will be set to the final state after <command> has been finished.\n";
+			ret += "      If the program has not been started by the service control manager,\n";
+			ret += "      serve runs in console mode: CTRL+C, CTRL+BREAK and closing the console\n";
+			ret += "      window will be passed as control code 0x1, system shutdown as 0x5 or\n";
+			ret += "      0xF, if accepted by <bitmask>. Events not accepted get their default\n";
+			ret += "      handling. Console mode ends when all services have been stopped.\n";
+			ret += "      One process can serve several services, each by its own interpreter.\n";
+			ret += "      Since all services must be known when the service control dispatcher\n";
+			ret += "      starts, option -defer only registers the service. The dispatcher will\n";
+			ret += "      be started by the next serve without -defer and serves all services\n";
+			ret += "      registered so far. Such services must have been registered with\n";
+			ret += "      regservice -shared. In console mode, services can be added later.\n";
+			ret += "      A stopped service can be served again, in console mode at once,\n";
+			ret += "      otherwise after the dispatcher has returned.\n";
 			ret += "      \n";
-			ret += "      Returns 0 on success, 1 if service is running, 2 if not enough memory\n";
+			ret += "      Returns 0 on success, 1 if service is running or the dispatcher has\n";
+			ret += "      already been started, 2 if not enough memory\n";
 			ret += "      is available or any WIN32 error code.\n";
 			ret += "\n";
 			found = true;
 		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "serviceprogress") == 0) {
+			ret += "  Command serviceprogress\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::serviceprogress <checkpoint> <waithint> [<name>]\n";
+			ret += "    Description:\n";
+			ret += "      Reports progress of a pending service state change to the service control\n";
+			ret += "      manager. Shall be called by the command specified in serve while a long\n";
+			ret += "      running stop, pause or continue action is being performed. <checkpoint> must\n";
+			ret += "      be incremented with each call, <waithint> is the time in milliseconds\n";
+			ret += "      until the next call or until the action will be finished.\n";
+			ret += "      The state will be reported by the service thread, serviceprogress\n";
+			ret += "      does not wait for the service control manager. <name> selects one of\n";
+			ret += "      the services served by the interpreter, default is the first one.\n";
+			ret += "      \n";
+			ret += "      Returns 0 on success and 1 if no service is running.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "setsched") == 0) {
+			ret += "  Command setsched\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::setsched <targets> [-affinity <cpulist>] [-nice <n>] [-policy <policy>] [-ioprio <class>]\n";
+			ret += "    Description:\n";
+			ret += "      Changes the scheduling parameters of running processes. <targets> is a\n";
+			ret += "      list of process IDs or names of executable files, as with stop.\n";
+			ret += "      <cpulist> is a list of processor numbers the processes may run on.\n";
+			ret += "      <n> is a nice value between -20 and 19, it will be mapped to a\n";
+			ret += "      priority class:\n";
+			ret += "        < -10: high\n";
+			ret += "        -10 ... -1: above normal\n";
+			ret += "        0: normal\n";
+			ret += "        1 ... 10: below normal\n";
+			ret += "        > 10: idle\n";
+			ret += "      Realtime priority will never be set. <policy> is one of normal, batch\n";
+			ret += "      (below normal priority) and idle, it takes precedence over -nice.\n";
+			ret += "      <class> is the I/O priority, one of verylow, low, normal and high.\n";
+			ret += "      Setting high I/O priority needs administrative privileges.\n";
+			ret += "      \n";
+			ret += "      Returns a list with one element per process, containing the process\n";
+			ret += "      ID and 0 on success or the Windows error code of the first failure.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "shutdownplan") == 0) {
+			ret += "  Command shutdownplan\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::shutdownplan <plan> [-signal <signal>] [-exitcode <exitcode>]\n";
+			ret += "    Description:\n";
+			ret += "      Stops groups of processes in dependency order, e.g. while handling the\n";
+			ret += "      prioritized shutdown notification of a service. <plan> is a dictionary with\n";
+			ret += "      one node per group. The key is the node name, the value a dictionary with\n";
+			ret += "      the following keys:\n";
+			ret += "        targets: Processes of the group, as specified for command stop,\n";
+			ret += "        grace: Deadline of the group in milliseconds, default 5000,\n";
+			ret += "        signal: Soft signal for the group, default <signal>,\n";
+			ret += "        after: List of nodes that must be finished before the group will be stopped.\n";
+			ret += "      All groups whose dependencies have been finished will be stopped in parallel,\n";
+			ret += "      each one like command stop. Therefore, the total time approaches the length of\n";
+			ret += "      the critical path of <plan>. Defaults are TERM for <signal> and 0 for\n";
+			ret += "      <exitcode>. The processes will be selected from one process snapshot, taken\n";
+			ret += "      when shutdownplan starts. Unknown nodes in after lists and cyclic\n";
+			ret += "      dependencies will be reported as errors.\n";
+			ret += "      \n";
+			ret += "      Returns a list with one element per node. Each element is a list containing\n";
+			ret += "      the node name, start and end time in milliseconds since shutdownplan started\n";
+			ret += "      and the list returned by command stop for the group.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "snapshot") == 0) {
+			ret += "  Command snapshot\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::snapshot take\n";
+			ret += "      VCRExt::snapshot diff\n";
+			ret += "      VCRExt::snapshot bench <count> [<threads>]\n";
+			ret += "    Description:\n";
+			ret += "      snapshot take stores a snapshot of the current process table.\n";
+			ret += "      snapshot diff compares the current process table with the stored\n";
+			ret += "      snapshot and stores the current process table as new snapshot.\n";
+			ret += "      Processes will be identified by process ID and start time, therefore\n";
+			ret += "      a reused process ID will be reported as exited and created process.\n";
+			ret += "      snapshot bench measures the parser of snapshot take on a synthetic\n";
+			ret += "      process table of <count> processes, using <threads> threads (1 - 8) or\n";
+			ret += "      as many as snapshot take would use. The stored snapshot remains\n";
+			ret += "      unchanged.\n";
+			ret += "      \n";
+			ret += "      snapshot take returns the number of processes in the snapshot.\n";
+			ret += "      snapshot diff returns a dictionary with the following keys:\n";
+			ret += "        created:    List of IDs of processes created since the last snapshot,\n";
+			ret += "        exited:     List of IDs of processes exited since the last snapshot,\n";
+			ret += "        reparented: List of process IDs, each followed by the ID of its\n";
+			ret += "                    parent process that exited since the last snapshot.\n";
+			ret += "      snapshot bench returns a list containing the number of threads used\n";
+			ret += "      and the parse time in microseconds.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "stop") == 0) {
+			ret += "  Command stop\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::stop <targets> [-grace <ms>] [-signal <signal>] [-exitcode <exitcode>]\n";
+			ret += "                   [-async <callback>]\n";
+			ret += "    Description:\n";
+			ret += "      Stops all processes specified by <targets> within a bounded time. <targets>\n";
+			ret += "      is a list of process IDs or names of executable files, e.g. notepad.exe.\n";
+			ret += "      A name selects the processes with exactly this executable name, ignoring\n";
+			ret += "      upper and lower case (unlike kill, which matches prefixes).\n";
+			ret += "      The soft signal <signal> will be sent to all processes at once, then stop\n";
+			ret += "      waits until all processes have been finished, but max. <ms> milliseconds.\n";
+			ret += "      Afterwards, only the remaining processes will be killed with exit code\n";
+			ret += "      <exitcode>. <signal> can be one of the following values:\n";
+			ret += "        NONE:  No soft signal, the processes shall finish by themselves,\n";
+			ret += "        CLOSE: Posts WM_CLOSE to all top-level windows of the processes,\n";
+			ret += "        BREAK: Sends CTRL+BREAK to the console process group of the processes,\n";
+			ret += "               only processes started with option -job lead their own group,\n";
+			ret += "               all other processes get CLOSE instead,\n";
+			ret += "        TERM:  CLOSE and BREAK.\n";
+			ret += "      Defaults are 5000 for <ms>, TERM for <signal> and 0 for <exitcode>.\n";
+			ret += "      With option -async, stop returns immediately and the event loop waits\n";
+			ret += "      for the processes, no thread blocks. The result will be appended to\n";
+			ret += "      <callback>, which will be evaluated by the event loop. Within a\n";
+			ret += "      coroutine, stop without -async suspends only the coroutine (Tcl 8.6\n";
+			ret += "      or later): The coroutine yields and will be resumed with the result.\n";
+			ret += "      \n";
+			ret += "      Returns a list with one element per process. Each element is a list\n";
+			ret += "      containing the process ID, the outcome and the time in milliseconds\n";
+			ret += "      until the process has been finished. The outcome is one of the following:\n";
+			ret += "        exited: The process finished within the grace period,\n";
+			ret += "        killed: The process has been killed,\n";
+			ret += "        hung:   The process has been killed, but did not finish within 1 second,\n";
+			ret += "        failed: The process could not be opened or killed.\n";
+			ret += "      Nothing with option -async.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "supervise") == 0) {
+			ret += "  Command supervise\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::supervise start <id> <command> [-restart <policy>] [-backoff <min> <max>] [-job]\n";
+			ret += "                                             [-heartbeat <ms>]\n";
+			ret += "      VCRExt::supervise stop <id> [-grace <ms>] [-signal <signal>]\n";
+			ret += "      VCRExt::supervise children\n";
+			ret += "      VCRExt::supervise configure [-intensity <n>] [-period <ms>] [-callback <callback>]\n";
+			ret += "    Description:\n";
+			ret += "      Supervises child processes without polling. supervise start starts <command> as\n";
+			ret += "      child <id>. <policy> specifies whether the child will be restarted when it exits:\n";
+			ret += "        permanent: Always (default),\n";
+			ret += "        transient: Only if the exit code is not 0,\n";
+			ret += "        temporary: Never.\n";
+			ret += "      Restarts will be delayed by <min> milliseconds, the delay doubles with each\n";
+			ret += "      restart up to <max> milliseconds (defaults 100 and 30000). The delay will be\n";
+			ret += "      reset when the child ran longer than <max> milliseconds. With option -job, the\n";
+			ret += "      child will be started in its own job object and supervise stop terminates its\n";
+			ret += "      whole process tree. With option -heartbeat, a child whose heartbeat stops for\n";
+			ret += "      <ms> milliseconds will be killed by the watchdog with exit code 258 and\n";
+			ret += "      restarted depending on <policy>, see watchdog.\n";
+			ret += "      supervise stop stops child <id> like command stop and removes it.\n";
+			ret += "      supervise configure sets the restart intensity: If more than <n> restarts occur\n";
+			ret += "      within <ms> milliseconds (defaults 10 and 60000), all children will be\n";
+			ret += "      terminated. <callback> will be invoked by the event loop with a list\n";
+			ret += "      {event id pid code} appended, event is one of exited (code is the exit code),\n";
+			ret += "      restarted (code is the number of restarts), failed (code is the WIN32 error\n";
+			ret += "      code of the failed restart) and shutdown (restart intensity exceeded).\n";
+			ret += "      Exits will be reported by the I/O completion port of the extension (the\n";
+			ret += "      system thread pool before Windows 8) and restarts handled by a timer wheel\n";
+			ret += "      in a supervisor thread, therefore the costs per event do not depend on the\n";
+			ret += "      number of children. When the interpreter will be deleted, the children keep\n";
+			ret += "      running unsupervised.\n";
+			ret += "      \n";
+			ret += "      supervise start returns the process ID or the WIN32 error code with negative\n";
+			ret += "      sign, supervise stop a list as returned by command stop (empty if the child was\n";
+			ret += "      not running), supervise children a list with one element {id state pid restarts}\n";
+			ret += "      per child (state is one of running, backoff and exited) and supervise configure\n";
+			ret += "      the current configuration.\n";
+			ret += "\n";
+			found = true;
+		}
 		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "terminate") == 0) {
 			ret += "  Command terminate\n";
 			ret += "    Syntax:\n";
@@ -643,6 +2227,43 @@ DECLARE(help, -1, "") {
 			ret += "\n";
 			found = true;
 		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "thawgroup") == 0) {
+			ret += "  Command thawgroup\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::thawgroup <jobhandle>\n";
+			ret += "    Description:\n";
+			ret += "      Resumes all processes of the job specified by <jobhandle>, previously\n";
+			ret += "      suspended by freezegroup. If the system cannot thaw the job as a whole,\n";
+			ret += "      as many processes as possible will be resumed one by one and the first\n";
+			ret += "      error will be returned.\n";
+			ret += "      \n";
+			ret += "      Returns 0 on success and a WIN32 error code otherwise.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "tree") == 0) {
+			ret += "  Command tree\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::tree <root> [-rollup <fieldlist>]\n";
+			ret += "    Description:\n";
+			ret += "      Lists the process trees of <root>, which must be either a process ID or\n";
+			ret += "      the name of an executable file, compared as described for stop. Roots\n";
+			ret += "      which are descendants of other roots will be listed once. The processes\n";
+			ret += "      belong to the same trees as with kill level 2.\n";
+			ret += "      <fieldlist> specifies values to be summed up over the subtree of each\n";
+			ret += "      process, any combination of:\n";
+			ret += "        rss: Working set in bytes\n";
+			ret += "        cpu: CPU time in milliseconds\n";
+			ret += "        count: Number of processes\n";
+			ret += "      The sums will be computed in one post-order pass over a parent/child\n";
+			ret += "      index built from one snapshot of the process table.\n";
+			ret += "      \n";
+			ret += "      Returns a list with one element {pid depth name ?sum ...?} per process,\n";
+			ret += "      each process before its descendants. depth is 0 for the roots, the sums\n";
+			ret += "      follow in the order of <fieldlist>.\n";
+			ret += "\n";
+			found = true;
+		}
 		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "unregservice") == 0) {
 			ret += "  Command unregservice\n";
 			ret += "    Syntax:\n";
@@ -679,16 +2300,55 @@ DECLARE(help, -1, "") {
 		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "wait") == 0) {
 			ret += "  Command wait\n";
 			ret += "    Syntax:\n";
-			ret += "      VCRExt::wait <handle>\n";
+			ret += "      VCRExt::wait [-async <callback>] [-timeout <ms>] <handle>\n";
 			ret += "    Description:\n";
 			ret += "      This command waits until one of the threads or processes specified by\n";
-			ret += "      <handle> has been terminated. <handle> is either one of the values\n";
-			ret += "      returned by a previously called execsuspended command or a list of\n";
-			ret += "      max. 64 values returned by several execsuspended commands.\n";
+			ret += "      <handle> has been terminated or one of the events has been set. <handle>\n";
+			ret += "      is either one of the values returned by a previously called execsuspended\n";
+			ret += "      or event create command or a list of max. 64 values returned by several\n";
+			ret += "      of these commands.\n";
+			ret += "      With option -async, wait returns immediately and the result will be\n";
+			ret += "      appended to <callback>, which will be evaluated by the event loop.\n";
+			ret += "      The number of handles is not limited in that case, no thread will be\n";
+			ret += "      blocked while waiting. Within a coroutine, wait without -async suspends\n";
+			ret += "      only the coroutine (Tcl 8.6 or later): The coroutine yields and will be\n";
+			ret += "      resumed with the result. With option -timeout, wait waits max. <ms>\n";
+			ret += "      milliseconds.\n";
+			ret += "      With -async or within a coroutine, each handle will be waited for on\n";
+			ret += "      its own. If several auto-reset events of the list have been set, all\n";
+			ret += "      of them will be reset, but only the first will be reported. Use events\n";
+			ret += "      created with -manual to wait for several events at once.\n";
 			ret += "      \n";
 			ret += "      Returns the index of the first handle of a thread or process that has\n";
 			ret += "      been terminated. In error case, the WIN32 error code will be returned\n";
-			ret += "      with negative sign.\n";
+			ret += "      with negative sign, -258 on timeout. Nothing with option -async.\n";
+			ret += "\n";
+			found = true;
+		}
+		if (((const char*)cmd)[0] == 0 || strcmp(cmd, "watchdog") == 0) {
+			ret += "  Command watchdog\n";
+			ret += "    Syntax:\n";
+			ret += "      VCRExt::watchdog configure [-callback <command>]\n";
+			ret += "      VCRExt::watchdog list\n";
+			ret += "    Description:\n";
+			ret += "      Detects hung children: Children started with execsuspended -heartbeat\n";
+			ret += "      or supervise start -heartbeat get a slot in a shared memory table. The\n";
+			ret += "      child finds the name of the table and its slot index in environment\n";
+			ret += "      variable VCREXT_HEARTBEAT (\"name,index\") and increments the 64-bit\n";
+			ret += "      counter at offset (index + 1) * 64 of the table periodically, e.g. with\n";
+			ret += "      command heartbeat. A native thread checks all counters every 50 ms with\n";
+			ret += "      one memory read per child. If a counter has not advanced within the\n";
+			ret += "      timeout, the child will be reported as hung, children of supervise\n";
+			ret += "      will be killed. The first heartbeat must arrive within 10 times the\n";
+			ret += "      timeout after the start of the child. Slots will be released when the\n";
+			ret += "      children exit.\n";
+			ret += "      configure sets <command>, which will be invoked with a list {event pid\n";
+			ret += "      slot} appended. event is one of hung, killed and recovered (heartbeat\n";
+			ret += "      resumed after hung). An empty <command> removes the callback.\n";
+			ret += "      \n";
+			ret += "      configure returns the current callback. list returns a list with one\n";
+			ret += "      element {slot pid counter state} per watched child of the interpreter,\n";
+			ret += "      state is one of waiting (no heartbeat yet), alive and hung.\n";
 			ret += "\n";
 			found = true;
 		}
@@ -705,9 +2365,14 @@ static NewCmdDesc validpidDesc("::VCRExt::validpid", validpid, NULL, NULL);
 static NewCmdDesc regserviceDesc("::VCRExt::regservice", regservice, NULL, NULL);
 static NewCmdDesc unregserviceDesc("::VCRExt::unregservice", unregservice, NULL, NULL);
 static NewCmdDesc serveDesc("::VCRExt::serve", serve, NULL, NULL);
+static NewCmdDesc serviceprogressDesc("::VCRExt::serviceprogress", serviceprogress, NULL, NULL);
 static NewCmdDesc execsuspendedDesc("::VCRExt::execsuspended", execsuspended, NULL, NULL);
 static NewCmdDesc resumeDesc("::VCRExt::resume", resume, NULL, NULL);
 static NewCmdDesc terminateDesc("::VCRExt::terminate", terminate, NULL, NULL);
-static NewCmdDesc waitDesc("::VCRExt::wait", wait, NULL, NULL);
+static NewCmdDesc eventDesc("::VCRExt::event", event, NULL, NULL);
+static NewCmdDesc killgroupDesc("::VCRExt::killgroup", killgroup, NULL, NULL);
+static NewCmdDesc freezegroupDesc("::VCRExt::freezegroup", freezegroup, NULL, NULL);
+static NewCmdDesc thawgroupDesc("::VCRExt::thawgroup", thawgroup, NULL, NULL);
+static NewCmdDesc waitDesc("::VCRExt::wait", wait, NULL, NULL, waitNR);
 static NewCmdDesc closeDesc("::VCRExt::close", close, NULL, NULL);
 static NewCmdDesc helpDesc("::VCRExt::help", help, NULL, NULL);
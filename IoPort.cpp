@@ -0,0 +1,128 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "VCRExtMain.h"
+#include "IoPort.h"
+#include "NtDefs.h"
+#include <mutex>
+
+typedef NTSTATUS (WINAPI *NtCreateWaitCompletionPacketProc)(PHANDLE, ACCESS_MASK, PVOID);
+typedef NTSTATUS (WINAPI *NtAssociateWaitCompletionPacketProc)(HANDLE, HANDLE, HANDLE, PVOID, PVOID, NTSTATUS, ULONG_PTR, PBOOLEAN);
+typedef NTSTATUS (WINAPI *NtCancelWaitCompletionPacketProc)(HANDLE, BOOLEAN);
+
+/*
+	The port and the entry points of the wait completion packet functions,
+	initialized once. The functions are exported by ntdll.dll of Windows 8
+	and later only. The port thread holds Busy exclusively while it invokes
+	completed().
+ */
+static struct IoPortState {
+	std::once_flag Once;
+	HANDLE Port, Thread;
+	SRWLOCK Busy;
+	NtCreateWaitCompletionPacketProc Create;
+	NtAssociateWaitCompletionPacketProc Associate;
+	NtCancelWaitCompletionPacketProc Cancel;
+} port;
+
+/*
+	Thread function of the port thread. Packets with key 0 are flush requests,
+	their OVERLAPPED pointer is the event to be set, or NULL to end the thread.
+ */
+static DWORD WINAPI portThread(LPVOID) {
+	for (;;) {
+		DWORD bytes;
+		ULONG_PTR key;
+		OVERLAPPED *ov;
+
+		if (!GetQueuedCompletionStatus(port.Port, &bytes, &key, &ov, INFINITE) && ov == NULL)
+			continue;
+		if (key == 0 && ov == NULL)
+			break;
+		if (key == 0)
+			SetEvent((HANDLE)ov);
+		else {
+			AcquireSRWLockExclusive(&port.Busy);
+			((PortClient*)key)->completed(bytes, ov);
+			ReleaseSRWLockExclusive(&port.Busy);
+		}
+	}
+	return 0;
+}
+static void startPort() {
+	HMODULE ntdll = GetModuleHandleA("ntdll.dll");
+
+	port.Create = (NtCreateWaitCompletionPacketProc)GetProcAddress(ntdll, "NtCreateWaitCompletionPacket");
+	port.Associate = (NtAssociateWaitCompletionPacketProc)GetProcAddress(ntdll, "NtAssociateWaitCompletionPacket");
+	port.Cancel = (NtCancelWaitCompletionPacketProc)GetProcAddress(ntdll, "NtCancelWaitCompletionPacket");
+	InitializeSRWLock(&port.Busy);
+	if ((port.Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1)) == NULL)
+		return;
+	if ((port.Thread = CreateThread(NULL, 0, portThread, NULL, 0, NULL)) == NULL) {
+		CloseHandle(port.Port);
+		port.Port = NULL;
+	}
+}
+/*
+	Unloading the extension: All waits have been cancelled by their owners,
+	the port thread ends after the packets queued before.
+ */
+static void stopPort() {
+	if (port.Port == NULL || !PostQueuedCompletionStatus(port.Port, 0, 0, NULL))
+		return;
+	WaitForSingleObject(port.Thread, INFINITE);
+	CloseHandle(port.Thread);
+	CloseHandle(port.Port);
+	port.Thread = port.Port = NULL;
+}
+static ExitDesc portExit(stopPort);
+HANDLE ioPort() {
+	std::call_once(port.Once, startPort);
+	return port.Port;
+}
+
+HANDLE portWait(HANDLE object, PortClient *client) {
+	HANDLE packet;
+
+	if (ioPort() == NULL || port.Create == NULL || port.Associate == NULL || port.Cancel == NULL)
+		return NULL;
+	if (port.Create(&packet, GENERIC_ALL, NULL) < 0)
+		return NULL;
+	if (port.Associate(packet, port.Port, object, client, NULL, 0, 0, NULL) < 0) {
+		CloseHandle(packet);
+		return NULL;
+	}
+	return packet;
+}
+void portCancel(HANDLE packet) {
+	// TRUE: Remove the packet from the port if it has been queued already
+	port.Cancel(packet, TRUE);
+	CloseHandle(packet);
+}
+void portFlush() {
+	HANDLE ev = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	if (ev == NULL || !PostQueuedCompletionStatus(port.Port, 0, 0, (OVERLAPPED*)ev)) {
+		// Without flush packet, wait at least until a running completed() call has finished
+		if (ev)
+			CloseHandle(ev);
+		AcquireSRWLockShared(&port.Busy);
+		ReleaseSRWLockShared(&port.Busy);
+		return;
+	}
+	WaitForSingleObject(ev, INFINITE);
+	CloseHandle(ev);
+}
@@ -0,0 +1,59 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef IOPORT_H
+# define IOPORT_H
+# include <windows.h>
+
+	/*
+	 * Base class of all objects that receive packets of the process-wide I/O
+	 * completion port. The address of the object is the completion key, completed()
+	 * will be invoked by the port thread and must return quickly.
+	 */
+	class PortClient {
+	public:
+		virtual void completed(DWORD bytes, OVERLAPPED *ov) = 0;
+	};
+
+	/*
+	 * Returns the process-wide I/O completion port. The port and its thread will be
+	 * created with the first call. Returns NULL if the port is not available.
+	 */
+	HANDLE ioPort();
+
+	/*
+	 * Wait completion packets (Windows 8 and later): When object will be signalled,
+	 * the port thread invokes client->completed(). Returns the packet handle or NULL
+	 * if wait completion packets are not available, callers fall back to the system
+	 * thread pool then.
+	 */
+	HANDLE portWait(HANDLE object, PortClient *client);
+
+	/*
+	 * Cancels the wait of a packet returned by portWait() and closes its handle. A
+	 * packet already queued will be removed, but completed() may be running at the
+	 * same time. Call portFlush() after cancelling to be sure it has finished.
+	 */
+	void portCancel(HANDLE packet);
+
+	/*
+	 * Waits until the port thread has handled all packets queued before. If no flush
+	 * packet can be queued, it waits only until a running completed() call has
+	 * finished, which is enough after portCancel(). Must not be called by the port
+	 * thread itself.
+	 */
+	void portFlush();
+#endif
@@ -0,0 +1,215 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+// Before any windows.h, which would include the obsolete winsock.h otherwise
+#include <winsock2.h>
+#include <afunix.h>
+#include "VCRExtMain.h"
+#include "Metrics.h"
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+
+Metrics extMetrics;
+
+static void counter(std::string &out, const char *name, const char *help, LONGLONG value) {
+	char buf[256];
+
+	sprintf(buf, "# TYPE %s counter\n# HELP %s %s\n%s_total %lld\n", name, name, help, name, value);
+	out += buf;
+}
+static void summary(std::string &out, const char *name, const char *help, const MetricSummary &s) {
+	char buf[320];
+	LONGLONG micros = s.Micros;
+
+	sprintf(buf, "# TYPE %s summary\n# UNIT %s seconds\n# HELP %s %s\n%s_count %lld\n%s_sum %lld.%06lld\n", name, name, name, help, name, s.Count, name, micros / 1000000, micros % 1000000);
+	out += buf;
+}
+std::string metricsText() {
+	std::string out;
+
+	counter(out, "vcrext_processes_spawned", "Processes created by the extension.", extMetrics.Spawned);
+	counter(out, "vcrext_processes_killed", "Processes terminated by the extension.", extMetrics.Killed);
+	counter(out, "vcrext_processes_reaped", "Exits of processes observed by stop and supervise.", extMetrics.Reaped);
+	summary(out, "vcrext_wait_seconds", "Time spent in wait until signalled or timed out.", extMetrics.Wait);
+	summary(out, "vcrext_service_dispatch_seconds", "Time between service control receipt and invocation of its command.", extMetrics.Dispatch);
+	summary(out, "vcrext_service_control_seconds", "Time between service control receipt and completion of its command.", extMetrics.Control);
+	summary(out, "vcrext_snapshot_seconds", "Time to enumerate the processes of a snapshot.", extMetrics.Snapshot);
+	out += "# EOF\n";
+	return out;
+}
+
+// Max. time in milliseconds a client may take to send its request and to accept the reply
+#define REQUESTMS 1000
+#define REPLYMS 1000
+#define CONTENTTYPE "application/openmetrics-text; version=1.0.0; charset=utf-8"
+
+/*
+	Process-wide metrics listener. Lock serializes listen and stop of
+	different interpreters, the serving thread does not use it.
+ */
+static struct MetricsListener {
+	std::mutex Lock;
+	SOCKET Socket;
+	HANDLE Thread;
+	std::string Path;
+} ml;
+
+static void sendAll(SOCKET s, const std::string &data) {
+	int n;
+
+	for (size_t done = 0; done < data.size(); done += n) {
+		if ((n = send(s, data.c_str() + done, (int)(data.size() - done), 0)) <= 0)
+			return;
+	}
+}
+/*
+	Thread function of the metrics listener. Serves one client at a time,
+	which is enough for a scraper. The request header will be read but not
+	evaluated, every request gets the metrics. Ends when the listening socket
+	has been closed.
+ */
+static DWORD WINAPI serving(LPVOID arg) {
+	SOCKET listener = (SOCKET)arg, client;
+
+	while ((client = accept(listener, NULL, NULL)) != INVALID_SOCKET) {
+		DWORD rcvms = REQUESTMS, sndms = REPLYMS;
+		std::string req;
+		char buf[1024];
+		int n;
+
+		// A stalled client must neither block other scrapers nor stopListener()
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&rcvms, sizeof rcvms);
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char*)&sndms, sizeof sndms);
+		while (req.find("\r\n\r\n") == std::string::npos && req.size() < 8192 && (n = recv(client, buf, sizeof buf, 0)) > 0)
+			req.append(buf, n);
+
+		std::string body = metricsText();
+
+		sprintf(buf, "HTTP/1.0 200 OK\r\nContent-Type: " CONTENTTYPE "\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", (unsigned)body.size());
+		sendAll(client, buf + body);
+		shutdown(client, SD_SEND);
+		closesocket(client);
+	}
+	return 0;
+}
+// Returns 0 or Winsock error code, must be called while Lock is held
+static int startListener(const char *path) {
+	WSADATA wsa;
+	SOCKADDR_UN addr;
+	SOCKET s;
+	int rc;
+
+	if (strlen(path) >= sizeof addr.sun_path)
+		return WSAENAMETOOLONG;
+	if ((rc = WSAStartup(MAKEWORD(2, 2), &wsa)) != 0)
+		return rc;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	// The socket file of a previous listener will not be removed by the system
+	DeleteFileA(path);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+		rc = WSAGetLastError();
+		WSACleanup();
+		return rc;
+	}
+	if (bind(s, (const sockaddr*)&addr, sizeof addr) != 0 || listen(s, SOMAXCONN) != 0) {
+		rc = WSAGetLastError();
+		closesocket(s);
+		WSACleanup();
+		return rc;
+	}
+	if ((ml.Thread = CreateThread(NULL, 0, serving, (LPVOID)s, 0, NULL)) == NULL) {
+		rc = GetLastError();
+		closesocket(s);
+		DeleteFileA(path);
+		WSACleanup();
+		return rc;
+	}
+	ml.Socket = s;
+	ml.Path = path;
+	return 0;
+}
+// Must be called while Lock is held
+static void stopListener() {
+	if (ml.Thread == NULL)
+		return;
+	closesocket(ml.Socket);
+	WaitForSingleObject(ml.Thread, INFINITE);
+	CloseHandle(ml.Thread);
+	ml.Thread = NULL;
+	DeleteFileA(ml.Path.c_str());
+	WSACleanup();
+}
+// Unloading the extension stops the listener
+static void stopMetrics() {
+	std::lock_guard<std::mutex> lock(ml.Lock);
+
+	stopListener();
+}
+static ExitDesc metricsExit(stopMetrics);
+
+/*
+	Command metrics
+	Syntax:
+		metrics listen path
+		metrics stop
+		metrics text
+	Function:
+		Exposes process-wide metrics of the extension in OpenMetrics text
+		format: Processes spawned, killed and reaped, wait latency, service
+		control counts, dispatch latencies and durations and snapshot
+		enumeration times.
+		listen serves the metrics via HTTP on Unix domain socket path
+		(Windows 10 1803 or later), a previous listener will be stopped.
+		The requests will be answered by a native thread, therefore
+		scraping works while the interpreter is busy and costs it nothing.
+		stop stops the listener and removes the socket file.
+	Returns:
+		listen: 0: OK, other: Winsock error code
+		stop: Nothing
+		text: The metrics
+ */
+DECLARE(metrics, -1, "listen path|stop|text") {
+	if (cnt < 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "listen path|stop|text");
+		return TCL_ERROR;
+	}
+	ARG(String, option, 1);
+
+	if (strcmp(option, "listen") == 0 && cnt == 3) {
+		ARG(String, path, 2);
+		std::lock_guard<std::mutex> lock(ml.Lock);
+
+		stopListener();
+		Tcl_SetObjResult(ip, Tcl_NewIntObj(startListener(path)));
+	}
+	else if (strcmp(option, "stop") == 0 && cnt == 2) {
+		std::lock_guard<std::mutex> lock(ml.Lock);
+
+		stopListener();
+	}
+	else if (strcmp(option, "text") == 0 && cnt == 2) {
+		std::string text = metricsText();
+
+		Tcl_SetObjResult(ip, Tcl_NewStringObj(text.c_str(), (int)text.size()));
+	}
+	else
+		throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (listen, stop, text)");
+}
+FINISH
+static NewCmdDesc metricsDesc("::VCRExt::metrics", metrics, NULL, NULL);
@@ -0,0 +1,50 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef METRICS_H
+# define METRICS_H
+# include "Waiter.h"
+# include <windows.h>
+# include <string>
+
+	// Number and total duration in microseconds of observed operations
+	struct MetricSummary {
+		volatile LONGLONG Count, Micros;
+	};
+
+	/*
+	 * Process-wide metrics of the extension. All members will be updated with
+	 * interlocked operations by any thread and read without lock by the metrics
+	 * listener thread.
+	 */
+	struct Metrics {
+		volatile LONGLONG Spawned, Killed, Reaped;
+		MetricSummary Wait, Dispatch, Control, Snapshot;
+	};
+	extern Metrics extMetrics;
+
+	inline void countMetric(volatile LONGLONG &counter) {
+		InterlockedIncrement64(&counter);
+	}
+	// Observes the time elapsed since start, a time stamp returned by nowMicros()
+	inline void observeMetric(MetricSummary &summary, ULONGLONG start) {
+		InterlockedIncrement64(&summary.Count);
+		InterlockedExchangeAdd64(&summary.Micros, (LONGLONG)(nowMicros() - start));
+	}
+
+	// Returns all metrics in OpenMetrics text format
+	std::string metricsText();
+#endif
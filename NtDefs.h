@@ -0,0 +1,29 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef NTDEFS_H
+# define NTDEFS_H
+# include <windows.h>
+
+	/*
+	 * Definitions for the functions called from ntdll.dll. windows.h does not
+	 * declare them, winternl.h and ntstatus.h conflict with it or each other.
+	 */
+	typedef LONG NTSTATUS;
+# ifndef STATUS_INFO_LENGTH_MISMATCH
+#  define STATUS_INFO_LENGTH_MISMATCH ((NTSTATUS)0xC0000004L)
+# endif
+#endif
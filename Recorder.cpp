@@ -0,0 +1,563 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "VCRExtMain.h"
+#include "Snapshot.h"
+#include <mutex>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <string.h>
+
+// Defaults for recording interval and file size
+#define DEFINTERVAL 1000
+#define DEFSIZE (16 << 20)
+
+// Geometry of the recorder file, segments are multiples of the page size
+#define HEADERSIZE 4096
+#define SEGMENTS 16
+#define MINSEGMENT 65536
+#define MAXSIZE (1 << 30)
+#define RECORDERMAGIC "VCRREC1"
+
+/*
+	Layout of the recorder file: A header of HEADERSIZE bytes, followed by
+	Segments segments of SegmentSize bytes each, used as ring. A segment
+	starts with a keyframe record holding the whole process table, followed
+	by delta records holding the processes created and exited since the
+	previous record. Records will only be written if the table has changed.
+	Sequence 0 marks a segment that is empty or being rewritten. Used will
+	be advanced after each complete record, a reader never sees a partial
+	record.
+		Record:		type ('K' or 'D'), time (8 bytes, ms since 1970), payload
+		Keyframe:	count, count * entry
+		Delta:		count, count * pid of exited process, count, count * entry
+		Entry:		pid, ppid, start (ms since 1970), name length, name (UTF-8)
+	All numbers except time are LEB128 encoded.
+ */
+struct RecorderHeader {
+	char Magic[8];
+	DWORD SegmentSize, Segments;
+	volatile ULONGLONG LastSample;		// Time of the last snapshot, ms since 1970
+};
+struct SegmentHeader {
+	volatile ULONGLONG Sequence;
+	volatile LONG Used;					// Bytes of records following the header
+	DWORD Reserved;
+};
+
+typedef std::vector<unsigned char> Buffer;
+
+static void putVarint(Buffer &buf, ULONGLONG v) {
+	for (; v >= 0x80; v >>= 7)
+		buf.push_back((unsigned char)(v | 0x80));
+	buf.push_back((unsigned char)v);
+}
+static void putRecord(Buffer &buf, char type, ULONGLONG time) {
+	buf.clear();
+	buf.push_back((unsigned char)type);
+	for (int i = 0; i < 8; i++)
+		buf.push_back((unsigned char)(time >> 8 * i));
+}
+static void putEntry(Buffer &buf, const ProcSnapshot &snap, const ProcEntry &p) {
+	const char *name = snap.name(p);
+	size_t len = strlen(name);
+
+	putVarint(buf, p.Pid);
+	putVarint(buf, p.Ppid);
+	putVarint(buf, startMillis(p.Start));
+	putVarint(buf, len);
+	buf.insert(buf.end(), name, name + len);
+}
+static ULONGLONG nowMillis() {
+	FILETIME ft;
+
+	GetSystemTimeAsFileTime(&ft);
+	return startMillis(((ULONGLONG)ft.dwHighDateTime << 32) + ft.dwLowDateTime);
+}
+static SegmentHeader *segmentAt(const char *view, ULONGLONG seq) {
+	const RecorderHeader *h = (const RecorderHeader*)view;
+
+	return (SegmentHeader*)(view + HEADERSIZE + (size_t)(seq % h->Segments) * h->SegmentSize);
+}
+
+/*
+	Process-wide recorder. Lock serializes start and stop of different
+	interpreters, the other members will be used by the recorder thread
+	only while it is running. Keyed is false until the current segment
+	has got its keyframe.
+ */
+static struct RecorderState {
+	std::mutex Lock;
+	HANDLE File, Mapping, Thread, Stop;
+	char *View;
+	DWORD Interval;
+	ULONGLONG Sequence;
+	bool Keyed;
+	ProcSnapshot Prev, Cur;
+	Buffer Record;
+} rec;
+
+// Starts the next segment with the keyframe in Record, returns false if it does not fit
+static bool newSegment() {
+	RecorderHeader *h = (RecorderHeader*)rec.View;
+	SegmentHeader *seg = segmentAt(rec.View, rec.Sequence + 1);
+
+	if (rec.Record.size() > h->SegmentSize - sizeof *seg)
+		return false;
+	seg->Sequence = 0;
+	MemoryBarrier();
+	memcpy(seg + 1, &rec.Record[0], rec.Record.size());
+	seg->Used = (LONG)rec.Record.size();
+	MemoryBarrier();
+	seg->Sequence = ++rec.Sequence;
+	return true;
+}
+/*
+	Takes one snapshot and appends the differences to the previous one to
+	the current segment. A full segment will be continued with a keyframe
+	in the next one, overwriting the oldest segment. Costs one snapshot and
+	one merge of the sorted process lists, plus a few bytes per change.
+ */
+static void sample() {
+	RecorderHeader *h = (RecorderHeader*)rec.View;
+	ULONGLONG now = nowMillis();
+	size_t i;
+
+	if (!rec.Cur.take(ProcSnapshot::Pid | ProcSnapshot::Ppid | ProcSnapshot::Name | ProcSnapshot::Start))
+		return;
+	if (rec.Keyed) {
+		ProcDiff res;
+
+		diff(rec.Prev, rec.Cur, res);
+		if (!res.Created.empty() || !res.Exited.empty()) {
+			SegmentHeader *seg = segmentAt(rec.View, rec.Sequence);
+
+			putRecord(rec.Record, 'D', now);
+			putVarint(rec.Record, res.Exited.size());
+			for (i = 0; i < res.Exited.size(); i++)
+				putVarint(rec.Record, res.Exited[i]->Pid);
+			putVarint(rec.Record, res.Created.size());
+			for (i = 0; i < res.Created.size(); i++)
+				putEntry(rec.Record, rec.Cur, *res.Created[i]);
+			if (seg->Used + rec.Record.size() <= h->SegmentSize - sizeof *seg) {
+				memcpy((char*)(seg + 1) + seg->Used, &rec.Record[0], rec.Record.size());
+				MemoryBarrier();
+				seg->Used += (LONG)rec.Record.size();
+			}
+			else
+				rec.Keyed = false;
+		}
+	}
+	if (!rec.Keyed) {
+		putRecord(rec.Record, 'K', now);
+		putVarint(rec.Record, rec.Cur.Procs.size());
+		for (i = 0; i < rec.Cur.Procs.size(); i++)
+			putEntry(rec.Record, rec.Cur, rec.Cur.Procs[i]);
+		// A keyframe larger than a segment will be tried again with the next snapshot
+		rec.Keyed = newSegment();
+	}
+	h->LastSample = now;
+	std::swap(rec.Prev, rec.Cur);
+}
+static DWORD WINAPI recording(LPVOID) {
+	do
+		sample();
+	while (WaitForSingleObject(rec.Stop, rec.Interval) == WAIT_TIMEOUT);
+	return 0;
+}
+// Must be called while Lock is held
+static void stopRecorder() {
+	if (rec.Thread) {
+		SetEvent(rec.Stop);
+		WaitForSingleObject(rec.Thread, INFINITE);
+		CloseHandle(rec.Thread);
+	}
+	if (rec.View) {
+		FlushViewOfFile(rec.View, 0);
+		UnmapViewOfFile(rec.View);
+	}
+	if (rec.Mapping)
+		CloseHandle(rec.Mapping);
+	if (rec.File)
+		CloseHandle(rec.File);
+	if (rec.Stop)
+		CloseHandle(rec.Stop);
+	rec.Thread = rec.Mapping = rec.File = rec.Stop = NULL;
+	rec.View = NULL;
+}
+// Unloading the extension stops the recorder
+static void stopRecording() {
+	std::lock_guard<std::mutex> lock(rec.Lock);
+
+	stopRecorder();
+}
+static ExitDesc recorderExit(stopRecording);
+/*
+	Opens or creates the recorder file and starts the recorder thread. The
+	history of a file with the same geometry will be continued, other files
+	will be initialized. Returns 0 or WIN32 error code, must be called while
+	Lock is held.
+ */
+static DWORD startRecorder(const char *path, DWORD size, DWORD interval) {
+	DWORD segsize = ((size - HEADERSIZE) / SEGMENTS) & ~(DWORD)(HEADERSIZE - 1), rc;
+	RecorderHeader *h;
+	HANDLE file;
+	DWORD i;
+
+	// Readers may open the file while it is recorded, other recorders not
+	if ((file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE)
+		return GetLastError();
+	rec.File = file;
+	if ((rec.Mapping = CreateFileMappingA(rec.File, NULL, PAGE_READWRITE, 0, size, NULL)) == NULL
+		|| (rec.View = (char*)MapViewOfFile(rec.Mapping, FILE_MAP_ALL_ACCESS, 0, 0, size)) == NULL
+		|| (rec.Stop = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL) {
+		rc = GetLastError();
+		stopRecorder();
+		return rc;
+	}
+	h = (RecorderHeader*)rec.View;
+	rec.Sequence = 0;
+	if (memcmp(h->Magic, RECORDERMAGIC, sizeof h->Magic) == 0 && h->SegmentSize == segsize && h->Segments == SEGMENTS) {
+		for (i = 0; i < SEGMENTS; i++)
+			rec.Sequence = std::max(rec.Sequence, (ULONGLONG)segmentAt(rec.View, i)->Sequence);
+	}
+	else {
+		memset(h, 0, HEADERSIZE);
+		h->SegmentSize = segsize;
+		h->Segments = SEGMENTS;
+		for (i = 0; i < SEGMENTS; i++)
+			memset(segmentAt(rec.View, i), 0, sizeof(SegmentHeader));
+		MemoryBarrier();
+		memcpy(h->Magic, RECORDERMAGIC, sizeof h->Magic);
+	}
+	rec.Interval = interval;
+	rec.Keyed = false;
+	if ((rec.Thread = CreateThread(NULL, 0, recording, NULL, 0, NULL)) == NULL) {
+		rc = GetLastError();
+		stopRecorder();
+		return rc;
+	}
+	return 0;
+}
+
+/*
+	Read-only view of a recorder file, may be recorded by another process
+	at the same time.
+ */
+class RecorderFile {
+	HANDLE File, Mapping;
+public:
+	const char *View;
+	RecorderFile() {
+		File = Mapping = NULL;
+		View = NULL;
+	}
+	~RecorderFile() {
+		if (View)
+			UnmapViewOfFile(View);
+		if (Mapping)
+			CloseHandle(Mapping);
+		if (File)
+			CloseHandle(File);
+	}
+	// Throws ValueException if the file cannot be opened or is no recorder file
+	void open(const char *path) {
+		const RecorderHeader *h;
+		LARGE_INTEGER size;
+		HANDLE file;
+
+		if ((file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE)
+			throw ValueException(ValueException::ValueExceptionLimit, "Cannot open recorder file");
+		File = file;
+		if (!GetFileSizeEx(File, &size) || size.QuadPart < HEADERSIZE
+			|| (Mapping = CreateFileMappingA(File, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL
+			|| (View = (const char*)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0)) == NULL)
+			throw ValueException(ValueException::ValueExceptionLimit, "Cannot map recorder file");
+		h = (const RecorderHeader*)View;
+		if (memcmp(h->Magic, RECORDERMAGIC, sizeof h->Magic) != 0 || h->Segments == 0 || h->SegmentSize < MINSEGMENT
+			|| HEADERSIZE + (LONGLONG)h->Segments * h->SegmentSize > size.QuadPart)
+			throw ValueException(ValueException::ValueExceptionLimit, "No recorder file");
+	}
+	const RecorderHeader *header() const {
+		return (const RecorderHeader*)View;
+	}
+	// Appends the sequence numbers of the used segments to seqs, oldest first
+	void segments(std::vector<ULONGLONG> &seqs) const {
+		for (DWORD i = 0; i < header()->Segments; i++) {
+			ULONGLONG seq = segmentAt(View, i)->Sequence;
+
+			if (seq)
+				seqs.push_back(seq);
+		}
+		std::sort(seqs.begin(), seqs.end());
+	}
+};
+
+struct RecordedProc {
+	DWORD Ppid;
+	ULONGLONG Start;
+	std::string Name;
+};
+typedef std::map<DWORD, RecordedProc> ProcTable;
+
+// Decoder of the records of one segment, all functions return false if the records are corrupt
+struct RecordReader {
+	const unsigned char *Pos, *End;
+	bool varint(ULONGLONG &v) {
+		v = 0;
+		for (int shift = 0; Pos < End && shift < 64; shift += 7) {
+			v |= (ULONGLONG)(*Pos & 0x7f) << shift;
+			if ((*Pos++ & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+	bool header(char &type, ULONGLONG &time) {
+		if (End - Pos < 9)
+			return false;
+		type = (char)*Pos++;
+		time = 0;
+		for (int i = 0; i < 8; i++)
+			time |= (ULONGLONG)*Pos++ << 8 * i;
+		return true;
+	}
+	bool entry(ProcTable &table) {
+		ULONGLONG pid, ppid, start, len;
+
+		if (!varint(pid) || !varint(ppid) || !varint(start) || !varint(len) || len > (ULONGLONG)(End - Pos))
+			return false;
+		RecordedProc &p = table[(DWORD)pid];
+		p.Ppid = (DWORD)ppid;
+		p.Start = start;
+		p.Name.assign((const char*)Pos, (size_t)len);
+		Pos += len;
+		return true;
+	}
+	bool entries(ProcTable &table) {
+		ULONGLONG n;
+
+		if (!varint(n))
+			return false;
+		while (n-- > 0) {
+			if (!entry(table))
+				return false;
+		}
+		return true;
+	}
+	bool exits(ProcTable &table) {
+		ULONGLONG n, pid;
+
+		if (!varint(n))
+			return false;
+		while (n-- > 0) {
+			if (!varint(pid))
+				return false;
+			table.erase((DWORD)pid);
+		}
+		return true;
+	}
+};
+static RecordReader recordsOf(const SegmentHeader *seg, DWORD max) {
+	RecordReader rd;
+	DWORD used = (DWORD)seg->Used;
+
+	rd.Pos = (const unsigned char*)(seg + 1);
+	rd.End = rd.Pos + std::min(used, max);
+	return rd;
+}
+/*
+	Replays the records of a segment with a time up to time into table,
+	beginning with its keyframe. time will be set to the time of the last
+	record replayed. Throws ValueException if the records are corrupt.
+ */
+static void replay(RecordReader rd, ULONGLONG &time, ProcTable &table) {
+	ULONGLONG t, until = time;
+	char type;
+
+	while (rd.Pos < rd.End) {
+		if (!rd.header(type, t))
+			throw ValueException(ValueException::ValueExceptionLimit, "Recorder file corrupt");
+		if (t > until)
+			break;
+		if (type == 'K')
+			table.clear();
+		if (type == 'K' ? !rd.entries(table) : type != 'D' || !rd.exits(table) || !rd.entries(table))
+			throw ValueException(ValueException::ValueExceptionLimit, "Recorder file corrupt");
+		time = t;
+	}
+}
+// Time of the keyframe of a segment, 0 if there is none
+static ULONGLONG keyTime(const SegmentHeader *seg, DWORD max) {
+	RecordReader rd = recordsOf(seg, max);
+	ULONGLONG time;
+	char type;
+
+	return rd.header(type, time) && type == 'K' ? time : 0;
+}
+
+static void recorderRead(Tcl_Interp *ip, const char *path, ULONGLONG time) {
+	static const char *const names[] = { "pid", "ppid", "name", "start" };
+	RecorderFile file;
+	std::vector<ULONGLONG> seqs;
+	const SegmentHeader *seg = NULL;
+	DWORD max;
+	ULONGLONG seq = 0;
+	ProcTable table;
+
+	file.open(path);
+	max = file.header()->SegmentSize - sizeof(SegmentHeader);
+	file.segments(seqs);
+	// The segment with the latest keyframe not after time
+	for (size_t i = seqs.size(); i-- > 0; ) {
+		const SegmentHeader *s = segmentAt(file.View, seqs[i]);
+		ULONGLONG key = keyTime(s, max);
+
+		if (key && key <= time) {
+			seg = s;
+			seq = seqs[i];
+			break;
+		}
+	}
+	if (seg == NULL)
+		throw ValueException(ValueException::ValueExceptionLimit, "No records up to the given time");
+	replay(recordsOf(seg, max), time, table);
+	// The recorder may have overwritten the segment meanwhile
+	if (seg->Sequence != seq)
+		throw ValueException(ValueException::ValueExceptionLimit, "Segment overwritten while reading");
+
+	Tcl_Obj *res[10], **col[4];
+	ProcTable::const_iterator it;
+	size_t j, n = table.size();
+
+	for (j = 0; j < 4; j++)
+		col[j] = (Tcl_Obj**)Tcl_Alloc((n + 1) * sizeof(Tcl_Obj*));
+	for (it = table.begin(), j = 0; it != table.end(); ++it, j++) {
+		col[0][j] = Tcl_NewWideIntObj(it->first);
+		col[1][j] = Tcl_NewWideIntObj(it->second.Ppid);
+		col[2][j] = Tcl_NewStringObj(it->second.Name.c_str(), (int)it->second.Name.size());
+		col[3][j] = Tcl_NewWideIntObj((Tcl_WideInt)it->second.Start);
+	}
+	res[0] = Tcl_NewStringObj("time", -1);
+	res[1] = Tcl_NewWideIntObj((Tcl_WideInt)time);
+	for (j = 0; j < 4; j++) {
+		res[2 + 2 * j] = Tcl_NewStringObj(names[j], -1);
+		res[3 + 2 * j] = Tcl_NewListObj((int)n, col[j]);
+		Tcl_Free((char*)col[j]);
+	}
+	Tcl_SetObjResult(ip, Tcl_NewListObj(10, res));
+}
+static void recorderRange(Tcl_Interp *ip, const char *path) {
+	RecorderFile file;
+	std::vector<ULONGLONG> seqs;
+	Tcl_Obj *res[2];
+
+	file.open(path);
+	file.segments(seqs);
+	if (seqs.empty())
+		return;
+	res[0] = Tcl_NewWideIntObj((Tcl_WideInt)keyTime(segmentAt(file.View, seqs[0]), file.header()->SegmentSize - sizeof(SegmentHeader)));
+	res[1] = Tcl_NewWideIntObj((Tcl_WideInt)file.header()->LastSample);
+	Tcl_SetObjResult(ip, Tcl_NewListObj(2, res));
+}
+
+static Tcl_WideInt wideOption(Tcl_Obj *obj, Tcl_WideInt min, Tcl_WideInt max, const char *range) {
+	Tcl_WideInt val;
+
+	if (Tcl_GetWideIntFromObj(NULL, obj, &val) != TCL_OK)
+		throw ValueException(ValueException::TypeMismatch, "No integer value");
+	if (val < min || val > max)
+		throw ValueException(ValueException::ValueExceptionLimit, range);
+	return val;
+}
+
+/*
+	Command recorder
+	Syntax:
+		recorder start path ?-size bytes? ?-interval ms?
+		recorder stop
+		recorder read path ?-time ms?
+		recorder range path
+	Function:
+		Flight recorder of the process table. start records the pid, ppid,
+		name and start time of all processes every ms milliseconds (default
+		1000) into file path of the given size (default 16 MB), used as
+		ring of 16 segments. Each segment starts with the whole table, the
+		following records hold the processes created and exited since the
+		previous record and will only be written if the table has changed.
+		The history of an existing file with the same size will be
+		continued. A running recorder will be replaced. stop ends recording
+		and flushes the file.
+		read reconstructs the process table at time ms (milliseconds since
+		1970, default: latest), range returns the recorded time range. Both
+		work while the file is being recorded, also by other processes.
+	Returns:
+		start: 0: OK, other: WIN32 error code
+		stop: Nothing
+		read: Dictionary with the time of the last record up to ms and one
+		list per column pid, ppid, name and start (ms since 1970)
+		range: List {first last} with the time of the oldest record and of
+		the last snapshot, empty if nothing has been recorded
+ */
+DECLARE(recorder, -1, "start|stop|read|range ?arg ...?") {
+	if (cnt < 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "start|stop|read|range ?arg ...?");
+		return TCL_ERROR;
+	}
+	ARG(String, option, 1);
+
+	if (strcmp(option, "start") == 0 && cnt >= 3 && cnt % 2 == 1) {
+		Tcl_WideInt size = DEFSIZE, interval = DEFINTERVAL;
+
+		for (int i = 3; i < cnt; i += 2) {
+			String opt(objs[i]);
+
+			if (strcmp(opt, "-size") == 0)
+				size = wideOption(objs[i + 1], HEADERSIZE + SEGMENTS * MINSEGMENT, MAXSIZE, "Value out of range (size 1052672 - 1073741824)");
+			else if (strcmp(opt, "-interval") == 0)
+				interval = wideOption(objs[i + 1], 10, 86400000, "Value out of range (interval 10 - 86400000)");
+			else
+				throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-size, -interval)");
+		}
+
+		ARG(String, path, 2);
+		std::lock_guard<std::mutex> lock(rec.Lock);
+
+		stopRecorder();
+		Tcl_SetObjResult(ip, Tcl_NewIntObj((int)startRecorder(path, (DWORD)size, (DWORD)interval)));
+	}
+	else if (strcmp(option, "stop") == 0 && cnt == 2) {
+		std::lock_guard<std::mutex> lock(rec.Lock);
+
+		stopRecorder();
+	}
+	else if (strcmp(option, "read") == 0 && (cnt == 3 || cnt == 5)) {
+		ULONGLONG time = ~0ULL;
+
+		if (cnt == 5) {
+			if (strcmp(Tcl_GetString(objs[3]), "-time") != 0)
+				throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-time)");
+			time = (ULONGLONG)wideOption(objs[4], 0, (Tcl_WideInt)(~0ULL >> 1), "Value out of range (time >= 0)");
+		}
+		recorderRead(ip, Tcl_GetString(objs[2]), time);
+	}
+	else if (strcmp(option, "range") == 0 && cnt == 3)
+		recorderRange(ip, Tcl_GetString(objs[2]));
+	else
+		throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (start, stop, read, range)");
+}
+FINISH
+static NewCmdDesc recorderDesc("::VCRExt::recorder", recorder, NULL, NULL);
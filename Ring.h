@@ -0,0 +1,68 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef RING_H
+# define RING_H
+# include <atomic>
+# include <vector>
+
+	/*
+	 * Class SpscRing is a bounded lock-free ring buffer for one producer thread and
+	 * one consumer thread. Capacity will be rounded up to a power of two. Head and
+	 * tail are free-running counters, each written by one side only, on separate
+	 * cache lines. Records will not be overwritten: push() fails if the ring is full.
+	 */
+	template<class T> class SpscRing {
+		std::vector<T> Buffer;
+		size_t Mask;
+		char Pad0[64];
+		std::atomic<size_t> Head;		// Next record to be read, written by consumer
+		char Pad1[64];
+		std::atomic<size_t> Tail;		// Next record to be written, written by producer
+		char Pad2[64];
+	public:
+		SpscRing(size_t capacity) : Head(0), Tail(0) {
+			size_t n = 1;
+
+			while (n < capacity)
+				n <<= 1;
+			Buffer.resize(n);
+			Mask = n - 1;
+		}
+		// Producer side. Returns false if the ring is full.
+		bool push(const T &rec) {
+			size_t tail = Tail.load(std::memory_order_relaxed);
+
+			if (tail - Head.load(std::memory_order_acquire) > Mask)
+				return false;
+			Buffer[tail & Mask] = rec;
+			Tail.store(tail + 1, std::memory_order_release);
+			return true;
+		}
+		// Consumer side. Appends all available records to out, returns their number.
+		size_t drain(std::vector<T> &out) {
+			size_t head = Head.load(std::memory_order_relaxed), tail = Tail.load(std::memory_order_acquire);
+
+			for (size_t i = head; i != tail; i++)
+				out.push_back(Buffer[i & Mask]);
+			Head.store(tail, std::memory_order_release);
+			return tail - head;
+		}
+		size_t capacity() const {
+			return Mask + 1;
+		}
+	};
+#endif
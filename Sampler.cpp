@@ -0,0 +1,310 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "VCRExtMain.h"
+#include "Snapshot.h"
+#include "Stop.h"
+#include "Waiter.h"
+#include "Ring.h"
+#include <psapi.h>
+
+// Defaults for sampling interval and ring capacity
+#define DEFINTERVAL 1000
+#define DEFCAPACITY 4096
+
+/*
+	One sample of one process. Cpu is percent of one processor since the
+	previous sample, Time is milliseconds since 1970.
+ */
+struct Sample {
+	ULONGLONG Time;
+	DWORD Pid;
+	float Cpu;
+	ULONGLONG Rss, Read, Write;
+};
+
+struct SampleTarget {
+	DWORD Pid;
+	HANDLE Handle;
+	ULONGLONG LastCpu, LastMicros;
+	bool Exited;
+};
+
+/*
+	Per-interpreter sampler. The sampler thread is the producer of Ring,
+	the interpreter thread its consumer. Targets will be used by the
+	sampler thread only while it is running.
+ */
+struct Sampler {
+	SpscRing<Sample> Ring;
+	std::vector<SampleTarget> Targets;
+	DWORD Interval;
+	HANDLE Stop, Thread;
+	volatile LONG Dropped;
+	std::vector<Sample> Drained;		// Reused by read
+	std::vector<Tcl_Obj*> Column;		// Reused by read
+	Sampler(size_t capacity) : Ring(capacity) {
+		Interval = DEFINTERVAL;
+		Stop = Thread = NULL;
+		Dropped = 0;
+	}
+};
+
+static ULONGLONG processCpu(HANDLE hd) {
+	FILETIME ct, et, kt, ut;
+
+	if (!GetProcessTimes(hd, &ct, &et, &kt, &ut))
+		return 0;
+	return ((ULONGLONG)kt.dwHighDateTime << 32) + kt.dwLowDateTime + ((ULONGLONG)ut.dwHighDateTime << 32) + ut.dwLowDateTime;
+}
+
+/*
+	Thread function of the sampler. Samples are taken at fixed points in
+	time, a late sample does not shift the following ones.
+ */
+static DWORD WINAPI sampling(LPVOID arg) {
+	Sampler *smp = (Sampler*)arg;
+	ULONGLONG next = GetTickCount64();
+	PROCESS_MEMORY_COUNTERS pmc;
+	IO_COUNTERS io;
+	Sample rec;
+
+	for (size_t i = 0; i < smp->Targets.size(); i++) {
+		smp->Targets[i].LastCpu = processCpu(smp->Targets[i].Handle);
+		smp->Targets[i].LastMicros = nowMicros();
+	}
+	for (;;) {
+		ULONGLONG now = GetTickCount64();
+		FILETIME ft;
+
+		next += smp->Interval;
+		if (WaitForSingleObject(smp->Stop, next > now ? (DWORD)(next - now) : 0) != WAIT_TIMEOUT)
+			break;
+		GetSystemTimeAsFileTime(&ft);
+		rec.Time = ((((ULONGLONG)ft.dwHighDateTime << 32) + ft.dwLowDateTime) - 116444736000000000ULL) / 10000;
+		for (size_t i = 0; i < smp->Targets.size(); i++) {
+			SampleTarget &t = smp->Targets[i];
+			ULONGLONG cpu, micros;
+
+			if (t.Exited)
+				continue;
+			if (WaitForSingleObject(t.Handle, 0) == WAIT_OBJECT_0) {
+				t.Exited = true;
+				continue;
+			}
+			cpu = processCpu(t.Handle);
+			micros = nowMicros();
+			pmc.cb = sizeof pmc;
+			if (!GetProcessMemoryInfo(t.Handle, &pmc, sizeof pmc))
+				pmc.WorkingSetSize = 0;
+			if (!GetProcessIoCounters(t.Handle, &io))
+				memset(&io, 0, sizeof io);
+			rec.Pid = t.Pid;
+			// CPU time in 100 ns units, wall time in microseconds
+			rec.Cpu = micros > t.LastMicros ? (float)(cpu - t.LastCpu) * 10.0f / (float)(micros - t.LastMicros) : 0.0f;
+			rec.Rss = pmc.WorkingSetSize;
+			rec.Read = io.ReadTransferCount;
+			rec.Write = io.WriteTransferCount;
+			t.LastCpu = cpu;
+			t.LastMicros = micros;
+			if (!smp->Ring.push(rec))
+				InterlockedIncrement(&smp->Dropped);
+		}
+	}
+	return 0;
+}
+
+// Stops the sampler thread and closes the target handles, the ring remains readable
+static void stopSampler(Sampler *smp) {
+	if (smp->Thread) {
+		SetEvent(smp->Stop);
+		WaitForSingleObject(smp->Thread, INFINITE);
+		CloseHandle(smp->Thread);
+		smp->Thread = NULL;
+	}
+	if (smp->Stop) {
+		CloseHandle(smp->Stop);
+		smp->Stop = NULL;
+	}
+	for (size_t i = 0; i < smp->Targets.size(); i++)
+		CloseHandle(smp->Targets[i].Handle);
+	smp->Targets.clear();
+}
+
+#define SAMPLERKEY "VCRExt::sampler"
+static AssocDataDesc samplerData(SAMPLERKEY);
+static void freeSampler(ClientData cd, Tcl_Interp *) {
+	Sampler *smp = (Sampler*)cd;
+
+	if (smp) {
+		stopSampler(smp);
+		delete smp;
+	}
+}
+
+/*
+	sampler start -targets list ?-interval ms? ?-capacity n?
+	Returns false if the targets are invalid, the error is the interpreter result
+ */
+static bool samplerStart(Tcl_Interp *ip, int cnt, Tcl_Obj *CONST objs[]) {
+	Tcl_Obj *list = NULL;
+	int interval = DEFINTERVAL, capacity = DEFCAPACITY, i;
+
+	for (i = 2; i < cnt; i += 2) {
+		String opt(objs[i]);
+
+		if (i + 1 >= cnt)
+			throw ValueException(ValueException::ValueExceptionLimit, "Usage: sampler start -targets list ?-interval ms? ?-capacity n?");
+		if (strcmp(opt, "-targets") == 0)
+			list = objs[i + 1];
+		else if (strcmp(opt, "-interval") == 0) {
+			if ((interval = Int(objs[i + 1])) < 10)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (interval >= 10)");
+		}
+		else if (strcmp(opt, "-capacity") == 0) {
+			if ((capacity = Int(objs[i + 1])) < 1 || capacity > 1 << 24)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (capacity 1 - 16777216)");
+		}
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-targets, -interval, -capacity)");
+	}
+	if (list == NULL)
+		throw ValueException(ValueException::ValueExceptionLimit, "Option -targets missing");
+
+	ProcSnapshot snap;
+	std::vector<StopTarget> targets;
+
+	if (!snap.take(ProcSnapshot::Pid | ProcSnapshot::Name | ProcSnapshot::Start))
+		throw ValueException(ValueException::ValueExceptionLimit, "Process snapshot failed");
+	if (!selectTargets(ip, list, snap, targets))
+		return false;
+
+	// A running sampler will be replaced, samples not read yet are lost
+	freeSampler(Tcl_GetAssocData(ip, SAMPLERKEY, NULL), ip);
+	Tcl_SetAssocData(ip, SAMPLERKEY, freeSampler, NULL);
+
+	Sampler *smp = new Sampler(capacity);
+
+	smp->Interval = interval;
+	for (size_t j = 0; j < targets.size(); j++) {
+		ProcEntry p;
+		SampleTarget t;
+
+		p.Pid = targets[j].Pid;
+		p.Start = targets[j].Start;
+		if ((t.Handle = openProcess(p, PROCESS_QUERY_LIMITED_INFORMATION | SYNCHRONIZE)) == NULL)
+			continue;
+		t.Pid = p.Pid;
+		t.LastCpu = t.LastMicros = 0;
+		t.Exited = false;
+		smp->Targets.push_back(t);
+	}
+	if ((smp->Stop = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL || (smp->Thread = CreateThread(NULL, 0, sampling, smp, 0, NULL)) == NULL) {
+		freeSampler(smp, ip);
+		throw ValueException(ValueException::ValueExceptionLimit, "Sampler thread not available");
+	}
+	Tcl_SetAssocData(ip, SAMPLERKEY, freeSampler, smp);
+	Tcl_SetObjResult(ip, Tcl_NewWideIntObj((Tcl_WideInt)smp->Targets.size()));
+	return true;
+}
+
+// Returns one column of the drained samples as list
+template<class F> static Tcl_Obj *column(Sampler *smp, F field) {
+	smp->Column.resize(smp->Drained.size());
+	for (size_t i = 0; i < smp->Drained.size(); i++)
+		smp->Column[i] = field(smp->Drained[i]);
+	return Tcl_NewListObj((int)smp->Column.size(), smp->Column.empty() ? NULL : &smp->Column[0]);
+}
+static Tcl_Obj *timeField(const Sample &s) { return Tcl_NewWideIntObj((Tcl_WideInt)s.Time); }
+static Tcl_Obj *pidField(const Sample &s) { return Tcl_NewWideIntObj(s.Pid); }
+static Tcl_Obj *cpuField(const Sample &s) { return Tcl_NewDoubleObj(s.Cpu); }
+static Tcl_Obj *rssField(const Sample &s) { return Tcl_NewWideIntObj((Tcl_WideInt)s.Rss); }
+static Tcl_Obj *readField(const Sample &s) { return Tcl_NewWideIntObj((Tcl_WideInt)s.Read); }
+static Tcl_Obj *writeField(const Sample &s) { return Tcl_NewWideIntObj((Tcl_WideInt)s.Write); }
+
+/*
+	sampler read
+ */
+static void samplerRead(Tcl_Interp *ip) {
+	Sampler *smp = (Sampler*)Tcl_GetAssocData(ip, SAMPLERKEY, NULL);
+	Tcl_Obj *res[14];
+
+	if (smp == NULL)
+		throw ValueException(ValueException::ValueExceptionLimit, "Sampler not started");
+	smp->Drained.clear();
+	smp->Ring.drain(smp->Drained);
+	res[0] = Tcl_NewStringObj("time", -1);
+	res[1] = column(smp, timeField);
+	res[2] = Tcl_NewStringObj("pid", -1);
+	res[3] = column(smp, pidField);
+	res[4] = Tcl_NewStringObj("cpu", -1);
+	res[5] = column(smp, cpuField);
+	res[6] = Tcl_NewStringObj("rss", -1);
+	res[7] = column(smp, rssField);
+	res[8] = Tcl_NewStringObj("read", -1);
+	res[9] = column(smp, readField);
+	res[10] = Tcl_NewStringObj("write", -1);
+	res[11] = column(smp, writeField);
+	res[12] = Tcl_NewStringObj("dropped", -1);
+	res[13] = Tcl_NewWideIntObj(InterlockedExchange(&smp->Dropped, 0));
+	Tcl_SetObjResult(ip, Tcl_NewListObj(14, res));
+}
+
+/*
+	Command sampler
+	Syntax:
+		sampler start -targets list ?-interval ms? ?-capacity n?
+		sampler read
+		sampler stop
+	Function:
+		Samples CPU usage, working set and I/O counters of processes in a
+		native thread. start resolves list like command stop and samples
+		the processes every ms milliseconds (default 1000) into a ring of
+		n records (default 4096). Samples will be dropped while the ring is
+		full. A running sampler will be replaced. read drains the ring.
+		stop ends sampling, the remaining samples can still be read.
+	Returns:
+		start: Number of sampled processes
+		read: Dictionary with one list per column: time (ms since 1970),
+		pid, cpu (percent of one processor since the previous sample), rss
+		(working set bytes), read and write (bytes transferred), and the
+		number of dropped samples since the last read
+		stop: Nothing
+ */
+DECLARE(sampler, -1, "start|read|stop ?arg ...?") {
+	if (cnt < 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "start|read|stop ?arg ...?");
+		return TCL_ERROR;
+	}
+	ARG(String, option, 1);
+
+	if (strcmp(option, "start") == 0) {
+		if (!samplerStart(ip, cnt, objs))
+			return TCL_ERROR;
+	}
+	else if (strcmp(option, "read") == 0 && cnt == 2)
+		samplerRead(ip);
+	else if (strcmp(option, "stop") == 0 && cnt == 2) {
+		Sampler *smp = (Sampler*)Tcl_GetAssocData(ip, SAMPLERKEY, NULL);
+
+		if (smp)
+			stopSampler(smp);
+	}
+	else
+		throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (start, read, stop)");
+}
+FINISH
+static NewCmdDesc samplerDesc("::VCRExt::sampler", sampler, NULL, NULL);
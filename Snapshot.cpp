@@ -0,0 +1,793 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "VCRExtMain.h"
+#include "Snapshot.h"
+#include "Metrics.h"
+#include "NtDefs.h"
+#include <Tlhelp32.h>
+#include <psapi.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+/*
+	Layout of the records returned by NtQuerySystemInformation for
+	information class SystemProcessInformation. winternl.h declares most
+	of the members as reserved, therefore the structure will be defined here.
+ */
+struct SysProcInfo {
+	ULONG NextEntryOffset;
+	ULONG NumberOfThreads;
+	LARGE_INTEGER WorkingSetPrivateSize;
+	ULONG HardFaultCount;
+	ULONG NumberOfThreadsHighWatermark;
+	ULONGLONG CycleTime;
+	LARGE_INTEGER CreateTime;
+	LARGE_INTEGER UserTime;
+	LARGE_INTEGER KernelTime;
+	struct { USHORT Length, MaximumLength; PWSTR Buffer; } ImageName;
+	LONG BasePriority;
+	HANDLE UniqueProcessId;
+	HANDLE InheritedFromUniqueProcessId;
+	ULONG HandleCount;
+	ULONG SessionId;
+	ULONG_PTR UniqueProcessKey;
+	SIZE_T PeakVirtualSize;
+	SIZE_T VirtualSize;
+	ULONG PageFaultCount;
+	SIZE_T PeakWorkingSetSize;
+	SIZE_T WorkingSetSize;
+	SIZE_T QuotaPeakPagedPoolUsage;
+	SIZE_T QuotaPagedPoolUsage;
+	SIZE_T QuotaPeakNonPagedPoolUsage;
+	SIZE_T QuotaNonPagedPoolUsage;
+	SIZE_T PagefileUsage;
+	SIZE_T PeakPagefileUsage;
+	SIZE_T PrivatePageCount;
+	LARGE_INTEGER ReadOperationCount;
+	LARGE_INTEGER WriteOperationCount;
+	LARGE_INTEGER OtherOperationCount;
+	LARGE_INTEGER ReadTransferCount;
+	LARGE_INTEGER WriteTransferCount;
+	LARGE_INTEGER OtherTransferCount;
+};
+typedef NTSTATUS (WINAPI *NtQuerySystemInformationProc)(ULONG, PVOID, ULONG, PULONG);
+#define SystemProcessInformation 5
+
+/*
+	Appends the UTF-8 representation of the given wide character string to
+	names and returns the offset of the copy.
+ */
+static size_t addName(std::vector<char> &names, const WCHAR *name, int len) {
+	size_t offset = names.size();
+	int size = len ? WideCharToMultiByte(CP_UTF8, 0, name, len, NULL, 0, NULL, NULL) : 0;
+
+	names.resize(offset + size + 1);
+	if (size)
+		WideCharToMultiByte(CP_UTF8, 0, name, len, &names[offset], size, NULL, NULL);
+	names[offset + size] = 0;
+	return offset;
+}
+
+/*
+	Parallel parsing of process records: The records will be split into
+	consecutive parts, each part will be parsed by its own thread into its
+	own process and name arrays. Afterwards, the parts will be appended to
+	the snapshot.
+ */
+struct ScanPart {
+	const void *const *Records;
+	size_t Count;
+	int Fields;
+	void (*Parse)(ScanPart &part);
+	std::vector<ProcEntry> Procs;
+	std::vector<char> Names;
+};
+#define MAXSCANTHREADS 8
+
+static DWORD WINAPI scanWorker(LPVOID arg) {
+	ScanPart *part = (ScanPart*)arg;
+
+	part->Parse(*part);
+	return 0;
+}
+
+/*
+	Returns the number of threads to be used to parse count records. Each
+	thread shall parse at least minimum records, the number of threads will
+	be limited by the number of processors.
+ */
+static int numProcessors() {
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors > MAXSCANTHREADS ? MAXSCANTHREADS : (int)si.dwNumberOfProcessors;
+}
+static int scanThreads(size_t count, size_t minimum) {
+	static const int processors = numProcessors();
+	size_t n = count / minimum;
+
+	return n < 1 ? 1 : n > (size_t)processors ? processors : (int)n;
+}
+
+/*
+	Parses recs into snap with nthreads threads, 0: Depending on the number
+	of records and processors. Returns the number of threads used.
+ */
+static int scanParallel(ProcSnapshot &snap, const std::vector<const void*> &recs, int fields, void (*parse)(ScanPart&), size_t minimum, int nthreads = 0) {
+	int i, n = nthreads > 0 ? std::min(nthreads, MAXSCANTHREADS) : recs.empty() ? 1 : scanThreads(recs.size(), minimum);
+	ScanPart parts[MAXSCANTHREADS];
+	HANDLE threads[MAXSCANTHREADS];
+
+	for (i = 0; i < n; i++) {
+		parts[i].Records = recs.empty() ? NULL : &recs[recs.size() * i / n];
+		parts[i].Count = recs.size() * (i + 1) / n - recs.size() * i / n;
+		parts[i].Fields = fields;
+		parts[i].Parse = parse;
+		threads[i] = i == 0 ? NULL : CreateThread(NULL, 0, scanWorker, &parts[i], 0, NULL);
+	}
+	// The calling thread parses the first part and every part no thread could be created for
+	for (i = 0; i < n; i++) {
+		if (threads[i] == NULL)
+			parse(parts[i]);
+	}
+	for (i = 1; i < n; i++) {
+		if (threads[i]) {
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+	}
+	snap.Procs.reserve(recs.size());
+	for (i = 0; i < n; i++) {
+		size_t base = snap.Names.size();
+
+		snap.Names.insert(snap.Names.end(), parts[i].Names.begin(), parts[i].Names.end());
+		for (size_t j = 0; j < parts[i].Procs.size(); j++) {
+			snap.Procs.push_back(parts[i].Procs[j]);
+			if (fields & ProcSnapshot::Name)
+				snap.Procs.back().Name += base;
+		}
+	}
+	return n;
+}
+
+static void parseNt(ScanPart &part) {
+	part.Procs.resize(part.Count);
+	for (size_t i = 0; i < part.Count; i++) {
+		const SysProcInfo *p = (const SysProcInfo*)part.Records[i];
+		ProcEntry &ent = part.Procs[i];
+
+		ent.Pid = (DWORD)(ULONG_PTR)p->UniqueProcessId;
+		ent.Ppid = (DWORD)(ULONG_PTR)p->InheritedFromUniqueProcessId;
+		ent.Start = p->CreateTime.QuadPart;
+		ent.Cpu = p->UserTime.QuadPart + p->KernelTime.QuadPart;
+		ent.Rss = p->WorkingSetSize;
+		ent.Name = part.Fields & ProcSnapshot::Name ? addName(part.Names, p->ImageName.Buffer, p->ImageName.Length / sizeof(WCHAR)) : 0;
+	}
+}
+
+/*
+	Parses the records in buffer, as returned by NtQuerySystemInformation,
+	into snap. Returns the number of threads used, see scanParallel.
+ */
+static int parseRecords(ProcSnapshot &snap, const char *buffer, int fields, int threads = 0) {
+	std::vector<const void*> recs;
+
+	for (const SysProcInfo *p = (const SysProcInfo*)buffer; ; p = (const SysProcInfo*)((const char*)p + p->NextEntryOffset)) {
+		recs.push_back(p);
+		if (p->NextEntryOffset == 0)
+			break;
+	}
+	return scanParallel(snap, recs, fields, parseNt, 4096, threads);
+}
+
+/*
+	Fills the snapshot via NtQuerySystemInformation. This retrieves all
+	process information with one system call, without opening any process.
+	The buffer size of the previous call will be used as initial size, it
+	may be shared by interpreters of several threads.
+ */
+static bool takeNt(ProcSnapshot &snap, int fields) {
+	static NtQuerySystemInformationProc query = (NtQuerySystemInformationProc)GetProcAddress(GetModuleHandleA("ntdll.dll"), "NtQuerySystemInformation");
+	static volatile LONG lastsize = 0x40000;
+	ULONG size = (ULONG)lastsize;
+	char *buffer = NULL;
+	NTSTATUS rc;
+
+	if (query == NULL)
+		return false;
+	do {
+		delete [] buffer;
+		buffer = new char[size];
+		rc = query(SystemProcessInformation, buffer, size, &size);
+		size += 0x10000;
+	} while (rc == STATUS_INFO_LENGTH_MISMATCH);
+	if (rc < 0) {
+		delete [] buffer;
+		return false;
+	}
+	InterlockedExchange(&lastsize, (LONG)size);
+	parseRecords(snap, buffer, fields);
+	delete [] buffer;
+	return true;
+}
+
+static void parseToolhelp(ScanPart &part) {
+	part.Procs.resize(part.Count);
+	for (size_t i = 0; i < part.Count; i++) {
+		const PROCESSENTRY32W *ent = (const PROCESSENTRY32W*)part.Records[i];
+		ProcEntry &pe = part.Procs[i];
+		HANDLE phd;
+
+		pe.Pid = ent->th32ProcessID;
+		pe.Ppid = ent->th32ParentProcessID;
+		pe.Start = pe.Cpu = 0;
+		pe.Rss = 0;
+		pe.Name = part.Fields & ProcSnapshot::Name ? addName(part.Names, ent->szExeFile, (int)wcslen(ent->szExeFile)) : 0;
+		if ((part.Fields & (ProcSnapshot::Start | ProcSnapshot::Cpu | ProcSnapshot::Rss)) && (phd = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pe.Pid))) {
+			PROCESS_MEMORY_COUNTERS pmc;
+			FILETIME ct, et, kt, ut;
+
+			if ((part.Fields & (ProcSnapshot::Start | ProcSnapshot::Cpu)) && GetProcessTimes(phd, &ct, &et, &kt, &ut)) {
+				pe.Start = ((ULONGLONG)ct.dwHighDateTime << 32) + ct.dwLowDateTime;
+				pe.Cpu = ((ULONGLONG)kt.dwHighDateTime << 32) + kt.dwLowDateTime + ((ULONGLONG)ut.dwHighDateTime << 32) + ut.dwLowDateTime;
+			}
+			pmc.cb = sizeof pmc;
+			if ((part.Fields & ProcSnapshot::Rss) && GetProcessMemoryInfo(phd, &pmc, sizeof pmc))
+				pe.Rss = pmc.WorkingSetSize;
+			CloseHandle(phd);
+		}
+	}
+}
+
+/*
+	Fallback if NtQuerySystemInformation is not available: Fills the snapshot
+	via Toolhelp32. Start time, cpu time and working set will be retrieved
+	from the process itself, if possible and requested. Since this needs
+	some system calls per process, less records per thread will be used.
+ */
+static bool takeToolhelp(ProcSnapshot &snap, int fields) {
+	HANDLE hd = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+	std::vector<PROCESSENTRY32W> ents;
+	std::vector<const void*> recs;
+	PROCESSENTRY32W ent;
+	BOOL res;
+
+	if (hd == INVALID_HANDLE_VALUE)
+		return false;
+	ent.dwSize = sizeof ent;
+	for (res = Process32FirstW(hd, &ent); res; res = Process32NextW(hd, &ent))
+		ents.push_back(ent);
+	CloseHandle(hd);
+	for (size_t i = 0; i < ents.size(); i++)
+		recs.push_back(&ents[i]);
+	scanParallel(snap, recs, fields, parseToolhelp, 256);
+	return true;
+}
+
+static bool pidLess(const ProcEntry &a, const ProcEntry &b) {
+	return a.Pid < b.Pid;
+}
+
+// Implementation of ProcSnapshot class
+
+bool ProcSnapshot::take(int fields) {
+	ULONGLONG start = nowMicros();
+
+	// Names[0] is the empty string, used for all processes if names are not requested
+	Procs.clear();
+	Names.assign(1, 0);
+	if (!takeNt(*this, fields)) {
+		Procs.clear();
+		Names.assign(1, 0);
+		if (!takeToolhelp(*this, fields))
+			return false;
+	}
+	std::sort(Procs.begin(), Procs.end(), pidLess);
+	observeMetric(extMetrics.Snapshot, start);
+	return true;
+}
+const ProcEntry *ProcSnapshot::find(DWORD pid) const {
+	ProcEntry key;
+
+	key.Pid = pid;
+	std::vector<ProcEntry>::const_iterator it = std::lower_bound(Procs.begin(), Procs.end(), key, pidLess);
+	return it == Procs.end() || it->Pid != pid ? NULL : &*it;
+}
+
+/*
+	Windows keeps the parent process ID after the parent has exited, therefore
+	a process with that ID is only the parent if it has been started before.
+ */
+const ProcEntry *ProcSnapshot::parent(const ProcEntry &p) const {
+	const ProcEntry *pp = p.Pid == p.Ppid ? NULL : find(p.Ppid);
+
+	return pp && pp->Start <= p.Start ? pp : NULL;
+}
+
+void ProcTree::build(const ProcSnapshot &snap) {
+	size_t i, n = snap.Procs.size();
+	std::vector<size_t> next;
+
+	Parent.assign(n, (size_t)NoParent);
+	First.assign(n + 1, 0);
+	for (i = 0; i < n; i++) {
+		const ProcEntry *p = snap.parent(snap.Procs[i]);
+
+		// Equal start times (not available) are ordered by process ID, so the index cannot contain cycles
+		if (p && (p->Start < snap.Procs[i].Start || p->Pid < snap.Procs[i].Pid)) {
+			Parent[i] = p - &snap.Procs[0];
+			First[Parent[i] + 1]++;
+		}
+	}
+	for (i = 0; i < n; i++)
+		First[i + 1] += First[i];
+	Children.resize(First[n]);
+	next.assign(First.begin(), First.end() - 1);
+	for (i = 0; i < n; i++) {
+		if (Parent[i] != (size_t)NoParent)
+			Children[next[Parent[i]]++] = i;
+	}
+}
+
+/*
+	Iterative depth-first traversal, the stack holds each process together
+	with the position of its next child to be visited.
+ */
+void ProcTree::postorder(size_t root, std::vector<size_t> &order) const {
+	std::vector<std::pair<size_t, size_t> > stack;
+
+	stack.push_back(std::make_pair(root, First[root]));
+	while (!stack.empty()) {
+		std::pair<size_t, size_t> &top = stack.back();
+
+		if (top.second < First[top.first + 1]) {
+			size_t child = Children[top.second++];
+
+			stack.push_back(std::make_pair(child, First[child]));
+		}
+		else {
+			order.push_back(top.first);
+			stack.pop_back();
+		}
+	}
+}
+
+HANDLE openProcess(const ProcEntry &p, DWORD access) {
+	HANDLE hd = OpenProcess(access | PROCESS_QUERY_LIMITED_INFORMATION, FALSE, p.Pid);
+	FILETIME ct, et, kt, ut;
+
+	if (hd && p.Start && (!GetProcessTimes(hd, &ct, &et, &kt, &ut) || (((ULONGLONG)ct.dwHighDateTime << 32) + ct.dwLowDateTime) != p.Start)) {
+		CloseHandle(hd);
+		SetLastError(ERROR_INVALID_PARAMETER);
+		hd = NULL;
+	}
+	return hd;
+}
+
+/*
+	Start times of the processes created as leaders of new process groups,
+	by process ID. An entry will be replaced when its process ID is reused
+	by a new leader, therefore the map is bounded by the process ID range.
+ */
+static struct {
+	std::mutex Lock;
+	std::map<DWORD, ULONGLONG> Starts;
+} leaders;
+
+bool groupLeader(DWORD pid, ULONGLONG start) {
+	std::lock_guard<std::mutex> lock(leaders.Lock);
+	std::map<DWORD, ULONGLONG>::const_iterator it = leaders.Starts.find(pid);
+
+	return start && it != leaders.Starts.end() && it->second == start;
+}
+
+DWORD spawnSuspended(char *cl, bool job, PROCESS_INFORMATION &pi, HANDLE &jhd, char *env) {
+	STARTUPINFOA si;
+	FILETIME ct, et, kt, ut;
+
+	memset(&si, 0, sizeof si);
+	memset(&pi, 0, sizeof pi);
+	si.cb = sizeof si;
+	jhd = NULL;
+	// si.lpDesktop = "WinSta0";
+	if (!CreateProcessA(NULL, cl, NULL, NULL, FALSE, CREATE_SUSPENDED | (job ? CREATE_NEW_PROCESS_GROUP : 0), env, NULL, &si, &pi))
+		return GetLastError();
+	if (job && ((jhd = CreateJobObjectA(NULL, NULL)) == NULL || !AssignProcessToJobObject(jhd, pi.hProcess))) {
+		DWORD rc = GetLastError();
+
+		TerminateProcess(pi.hProcess, rc);
+		CloseHandle(pi.hThread);
+		CloseHandle(pi.hProcess);
+		if (jhd)
+			CloseHandle(jhd);
+		return rc;
+	}
+	if (job && GetProcessTimes(pi.hProcess, &ct, &et, &kt, &ut)) {
+		std::lock_guard<std::mutex> lock(leaders.Lock);
+
+		leaders.Starts[pi.dwProcessId] = ((ULONGLONG)ct.dwHighDateTime << 32) + ct.dwLowDateTime;
+	}
+	countMetric(extMetrics.Spawned);
+	return 0;
+}
+
+/*
+	Computes the differences between snapshots old and cur. Both process
+	lists are sorted by process ID, therefore one merge pass is sufficient.
+	Equal process IDs with different start times are handled as one exited
+	and one created process.
+ */
+void diff(const ProcSnapshot &old, const ProcSnapshot &cur, ProcDiff &res) {
+	size_t i = 0, j = 0;
+
+	res.Created.clear();
+	res.Exited.clear();
+	res.Reparented.clear();
+	while (i < old.Procs.size() || j < cur.Procs.size()) {
+		const ProcEntry *o = i < old.Procs.size() ? &old.Procs[i] : NULL;
+		const ProcEntry *c = j < cur.Procs.size() ? &cur.Procs[j] : NULL;
+
+		if (c == NULL || (o && o->Pid < c->Pid))
+			res.Exited.push_back(o), i++;
+		else if (o == NULL || c->Pid < o->Pid)
+			res.Created.push_back(c), j++;
+		else if (o->Start != c->Start) {
+			res.Exited.push_back(o), i++;
+			res.Created.push_back(c), j++;
+		}
+		else {
+			// Same process: Check whether parent was alive before and has gone now
+			const ProcEntry *op = old.parent(*o), *cp = cur.find(c->Ppid);
+
+			if (op && (cp == NULL || !cur.same(*op, *cp)))
+				res.Reparented.push_back(c);
+			i++, j++;
+		}
+	}
+}
+
+/*
+	Per-interpreter storage for the snapshot used by command snapshot
+ */
+#define SNAPSHOTKEY "VCRExt::snapshot"
+static AssocDataDesc snapshotData(SNAPSHOTKEY);
+static void freeSnapshot(ClientData cd, Tcl_Interp *) {
+	delete (ProcSnapshot*)cd;
+}
+static ProcSnapshot *getSnapshot(Tcl_Interp *ip) {
+	ProcSnapshot *snap = (ProcSnapshot*)Tcl_GetAssocData(ip, SNAPSHOTKEY, NULL);
+
+	if (snap == NULL) {
+		snap = new ProcSnapshot;
+		Tcl_SetAssocData(ip, SNAPSHOTKEY, freeSnapshot, snap);
+	}
+	return snap;
+}
+static Tcl_Obj *pidList(const std::vector<const ProcEntry*> &procs) {
+	Tcl_Obj *res = Tcl_NewListObj(0, NULL);
+
+	for (size_t i = 0; i < procs.size(); i++)
+		Tcl_ListObjAppendElement(NULL, res, Tcl_NewWideIntObj(procs[i]->Pid));
+	return res;
+}
+
+/*
+	Builds a synthetic process table of count records in the layout returned
+	by NtQuerySystemInformation, each record followed by its image name.
+ */
+static void benchRecords(std::vector<char> &buffer, size_t count) {
+	const size_t stride = (sizeof(SysProcInfo) + 32 * sizeof(WCHAR) + 7) & ~(size_t)7;
+
+	buffer.assign(count * stride, 0);
+	for (size_t i = 0; i < count; i++) {
+		SysProcInfo *p = (SysProcInfo*)&buffer[i * stride];
+		WCHAR *name = (WCHAR*)(p + 1);
+		char ascii[32];
+		int len = sprintf(ascii, "process%u.exe", (unsigned)i);
+
+		for (int j = 0; j < len; j++)
+			name[j] = ascii[j];
+		p->NextEntryOffset = i + 1 < count ? (ULONG)stride : 0;
+		p->ImageName.Length = p->ImageName.MaximumLength = (USHORT)(len * sizeof(WCHAR));
+		p->ImageName.Buffer = name;
+		p->UniqueProcessId = (HANDLE)(ULONG_PTR)((i + 1) * 4);
+		p->InheritedFromUniqueProcessId = (HANDLE)(ULONG_PTR)(i / 8 * 4);
+		p->CreateTime.QuadPart = i;
+		p->UserTime.QuadPart = p->KernelTime.QuadPart = i * 10000;
+		p->WorkingSetSize = (SIZE_T)(i + 1) * 4096;
+	}
+}
+
+/*
+	Command snapshot
+	Syntax:
+		snapshot take
+		snapshot diff
+		snapshot bench count ?threads?
+	Function:
+		take stores a snapshot of the process table, diff compares the
+		process table with the stored snapshot and stores the process
+		table as new snapshot.
+		bench measures the parser of take on a synthetic process table
+		of count records, with threads threads (1 - 8) or, by default,
+		the number take would use. The stored snapshot remains unchanged.
+	Returns:
+		take: Number of processes in snapshot
+		diff: Dictionary with keys created, exited and reparented. Values
+			  are lists of process ids, for reparented, each process id
+			  will be followed by the id of the exited parent process.
+		bench: List {threads micros}, the number of parser threads and
+			  the parse time in microseconds
+ */
+DECLARE(snapshot, -1, "take|diff|bench count ?threads?") {
+	if (cnt < 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "take|diff|bench count ?threads?");
+		return TCL_ERROR;
+	}
+	ARG(String, option, 1);
+
+	if (strcmp(option, "bench") == 0) {
+		if (cnt != 3 && cnt != 4) {
+			Tcl_WrongNumArgs(ip, 2, objs, "count ?threads?");
+			return TCL_ERROR;
+		}
+		ARG(Int, count, 2);
+		int threads = cnt == 4 ? (int)Int(objs[3]) : 0;
+		std::vector<char> buffer;
+		ProcSnapshot snap;
+		Tcl_Obj *res[2];
+
+		if (count < 1 || threads < 0 || threads > MAXSCANTHREADS)
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid count or threads");
+		benchRecords(buffer, count);
+
+		ULONGLONG start = nowMicros();
+
+		res[0] = Tcl_NewIntObj(parseRecords(snap, &buffer[0], ProcSnapshot::AllFields, threads));
+		res[1] = Tcl_NewWideIntObj(nowMicros() - start);
+		Tcl_SetObjResult(ip, Tcl_NewListObj(2, res));
+		return TCL_OK;
+	}
+	if (cnt != 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "take|diff|bench count ?threads?");
+		return TCL_ERROR;
+	}
+
+	ProcSnapshot *old = getSnapshot(ip), *cur;
+
+	if (strcmp(option, "take") != 0 && strcmp(option, "diff") != 0)
+		throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (take, diff, bench)");
+	cur = new ProcSnapshot;
+	if (!cur->take()) {
+		delete cur;
+		throw ValueException(ValueException::ValueExceptionLimit, "Process snapshot failed");
+	}
+	if (strcmp(option, "take") == 0)
+		Tcl_SetObjResult(ip, Tcl_NewWideIntObj(cur->Procs.size()));
+	else {
+		ProcDiff res;
+		Tcl_Obj *dict = Tcl_NewDictObj(), *rep = Tcl_NewListObj(0, NULL);
+
+		diff(*old, *cur, res);
+		for (size_t i = 0; i < res.Reparented.size(); i++) {
+			Tcl_ListObjAppendElement(NULL, rep, Tcl_NewWideIntObj(res.Reparented[i]->Pid));
+			Tcl_ListObjAppendElement(NULL, rep, Tcl_NewWideIntObj(res.Reparented[i]->Ppid));
+		}
+		Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("created", -1), pidList(res.Created));
+		Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("exited", -1), pidList(res.Exited));
+		Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj("reparented", -1), rep);
+		Tcl_SetObjResult(ip, dict);
+	}
+	// Tcl_SetAssocData doesn't free the previous snapshot
+	Tcl_SetAssocData(ip, SNAPSHOTKEY, freeSnapshot, cur);
+	delete old;
+}
+FINISH
+/*
+	Conversion of FILETIME values to milliseconds since 1970-01-01
+ */
+#define EPOCHDIFF 116444736000000000ULL
+ULONGLONG startMillis(ULONGLONG start) {
+	return start < EPOCHDIFF ? 0 : (start - EPOCHDIFF) / 10000;
+}
+
+/*
+	Command ps
+	Syntax:
+		ps ?-fields fieldlist? ?-filter pattern?
+	Function:
+		Lists the running processes. fieldlist specifies the fields to be
+		returned, any combination of pid, ppid, name, rss, cpu and start.
+		Default is all fields. If pattern has been specified, only
+		processes with matching executable name will be listed.
+	Returns:
+		Dictionary with the specified fields as keys. Each value is a list
+		with one element per process.
+ */
+DECLARE(ps, -1, "?-fields fieldlist? ?-filter pattern?") {
+	static const char *const names[] = { "pid", "ppid", "name", "rss", "cpu", "start", NULL };
+	const char *pattern = NULL;
+	int fields = 0, i, count;
+	Tcl_Obj **elems;
+
+	if (cnt % 2 == 0) {
+		Tcl_WrongNumArgs(ip, 1, objs, "?-fields fieldlist? ?-filter pattern?");
+		return TCL_ERROR;
+	}
+	for (i = 1; i < cnt; i += 2) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-fields") == 0) {
+			if (Tcl_ListObjGetElements(ip, objs[i + 1], &count, &elems) == TCL_ERROR)
+				throw ValueException(ValueException::TypeMismatch, "No list object");
+			while (--count >= 0) {
+				int index;
+
+				if (Tcl_GetIndexFromObj(ip, elems[count], names, "field", 0, &index) != TCL_OK)
+					return TCL_ERROR;
+				fields |= 1 << index;
+			}
+		}
+		else if (strcmp(opt, "-filter") == 0)
+			pattern = Tcl_GetString(objs[i + 1]);
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-fields, -filter)");
+	}
+	if (fields == 0)
+		fields = ProcSnapshot::AllFields;
+
+	ProcSnapshot snap;
+	std::vector<const ProcEntry*> sel;
+
+	if (!snap.take(pattern ? fields | ProcSnapshot::Name : fields))
+		throw ValueException(ValueException::ValueExceptionLimit, "Process snapshot failed");
+	sel.reserve(snap.Procs.size());
+	for (size_t j = 0; j < snap.Procs.size(); j++) {
+		if (pattern == NULL || Tcl_StringCaseMatch(snap.name(snap.Procs[j]), pattern, TCL_MATCH_NOCASE))
+			sel.push_back(&snap.Procs[j]);
+	}
+
+	// Column-oriented result: One list per field, built from one element array
+	Tcl_Obj *dict = Tcl_NewDictObj();
+	Tcl_Obj **col = (Tcl_Obj**)Tcl_Alloc((sel.size() + 1) * sizeof *col);
+
+	for (i = 0; names[i]; i++) {
+		if (!(fields & (1 << i)))
+			continue;
+		for (size_t j = 0; j < sel.size(); j++) {
+			const ProcEntry &p = *sel[j];
+
+			switch (1 << i) {
+			case ProcSnapshot::Pid:		col[j] = Tcl_NewWideIntObj(p.Pid); break;
+			case ProcSnapshot::Ppid:	col[j] = Tcl_NewWideIntObj(p.Ppid); break;
+			case ProcSnapshot::Name:	col[j] = Tcl_NewStringObj(snap.name(p), -1); break;
+			case ProcSnapshot::Rss:		col[j] = Tcl_NewWideIntObj((Tcl_WideInt)p.Rss); break;
+			case ProcSnapshot::Cpu:		col[j] = Tcl_NewWideIntObj((Tcl_WideInt)(p.Cpu / 10000)); break;
+			case ProcSnapshot::Start:	col[j] = Tcl_NewWideIntObj((Tcl_WideInt)startMillis(p.Start)); break;
+			}
+		}
+		Tcl_DictObjPut(NULL, dict, Tcl_NewStringObj(names[i], -1), Tcl_NewListObj((int)sel.size(), col));
+	}
+	Tcl_Free((char*)col);
+	Tcl_SetObjResult(ip, dict);
+}
+FINISH
+/*
+	Command tree
+	Syntax:
+		tree root ?-rollup fieldlist?
+	Function:
+		Lists the process trees of root, a process id or the name of an
+		executable file. Roots which are descendants of other roots will
+		be listed once. fieldlist specifies values to be summed up over
+		each subtree, any combination of rss, cpu and count. The sums will
+		be computed in one post-order pass per root over the parent/child
+		index of one snapshot.
+	Returns:
+		List with one element {pid depth name ?sum ...?} per process, each
+		process before its descendants. The sums follow in the order of
+		fieldlist, cpu in milliseconds.
+ */
+DECLARE(tree, -1, "root ?-rollup fieldlist?") {
+	static const char *const names[] = { "rss", "cpu", "count", NULL };
+	std::vector<int> rollup;
+	Tcl_Obj **elems;
+	int count, i;
+
+	if (cnt != 2 && (cnt != 4 || strcmp(Tcl_GetString(objs[2]), "-rollup") != 0)) {
+		Tcl_WrongNumArgs(ip, 1, objs, "root ?-rollup fieldlist?");
+		return TCL_ERROR;
+	}
+	if (cnt == 4) {
+		if (Tcl_ListObjGetElements(ip, objs[3], &count, &elems) == TCL_ERROR)
+			throw ValueException(ValueException::TypeMismatch, "No list object");
+		for (i = 0; i < count; i++) {
+			int index;
+
+			if (Tcl_GetIndexFromObj(ip, elems[i], names, "field", 0, &index) != TCL_OK)
+				return TCL_ERROR;
+			rollup.push_back(index);
+		}
+	}
+
+	ProcSnapshot snap;
+	ProcTree index;
+	Tcl_WideInt pid = 0;
+	const char *exe = NULL;
+
+	if (Tcl_GetWideIntFromObj(NULL, objs[1], &pid) != TCL_OK)
+		exe = Tcl_GetString(objs[1]);
+	if (!snap.take())
+		throw ValueException(ValueException::ValueExceptionLimit, "Process snapshot failed");
+	index.build(snap);
+
+	size_t j, n = snap.Procs.size();
+	std::vector<char> root(n, 0);
+	std::vector<size_t> order, depth(n, 0);
+	// Sums per process: working set in bytes, CPU time in 100 ns units, number of processes
+	std::vector<ULONGLONG> rss(n), cpu(n), num(n);
+	std::vector<Tcl_Obj*> ent(3 + rollup.size());
+	Tcl_Obj *res = Tcl_NewListObj(0, NULL);
+
+	for (j = 0; j < n; j++)
+		root[j] = exe ? snap.named(snap.Procs[j], exe) : snap.Procs[j].Pid == (DWORD)pid;
+	for (j = 0; j < n; j++) {
+		size_t k;
+
+		if (!root[j])
+			continue;
+		for (k = index.Parent[j]; k != (size_t)ProcTree::NoParent && !root[k]; k = index.Parent[k]);
+		if (k != (size_t)ProcTree::NoParent)
+			continue;
+		order.clear();
+		index.postorder(j, order);
+		for (size_t o = 0; o < order.size(); o++) {
+			size_t p = order[o];
+
+			rss[p] = snap.Procs[p].Rss;
+			cpu[p] = snap.Procs[p].Cpu;
+			num[p] = 1;
+			for (size_t c = index.First[p]; c < index.First[p + 1]; c++) {
+				rss[p] += rss[index.Children[c]];
+				cpu[p] += cpu[index.Children[c]];
+				num[p] += num[index.Children[c]];
+			}
+		}
+		// Reverse post-order lists each process before its descendants
+		depth[j] = 0;
+		for (size_t o = order.size(); o-- > 0; ) {
+			size_t p = order[o];
+
+			if (p != j)
+				depth[p] = depth[index.Parent[p]] + 1;
+			ent[0] = Tcl_NewWideIntObj(snap.Procs[p].Pid);
+			ent[1] = Tcl_NewWideIntObj((Tcl_WideInt)depth[p]);
+			ent[2] = Tcl_NewStringObj(snap.name(snap.Procs[p]), -1);
+			for (i = 0; i < (int)rollup.size(); i++)
+				ent[3 + i] = Tcl_NewWideIntObj((Tcl_WideInt)(rollup[i] == 0 ? rss[p] : rollup[i] == 1 ? cpu[p] / 10000 : num[p]));
+			Tcl_ListObjAppendElement(NULL, res, Tcl_NewListObj((int)ent.size(), &ent[0]));
+		}
+	}
+	Tcl_SetObjResult(ip, res);
+}
+FINISH
+static NewCmdDesc snapshotDesc("::VCRExt::snapshot", snapshot, NULL, NULL);
+static NewCmdDesc psDesc("::VCRExt::ps", ps, NULL, NULL);
+static NewCmdDesc treeDesc("::VCRExt::tree", tree, NULL, NULL);
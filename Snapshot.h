@@ -0,0 +1,119 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef SNAPSHOT_H
+# define SNAPSHOT_H
+# include <windows.h>
+# include <string.h>
+# include <vector>
+
+	/*
+	 * Struct ProcEntry describes one process of a process snapshot. Since process IDs
+	 * will be reused by the system, a process is identified by the pair Pid and Start.
+	 */
+	struct ProcEntry {
+		DWORD Pid, Ppid;
+		ULONGLONG Start;		// Creation time in FILETIME units, 0 if not available
+		ULONGLONG Cpu;			// User plus kernel time in 100 ns units
+		SIZE_T Rss;				// Working set size in bytes
+		size_t Name;			// Offset of UTF-8 encoded executable name in Names
+	};
+
+	/*
+	 * Class ProcSnapshot holds all processes that were running when take() has been
+	 * called. Procs is sorted by process ID, the executable names will be stored in
+	 * one common character array to avoid one allocation per process. fields is a
+	 * combination of the field flags, fields not specified might not be filled.
+	 */
+	class ProcSnapshot {
+	public:
+		enum { Pid = 1, Ppid = 2, Name = 4, Rss = 8, Cpu = 16, Start = 32, AllFields = 63 };
+		std::vector<ProcEntry> Procs;
+		std::vector<char> Names;
+		bool take(int fields = AllFields);			// Returns false if no snapshot could be taken
+		const ProcEntry *find(DWORD pid) const;		// Returns NULL if pid is not in snapshot
+		const char *name(const ProcEntry &p) const {
+			return &Names[p.Name];
+		}
+		// Matching of commands stop, shutdownplan, sampler and tree: Same name, ignoring case
+		bool named(const ProcEntry &p, const char *exe) const {
+			return _stricmp(name(p), exe) == 0;
+		}
+		// Matching of command kill: exe starts with the executable name of p
+		bool prefixed(const ProcEntry &p, const char *exe) const {
+			return *name(p) && strncmp(exe, name(p), strlen(name(p))) == 0;
+		}
+		bool same(const ProcEntry &p, const ProcEntry &q) const {
+			return p.Pid == q.Pid && p.Start == q.Start;
+		}
+		const ProcEntry *parent(const ProcEntry &p) const;	// Returns NULL if parent has exited
+	};
+
+	/*
+	 * Class ProcTree is the parent/child index of a snapshot in compressed sparse row
+	 * form: The children of Procs[i] are Procs[Children[First[i]]] up to, but not
+	 * including, Procs[Children[First[i + 1]]]. Parent[i] is the index of the parent
+	 * of Procs[i] or NoParent. The index will be built in O(n log n) with two passes.
+	 */
+	class ProcTree {
+	public:
+		enum { NoParent = (size_t)-1 };
+		std::vector<size_t> First, Children, Parent;
+		void build(const ProcSnapshot &snap);
+		// Appends the indexes of the subtree of root to order, each process after its descendants
+		void postorder(size_t root, std::vector<size_t> &order) const;
+	};
+
+	/*
+	 * Opens the process described by p with the given access rights. The start time of the
+	 * opened process must match the start time in p, otherwise the process ID has been reused
+	 * and the function fails with ERROR_INVALID_PARAMETER, as if the process had exited.
+	 * Since a process ID will not be reused while a handle is open, the handle identifies the
+	 * process from now on.
+	 */
+	HANDLE openProcess(const ProcEntry &p, DWORD access);
+
+	// Converts a FILETIME value like ProcEntry::Start to milliseconds since 1970, 0 if before
+	ULONGLONG startMillis(ULONGLONG start);
+
+	/*
+	 * Creates a suspended process with command line cl. With job, the process will be
+	 * created in a new process group and assigned to a new job object, returned in jhd.
+	 * If that fails, the process will be terminated with the error code as exit code.
+	 * env is an ANSI environment block or NULL for the environment of the calling process.
+	 * Uses no Tcl objects, therefore it can be called by any thread. Returns 0 on success
+	 * and WIN32 error code otherwise.
+	 */
+	DWORD spawnSuspended(char *cl, bool job, PROCESS_INFORMATION &pi, HANDLE &jhd, char *env = NULL);
+
+	/*
+	 * Returns true if the process with the given ID and start time has been created by
+	 * spawnSuspended() with job. Only such processes lead their own console process group,
+	 * CTRL_BREAK_EVENT sent to any other process ID reaches all processes of the console.
+	 */
+	bool groupLeader(DWORD pid, ULONGLONG start);
+
+	/*
+	 * Struct ProcDiff holds the differences between two snapshots, see diff().
+	 *	Created		Processes in new snapshot, but not in old snapshot
+	 *	Exited		Processes in old snapshot, but not in new snapshot
+	 *	Reparented	Processes in both snapshots whose parent has exited in between
+	 */
+	struct ProcDiff {
+		std::vector<const ProcEntry*> Created, Exited, Reparented;
+	};
+	void diff(const ProcSnapshot &old, const ProcSnapshot &cur, ProcDiff &res);
+#endif
@@ -0,0 +1,283 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "Spawn.h"
+#include "Snapshot.h"
+#include "Stop.h"
+#include "NtDefs.h"
+#include <string.h>
+
+typedef NTSTATUS (WINAPI *NtSetInformationProcessProc)(HANDLE, ULONG, PVOID, ULONG);
+typedef ULONG (WINAPI *RtlNtStatusToDosErrorProc)(NTSTATUS);
+#define ProcessIoPriority 33
+
+/*
+	Conversion of nice values (-20 ... 19) to priority classes. Realtime
+	priority will never be set.
+ */
+static DWORD niceClass(int nice) {
+	if (nice < -10)
+		return HIGH_PRIORITY_CLASS;
+	if (nice < 0)
+		return ABOVE_NORMAL_PRIORITY_CLASS;
+	if (nice == 0)
+		return NORMAL_PRIORITY_CLASS;
+	if (nice <= 10)
+		return BELOW_NORMAL_PRIORITY_CLASS;
+	return IDLE_PRIORITY_CLASS;
+}
+
+static int nameIndex(const char *name, const char *const *names, const char *error) {
+	for (int i = 0; names[i]; i++) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	throw ValueException(ValueException::ValueExceptionLimit, error);
+}
+
+bool schedOption(int &i, int cnt, Tcl_Obj *CONST objs[], SchedParams &sp) {
+	static const char *const policies[] = { "normal", "batch", "idle", NULL };
+	static const char *const ioclasses[] = { "verylow", "low", "normal", "high", NULL };
+	const char *opt = Tcl_GetString(objs[i]);
+
+	if (i + 1 >= cnt)
+		return false;
+	if (strcmp(opt, "-affinity") == 0) {
+		Tcl_Obj **cpus;
+		int count, j, cpu;
+
+		if (Tcl_ListObjGetElements(NULL, objs[i + 1], &count, &cpus) != TCL_OK || count == 0)
+			throw ValueException(ValueException::TypeMismatch, "No list of processor numbers");
+		sp.AffinityMask = 0;
+		for (j = 0; j < count; j++) {
+			if ((cpu = Int(cpus[j])) < 0 || cpu >= (int)sizeof sp.AffinityMask * 8)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (affinity)");
+			sp.AffinityMask |= (DWORD_PTR)1 << cpu;
+		}
+		sp.Fields |= SchedParams::SetAffinity;
+	}
+	else if (strcmp(opt, "-nice") == 0) {
+		int nice = Int(objs[i + 1]);
+
+		if (nice < -20 || nice > 19)
+			throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (-20 - 19)");
+		// An explicit policy takes precedence
+		if (!(sp.Fields & SchedParams::Policy))
+			sp.PriorityClass = niceClass(nice);
+		sp.Fields |= SchedParams::SetPriority;
+	}
+	else if (strcmp(opt, "-policy") == 0) {
+		switch (nameIndex(Tcl_GetString(objs[i + 1]), policies, "Invalid policy (normal, batch, idle)")) {
+		case 1:
+			sp.PriorityClass = BELOW_NORMAL_PRIORITY_CLASS;
+			break;
+		case 2:
+			sp.PriorityClass = IDLE_PRIORITY_CLASS;
+			break;
+		default:
+			sp.PriorityClass = NORMAL_PRIORITY_CLASS;
+		}
+		sp.Fields |= SchedParams::SetPriority | SchedParams::Policy;
+	}
+	else if (strcmp(opt, "-ioprio") == 0) {
+		sp.IoPriority = nameIndex(Tcl_GetString(objs[i + 1]), ioclasses, "Invalid I/O priority (verylow, low, normal, high)");
+		sp.Fields |= SchedParams::SetIoPriority;
+	}
+	else
+		return false;
+	i += 2;
+	return true;
+}
+
+bool limitOption(int &i, int cnt, Tcl_Obj *CONST objs[], JobLimits &jl) {
+	const char *opt = Tcl_GetString(objs[i]);
+	Tcl_WideInt val;
+
+	if (i + 1 >= cnt)
+		return false;
+	if (strcmp(opt, "-maxmemory") != 0 && strcmp(opt, "-jobmemory") != 0 && strcmp(opt, "-cputime") != 0 && strcmp(opt, "-cpurate") != 0 && strcmp(opt, "-maxprocs") != 0)
+		return false;
+	if (Tcl_GetWideIntFromObj(NULL, objs[i + 1], &val) != TCL_OK)
+		throw ValueException(ValueException::TypeMismatch, "No integer value");
+	if (val <= 0)
+		throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (limit must be positive)");
+	if (strcmp(opt, "-maxmemory") == 0)
+		jl.ProcessMemory = (SIZE_T)val;
+	else if (strcmp(opt, "-jobmemory") == 0)
+		jl.JobMemory = (SIZE_T)val;
+	else if (strcmp(opt, "-cputime") == 0)
+		jl.CpuTime = (ULONGLONG)val * 10000000;
+	else if (strcmp(opt, "-cpurate") == 0) {
+		if (val > 100)
+			throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (1 - 100)");
+		jl.CpuRate = (DWORD)val;
+	}
+	else
+		jl.ActiveProcesses = (DWORD)val;
+	i += 2;
+	return true;
+}
+
+DWORD applyLimits(HANDLE job, const JobLimits &jl) {
+	JOBOBJECT_EXTENDED_LIMIT_INFORMATION eli;
+
+	memset(&eli, 0, sizeof eli);
+	if (jl.ProcessMemory) {
+		eli.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+		eli.ProcessMemoryLimit = jl.ProcessMemory;
+	}
+	if (jl.JobMemory) {
+		eli.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+		eli.JobMemoryLimit = jl.JobMemory;
+	}
+	if (jl.CpuTime) {
+		eli.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_PROCESS_TIME;
+		eli.BasicLimitInformation.PerProcessUserTimeLimit.QuadPart = (LONGLONG)jl.CpuTime;
+	}
+	if (jl.ActiveProcesses) {
+		eli.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_ACTIVE_PROCESS;
+		eli.BasicLimitInformation.ActiveProcessLimit = jl.ActiveProcesses;
+	}
+	if (eli.BasicLimitInformation.LimitFlags && !SetInformationJobObject(job, JobObjectExtendedLimitInformation, &eli, sizeof eli))
+		return GetLastError();
+	if (jl.CpuRate) {
+		JOBOBJECT_CPU_RATE_CONTROL_INFORMATION ri;
+
+		memset(&ri, 0, sizeof ri);
+		ri.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP;
+		ri.CpuRate = jl.CpuRate * 100;		// In 1/100 percent
+		if (!SetInformationJobObject(job, JobObjectCpuRateControlInformation, &ri, sizeof ri))
+			return GetLastError();
+	}
+	return 0;
+}
+
+DWORD applySched(HANDLE process, const SchedParams &sp) {
+	static NtSetInformationProcessProc setinfo = (NtSetInformationProcessProc)GetProcAddress(GetModuleHandleA("ntdll.dll"), "NtSetInformationProcess");
+	static RtlNtStatusToDosErrorProc dosError = (RtlNtStatusToDosErrorProc)GetProcAddress(GetModuleHandleA("ntdll.dll"), "RtlNtStatusToDosError");
+	DWORD rc = 0;
+
+	if ((sp.Fields & SchedParams::SetAffinity) && !SetProcessAffinityMask(process, sp.AffinityMask))
+		rc = GetLastError();
+	if ((sp.Fields & SchedParams::SetPriority) && !SetPriorityClass(process, sp.PriorityClass) && rc == 0)
+		rc = GetLastError();
+	if (sp.Fields & SchedParams::SetIoPriority) {
+		ULONG prio = sp.IoPriority;
+		NTSTATUS status;
+
+		if (setinfo == NULL) {
+			if (rc == 0)
+				rc = ERROR_CALL_NOT_IMPLEMENTED;
+		}
+		else if ((status = setinfo(process, ProcessIoPriority, &prio, sizeof prio)) < 0 && rc == 0)
+			rc = dosError == NULL ? ERROR_GEN_FAILURE : dosError(status);
+	}
+	return rc;
+}
+
+DWORD spawnProcess(char *cl, bool job, const SchedParams &sp, const JobLimits &jl, PROCESS_INFORMATION &pi, HANDLE &jhd, DWORD heartbeat, WatchOwner *owner) {
+	std::vector<char> env;
+	int slot = -1;
+	DWORD rc;
+
+	if (heartbeat) {
+		if ((slot = heartbeatSlot()) < 0)
+			return ERROR_NO_MORE_ITEMS;
+		heartbeatEnv(slot, env);
+	}
+	if ((rc = spawnSuspended(cl, job || !jl.empty(), pi, jhd, slot < 0 ? NULL : &env[0])) != 0) {
+		if (slot >= 0)
+			releaseSlot(slot);
+		return rc;
+	}
+	if (!jl.empty())
+		rc = applyLimits(jhd, jl);
+	if (rc == 0 && sp.Fields)
+		rc = applySched(pi.hProcess, sp);
+	if (rc) {
+		TerminateProcess(pi.hProcess, rc);
+		CloseHandle(pi.hThread);
+		CloseHandle(pi.hProcess);
+		if (jhd)
+			CloseHandle(jhd);
+		jhd = NULL;
+		if (slot >= 0)
+			releaseSlot(slot);
+	}
+	else if (slot >= 0)
+		watchProcess(slot, pi.hProcess, pi.dwProcessId, heartbeat, false, owner);
+	return rc;
+}
+
+/*
+	Command setsched
+	Syntax:
+		setsched targets ?-affinity cpulist? ?-nice n? ?-policy policy? ?-ioprio class?
+	Function:
+		Changes the scheduling parameters of running processes. targets is
+		a list of process ids or names of executable files. cpulist is a
+		list of processor numbers, n a nice value between -20 and 19,
+		mapped to the priority classes high (< -10), above normal (< 0),
+		normal (0), below normal (<= 10) and idle. policy is one of normal,
+		batch (below normal) and idle and takes precedence over n. class
+		is one of verylow, low, normal and high (needs privilege).
+	Returns:
+		List with one element per process, containing process id and 0 or
+		the WIN32 error code.
+ */
+DECLARE(setsched, -1, "targets ?-affinity cpulist? ?-nice n? ?-policy policy? ?-ioprio class?") {
+	SchedParams sp;
+	int i;
+
+	if (cnt < 2 || cnt % 2 != 0) {
+		Tcl_WrongNumArgs(ip, 1, objs, "targets ?-affinity cpulist? ?-nice n? ?-policy policy? ?-ioprio class?");
+		return TCL_ERROR;
+	}
+	for (i = 2; i < cnt; ) {
+		if (!schedOption(i, cnt, objs, sp))
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-affinity, -nice, -policy, -ioprio)");
+	}
+
+	ProcSnapshot snap;
+	std::vector<StopTarget> targets;
+	Tcl_Obj *res = Tcl_NewListObj(0, NULL);
+
+	if (!snap.take(ProcSnapshot::Pid | ProcSnapshot::Name | ProcSnapshot::Start))
+		throw ValueException(ValueException::ValueExceptionLimit, "Process snapshot failed");
+	if (!selectTargets(ip, objs[1], snap, targets))
+		return TCL_ERROR;
+	for (size_t j = 0; j < targets.size(); j++) {
+		ProcEntry p;
+		HANDLE hd;
+		DWORD rc;
+		Tcl_Obj *ent[2];
+
+		p.Pid = targets[j].Pid;
+		p.Start = targets[j].Start;
+		if ((hd = openProcess(p, PROCESS_SET_INFORMATION)) == NULL)
+			rc = GetLastError();
+		else {
+			rc = applySched(hd, sp);
+			CloseHandle(hd);
+		}
+		ent[0] = Tcl_NewWideIntObj(p.Pid);
+		ent[1] = Tcl_NewWideIntObj(rc);
+		Tcl_ListObjAppendElement(NULL, res, Tcl_NewListObj(2, ent));
+	}
+	Tcl_SetObjResult(ip, res);
+}
+FINISH
+static NewCmdDesc setschedDesc("::VCRExt::setsched", setsched, NULL, NULL);
@@ -0,0 +1,96 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef SPAWN_H
+# define SPAWN_H
+# include "VCRExtMain.h"
+# include "Watchdog.h"
+# include <windows.h>
+
+	/*
+	 * Struct SchedParams holds the scheduling parameters to be applied to a process.
+	 * Fields is a combination of the field flags, only the specified fields will be
+	 * applied.
+	 */
+	struct SchedParams {
+		enum { SetAffinity = 1, SetPriority = 2, SetIoPriority = 4, Policy = 8 };	// Policy: priority class from -policy
+		int Fields;
+		DWORD_PTR AffinityMask;
+		DWORD PriorityClass;
+		ULONG IoPriority;		// 0: very low, 1: low, 2: normal, 3: high
+		SchedParams() {
+			Fields = 0;
+			AffinityMask = 0;
+			PriorityClass = NORMAL_PRIORITY_CLASS;
+			IoPriority = 2;
+		}
+	};
+
+	/*
+	 * Struct JobLimits holds the limits to be applied to the job of a new process.
+	 * A value of 0 means no limit. ProcessMemory and JobMemory are committed bytes,
+	 * CpuTime is user time per process in 100 ns units, CpuRate is percent of all
+	 * processors for the whole job.
+	 */
+	struct JobLimits {
+		SIZE_T ProcessMemory, JobMemory;
+		ULONGLONG CpuTime;
+		DWORD ActiveProcesses, CpuRate;
+		JobLimits() {
+			ProcessMemory = JobMemory = 0;
+			CpuTime = 0;
+			ActiveProcesses = CpuRate = 0;
+		}
+		bool empty() const {
+			return ProcessMemory == 0 && JobMemory == 0 && CpuTime == 0 && ActiveProcesses == 0 && CpuRate == 0;
+		}
+	};
+
+	/*
+	 * Parses the scheduling option at position i of objs (-affinity, -nice, -policy or
+	 * -ioprio) into sp. Returns false if objs[i] is no scheduling option, otherwise
+	 * increments i behind the option. Throws ValueException for invalid values.
+	 */
+	bool schedOption(int &i, int cnt, Tcl_Obj *CONST objs[], SchedParams &sp);
+
+	/*
+	 * Parses the limit option at position i of objs (-maxmemory, -jobmemory, -cputime,
+	 * -cpurate or -maxprocs) into jl, like schedOption().
+	 */
+	bool limitOption(int &i, int cnt, Tcl_Obj *CONST objs[], JobLimits &jl);
+
+	/*
+	 * Applies jl to the job. The handle needs JOB_OBJECT_SET_ATTRIBUTES access.
+	 * Returns 0 on success, otherwise the WIN32 error code.
+	 */
+	DWORD applyLimits(HANDLE job, const JobLimits &jl);
+
+	/*
+	 * Applies sp to the process. The handle needs PROCESS_SET_INFORMATION access.
+	 * Returns 0 on success, otherwise the WIN32 error code of the first failure.
+	 */
+	DWORD applySched(HANDLE process, const SchedParams &sp);
+
+	/*
+	 * Creates a suspended process like spawnSuspended() and applies sp and jl before
+	 * the process starts. Limits imply a job. If sp or jl cannot be applied, the
+	 * process will be terminated with the WIN32 error code as exit code. With
+	 * heartbeat > 0, the process gets a heartbeat slot and will be watched with
+	 * timeout heartbeat ms, hangs will be reported to owner. Returns 0 on success,
+	 * otherwise the WIN32 error code.
+	 */
+	DWORD spawnProcess(char *cl, bool job, const SchedParams &sp, const JobLimits &jl, PROCESS_INFORMATION &pi, HANDLE &jhd, DWORD heartbeat = 0, WatchOwner *owner = NULL);
+#endif
@@ -0,0 +1,722 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "VCRExtMain.h"
+#include "Stop.h"
+#include "Waiter.h"
+#include "Metrics.h"
+#include "Worker.h"
+#include <algorithm>
+#include <string>
+
+// Max. time to wait for killed processes to vanish
+#define KILLWAIT 1000
+
+static bool targetLess(const StopTarget &a, const StopTarget &b) {
+	return a.Pid < b.Pid;
+}
+
+bool selectTargets(Tcl_Interp *ip, Tcl_Obj *list, const ProcSnapshot &snap, std::vector<StopTarget> &targets) {
+	Tcl_Obj **elems;
+	int count, i;
+	StopTarget t;
+
+	if (Tcl_ListObjGetElements(ip, list, &count, &elems) == TCL_ERROR)
+		return false;
+	t.Handle = NULL;
+	t.Outcome = StopTarget::Pending;
+	t.Error = 0;
+	t.Micros = 0;
+	for (i = 0; i < count; i++) {
+		int pid;
+
+		if (Tcl_GetIntFromObj(NULL, elems[i], &pid) == TCL_OK) {
+			const ProcEntry *p = snap.find(pid);
+
+			if (p)
+				t.Pid = p->Pid, t.Start = p->Start, targets.push_back(t);
+		}
+		else {
+			const char *name = Tcl_GetString(elems[i]);
+
+			for (size_t j = 0; j < snap.Procs.size(); j++) {
+				if (snap.named(snap.Procs[j], name))
+					t.Pid = snap.Procs[j].Pid, t.Start = snap.Procs[j].Start, targets.push_back(t);
+			}
+		}
+	}
+	// Remove duplicates
+	std::sort(targets.begin(), targets.end(), targetLess);
+	for (size_t j = 1; j < targets.size(); ) {
+		if (targets[j].Pid == targets[j - 1].Pid)
+			targets.erase(targets.begin() + j);
+		else
+			j++;
+	}
+	return true;
+}
+
+void openTargets(std::vector<StopTarget> &targets) {
+	for (size_t i = 0; i < targets.size(); i++) {
+		StopTarget &t = targets[i];
+		ProcEntry p;
+
+		if (t.Handle || t.Outcome != StopTarget::Pending)
+			continue;
+		p.Pid = t.Pid;
+		p.Start = t.Start;
+		if ((t.Handle = openProcess(p, SYNCHRONIZE | PROCESS_TERMINATE)) == NULL) {
+			// ERROR_INVALID_PARAMETER: Process has gone in between
+			t.Error = GetLastError();
+			t.Outcome = t.Error == ERROR_INVALID_PARAMETER ? StopTarget::Exited : StopTarget::Failed;
+		}
+	}
+}
+
+/*
+	Targets of closeWindow(): The targets, sorted by process ID, and one
+	flag per target whether its windows shall be closed.
+ */
+struct CloseTargets {
+	std::vector<StopTarget> *Targets;
+	std::vector<char> Close;
+};
+/*
+	EnumWindows callback: Posts WM_CLOSE to all windows owned by one of the
+	target processes marked in Close.
+ */
+static BOOL CALLBACK closeWindow(HWND hwnd, LPARAM arg) {
+	CloseTargets &ct = *(CloseTargets*)arg;
+	StopTarget key;
+
+	GetWindowThreadProcessId(hwnd, &key.Pid);
+	std::vector<StopTarget>::iterator it = std::lower_bound(ct.Targets->begin(), ct.Targets->end(), key, targetLess);
+	if (it != ct.Targets->end() && it->Pid == key.Pid && it->Handle && ct.Close[it - ct.Targets->begin()])
+		PostMessageA(hwnd, WM_CLOSE, 0, 0);
+	return TRUE;
+}
+
+/*
+	One stop of a set of targets, split in its phases: signal() sends the
+	soft signal and starts the multiplexed wait, wait() waits for the
+	targets, kill() kills the survivors and finish() sets the outcomes and
+	closes the handles. End times will be stored in Ended. If the waiter
+	could not be started, the handles will be waited for one after the
+	other.
+ */
+class StopRun {
+	std::vector<StopTarget> &Targets;
+	HandleWaiter Waiter;
+	std::vector<size_t> Slot;
+	std::vector<ULONGLONG> Ended;
+	ULONGLONG Begin;
+	bool Started;
+public:
+	StopRun(std::vector<StopTarget> &targets) : Targets(targets), Slot(targets.size()), Ended(targets.size(), 0) {
+		Begin = nowMicros();
+		Started = false;
+	}
+	bool started() const {
+		return Started;
+	}
+	HANDLE event() const {				// Set when all targets have ended
+		return Waiter.event();
+	}
+	void signal(int signal);
+	bool wait(DWORD ms);				// Returns true if all targets have ended
+	void kill(UINT exitcode);
+	void finish();
+};
+
+/*
+	Sends the soft signal to all targets at once. CTRL_BREAK_EVENT will only
+	be sent to leaders of their own process groups, any other process ID
+	would reach all processes of the console, including the calling process.
+	The other targets get WM_CLOSE instead.
+ */
+void StopRun::signal(int signal) {
+	CloseTargets ct;
+	bool close = false;
+	size_t i;
+
+	std::sort(Targets.begin(), Targets.end(), targetLess);
+	ct.Targets = &Targets;
+	ct.Close.assign(Targets.size(), (signal & SignalClose) != 0);
+	for (i = 0; i < Targets.size(); i++) {
+		if (Targets[i].Handle == NULL)
+			continue;
+		Slot[i] = Waiter.add(Targets[i].Handle);
+		if (signal & SignalBreak) {
+			if (groupLeader(Targets[i].Pid, Targets[i].Start))
+				GenerateConsoleCtrlEvent(CTRL_BREAK_EVENT, Targets[i].Pid);
+			else
+				ct.Close[i] = 1;
+		}
+		close = close || ct.Close[i];
+	}
+	if (close)
+		EnumWindows(closeWindow, (LPARAM)&ct);
+	Started = Waiter.start();
+}
+bool StopRun::wait(DWORD ms) {
+	ULONGLONG end = GetTickCount64() + ms;
+	bool all = Started ? Waiter.wait(ms) : true;
+
+	for (size_t i = 0; i < Targets.size(); i++) {
+		if (Targets[i].Handle == NULL || Ended[i])
+			continue;
+		if (Started)
+			Ended[i] = Waiter.signalled(Slot[i]);
+		else {
+			ULONGLONG now = GetTickCount64();
+
+			if (WaitForSingleObject(Targets[i].Handle, now < end ? (DWORD)(end - now) : 0) == WAIT_OBJECT_0)
+				Ended[i] = nowMicros();
+			else
+				all = false;
+		}
+	}
+	return all;
+}
+void StopRun::kill(UINT exitcode) {
+	for (size_t i = 0; i < Targets.size(); i++) {
+		if (Targets[i].Handle && Ended[i] == 0) {
+			if (TerminateProcess(Targets[i].Handle, exitcode)) {
+				Targets[i].Outcome = StopTarget::Killed;
+				countMetric(extMetrics.Killed);
+			}
+			else {
+				Targets[i].Outcome = StopTarget::Failed;
+				Targets[i].Error = GetLastError();
+			}
+		}
+	}
+}
+void StopRun::finish() {
+	for (size_t i = 0; i < Targets.size(); i++) {
+		StopTarget &t = Targets[i];
+
+		if (t.Handle == NULL)
+			continue;
+		if (Ended[i]) {
+			countMetric(extMetrics.Reaped);
+			if (t.Outcome == StopTarget::Pending)
+				t.Outcome = StopTarget::Exited;
+			t.Micros = Ended[i] - Begin;
+		}
+		else {
+			if (t.Outcome == StopTarget::Killed)
+				t.Outcome = StopTarget::Hung;
+			t.Micros = nowMicros() - Begin;
+		}
+		CloseHandle(t.Handle);
+		t.Handle = NULL;
+	}
+}
+
+/*
+	Sends the soft signal to all targets at once and waits with one multiplexed
+	wait until all targets have finished or the grace period has elapsed. Only
+	the survivors will be killed afterwards.
+ */
+void stopProcesses(std::vector<StopTarget> &targets, int signal, DWORD grace, UINT exitcode) {
+	StopRun run(targets);
+
+	run.signal(signal);
+	if (!run.wait(grace)) {
+		run.kill(exitcode);
+		run.wait(KILLWAIT);
+	}
+	run.finish();
+}
+
+const char *outcomeName(int outcome) {
+	static const char *const names[] = { "pending", "exited", "killed", "hung", "failed" };
+
+	return names[outcome];
+}
+
+Tcl_Obj *stopReport(const std::vector<StopTarget> &targets) {
+	Tcl_Obj *res = Tcl_NewListObj(0, NULL);
+
+	for (size_t i = 0; i < targets.size(); i++) {
+		Tcl_Obj *ent[3];
+
+		ent[0] = Tcl_NewWideIntObj(targets[i].Pid);
+		ent[1] = Tcl_NewStringObj(outcomeName(targets[i].Outcome), -1);
+		ent[2] = Tcl_NewWideIntObj((Tcl_WideInt)(targets[i].Micros / 1000));
+		Tcl_ListObjAppendElement(NULL, res, Tcl_NewListObj(3, ent));
+	}
+	return res;
+}
+
+/*
+	Parses the signal name used by commands stop and shutdownplan
+ */
+int signalValue(const char *name) {
+	static const char *const names[] = { "NONE", "CLOSE", "BREAK", "TERM" };
+
+	for (int i = 0; i < 4; i++) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	throw ValueException(ValueException::ValueExceptionLimit, "Invalid signal (NONE, CLOSE, BREAK, TERM)");
+}
+
+/*
+	Stop for stop -async and within coroutines. The interpreter thread
+	signals the targets and waits for them via its event loop: A thread
+	pool wait on the event of the multiplexed wait queues an event when all
+	targets have ended, a timer handler kills the survivors when the grace
+	period has elapsed and finishes the stop KILLWAIT ms later. No thread
+	will be blocked. If the multiplexed wait is not available, a worker
+	thread waits instead (run()).
+ */
+class StopWatch : public AsyncJob {
+	std::vector<StopTarget> Targets;
+	StopRun Run;
+	int Signal;
+	DWORD Grace;
+	UINT Exitcode;
+	Tcl_ThreadId Thread;
+	HANDLE Wait;
+	Tcl_TimerToken Timer;
+	bool Killed;
+	struct EndedEvent {
+		Tcl_Event Header;			// Must be the first member
+		StopWatch *Watch;
+	};
+	static VOID CALLBACK ended(PVOID arg, BOOLEAN);
+	static int endedEvent(Tcl_Event *ev, int flags);
+	static int dropEvent(Tcl_Event *ev, ClientData cd);
+	static void expired(ClientData cd);
+	void finish(bool event);
+public:
+	StopWatch(Tcl_Interp *ip, Tcl_Obj *callback, const std::vector<StopTarget> &targets, int signal, DWORD grace, UINT exitcode) : AsyncJob(ip, callback), Targets(targets), Run(Targets) {
+		Signal = signal;
+		Grace = grace;
+		Exitcode = exitcode;
+		Thread = Tcl_GetCurrentThread();
+		Wait = NULL;
+		Timer = NULL;
+		Killed = false;
+	}
+	~StopWatch() {
+		// Handles remain open if the stop has never been finished
+		for (size_t i = 0; i < Targets.size(); i++) {
+			if (Targets[i].Handle)
+				CloseHandle(Targets[i].Handle);
+		}
+	}
+	bool start();
+	void run() {
+		if (!Run.wait(Grace)) {
+			Run.kill(Exitcode);
+			Run.wait(KILLWAIT);
+		}
+		Run.finish();
+	}
+	Tcl_Obj *result() {
+		return stopReport(Targets);
+	}
+};
+/*
+	Sends the soft signal and arms wait and timer. Returns false if the
+	targets must be waited for by run() instead.
+ */
+bool StopWatch::start() {
+	Run.signal(Signal);
+	if (!Run.started() || !RegisterWaitForSingleObject(&Wait, Run.event(), ended, this, INFINITE, WT_EXECUTEONLYONCE)) {
+		Wait = NULL;
+		return false;
+	}
+	Timer = Tcl_CreateTimerHandler(Grace, expired, this);
+	return true;
+}
+// Wait callback, invoked by the system thread pool when all targets have ended
+VOID CALLBACK StopWatch::ended(PVOID arg, BOOLEAN) {
+	StopWatch *watch = (StopWatch*)arg;
+	EndedEvent *ev = (EndedEvent*)Tcl_Alloc(sizeof *ev);
+
+	ev->Header.proc = endedEvent;
+	ev->Header.nextPtr = NULL;
+	ev->Watch = watch;
+	Tcl_ThreadQueueEvent(watch->Thread, &ev->Header, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(watch->Thread);
+}
+int StopWatch::endedEvent(Tcl_Event *ev, int) {
+	((EndedEvent*)ev)->Watch->finish(true);
+	return 1;
+}
+int StopWatch::dropEvent(Tcl_Event *ev, ClientData cd) {
+	return ev->proc == endedEvent && ((EndedEvent*)ev)->Watch == (StopWatch*)cd;
+}
+void StopWatch::expired(ClientData cd) {
+	StopWatch *watch = (StopWatch*)cd;
+
+	watch->Timer = NULL;
+	if (watch->Killed || watch->Run.wait(0))
+		watch->finish(false);
+	else {
+		watch->Run.kill(watch->Exitcode);
+		watch->Killed = true;
+		watch->Timer = Tcl_CreateTimerHandler(KILLWAIT, expired, watch);
+	}
+}
+/*
+	Finishes the stop and queues the result. event tells whether invoked
+	by the event of the wait callback, otherwise an event queued in the
+	meantime will be removed.
+ */
+void StopWatch::finish(bool event) {
+	if (Timer) {
+		Tcl_DeleteTimerHandler(Timer);
+		Timer = NULL;
+	}
+	// INVALID_HANDLE_VALUE: Wait until a running callback has been finished
+	UnregisterWaitEx(Wait, INVALID_HANDLE_VALUE);
+	Wait = NULL;
+	if (!event)
+		Tcl_DeleteEvents(dropEvent, this);
+	Run.wait(0);
+	Run.finish();
+	complete();
+}
+/*
+	Command stop
+	Syntax:
+		stop targets ?-grace ms? ?-signal signal? ?-exitcode exitcode? ?-async callback?
+	Function:
+		Stops the processes specified by targets, a list of process ids
+		or names of executable files (case-insensitive, no prefixes as with
+		kill). The soft signal will be sent to all processes, after grace
+		milliseconds, the remaining processes will be killed with exit code
+		exitcode. signal is one of NONE, CLOSE,
+		BREAK and TERM (CLOSE + BREAK). BREAK reaches only processes started
+		with option -job, the other processes get CLOSE. Default is -grace 5000
+		-signal TERM -exitcode 0.
+		With option -async, stop returns immediately, the event loop waits
+		for the processes and callback will be invoked with the result
+		appended. Within a coroutine, stop without option -async suspends
+		the coroutine instead of the thread (Tcl 8.6 or later).
+	Returns:
+		List with one element per process, containing process id, outcome
+		(exited, killed, hung or failed) and the time in milliseconds
+		until the process ended. Nothing with option -async.
+ */
+DECLARE(stop, -1, "targets ?-grace ms? ?-signal signal? ?-exitcode exitcode? ?-async callback?") {
+	int signal = SignalTerm, grace = 5000, exitcode = 0, i;
+	Tcl_Obj *callback = NULL;
+
+	if (cnt < 2 || cnt % 2 != 0) {
+		Tcl_WrongNumArgs(ip, 1, objs, "targets ?-grace ms? ?-signal signal? ?-exitcode exitcode? ?-async callback?");
+		return TCL_ERROR;
+	}
+	for (i = 2; i < cnt; i += 2) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-grace") == 0)
+			grace = Int(objs[i + 1]);
+		else if (strcmp(opt, "-signal") == 0)
+			signal = signalValue(String(objs[i + 1]));
+		else if (strcmp(opt, "-exitcode") == 0)
+			exitcode = Int(objs[i + 1]);
+		else if (strcmp(opt, "-async") == 0)
+			callback = objs[i + 1];
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-grace, -signal, -exitcode, -async)");
+	}
+	if (grace < 0)
+		throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (grace)");
+
+	ProcSnapshot snap;
+	std::vector<StopTarget> targets;
+
+	if (!snap.take(ProcSnapshot::Pid | ProcSnapshot::Name | ProcSnapshot::Start))
+		throw ValueException(ValueException::ValueExceptionLimit, "Process snapshot failed");
+	if (!selectTargets(ip, objs[1], snap, targets))
+		return TCL_ERROR;
+	openTargets(targets);
+	if (callback) {
+		StopWatch *watch = new StopWatch(ip, callback, targets, signal, grace, exitcode);
+
+		if (!watch->start() && !submitJob(watch)) {
+			// Neither the multiplexed wait nor the worker pool is available
+			watch->run();
+			watch->complete();
+		}
+	}
+	else {
+		stopProcesses(targets, signal, grace, exitcode);
+		Tcl_SetObjResult(ip, stopReport(targets));
+	}
+}
+FINISH
+static int stopNR(ClientData cd, Tcl_Interp *ip, int cnt, Tcl_Obj *CONST objs[]) {
+	return yieldAsync(stop, cnt, cd, ip, cnt, objs);
+}
+static NewCmdDesc stopDesc("::VCRExt::stop", stop, NULL, NULL, stopNR);
+
+/*
+	Shutdown plan: One node per group of processes. A node will be stopped
+	by its own thread as soon as all nodes it depends on have finished.
+	Finished nodes will be reported to the coordinating thread via an I/O
+	completion port.
+ */
+struct PlanNode {
+	std::string Name;
+	std::vector<StopTarget> Targets;
+	std::vector<size_t> Next;		// Nodes depending on this node
+	int Pending;					// Number of unfinished nodes this node depends on
+	int Signal;
+	DWORD Grace;
+	ULONGLONG Begin, End;			// Microseconds since begin of plan
+};
+struct PlanRun {
+	std::vector<PlanNode> Nodes;
+	std::vector<HANDLE> Threads;	// Node threads, joined before the command returns
+	HANDLE Port;
+	UINT Exitcode;
+	ULONGLONG Begin;
+};
+struct PlanStart {
+	PlanRun *Run;
+	size_t Index;
+};
+
+static void runNode(PlanRun *run, size_t i) {
+	PlanNode &node = run->Nodes[i];
+
+	stopProcesses(node.Targets, node.Signal, node.Grace, run->Exitcode);
+	node.End = nowMicros() - run->Begin;
+	PostQueuedCompletionStatus(run->Port, 0, i, NULL);
+}
+static DWORD WINAPI nodeThread(LPVOID arg) {
+	PlanStart *ps = (PlanStart*)arg;
+
+	runNode(ps->Run, ps->Index);
+	delete ps;
+	return 0;
+}
+static void startNode(PlanRun *run, size_t i) {
+	PlanStart *ps = new PlanStart;
+	HANDLE thd;
+
+	run->Nodes[i].Begin = nowMicros() - run->Begin;
+	ps->Run = run;
+	ps->Index = i;
+	if ((thd = CreateThread(NULL, 0, nodeThread, ps, 0, NULL)) != NULL)
+		run->Threads.push_back(thd);
+	else {
+		// No thread available: Stop the node in the coordinating thread
+		delete ps;
+		runNode(run, i);
+	}
+}
+
+/*
+	Parses plan into run. Returns false if plan is no valid dictionary.
+	Throws ValueException for invalid node specifications, unknown
+	dependencies and cycles.
+ */
+static bool parsePlan(Tcl_Interp *ip, Tcl_Obj *plan, const ProcSnapshot &snap, int signal, PlanRun &run) {
+	String targets("targets"), grace("grace"), sig("signal"), after("after");
+	std::vector<Tcl_Obj*> specs;
+	Tcl_DictSearch search;
+	Tcl_Obj *key, *spec;
+	int done;
+	size_t i, j;
+
+	if (Tcl_DictObjFirst(ip, plan, &search, &key, &spec, &done) != TCL_OK)
+		return false;
+	for (; !done; Tcl_DictObjNext(&search, &key, &spec, &done)) {
+		PlanNode node;
+
+		node.Name = Tcl_GetString(key);
+		node.Pending = 0;
+		node.Signal = signal;
+		node.Grace = 5000;
+		node.Begin = node.End = 0;
+		run.Nodes.push_back(node);
+		specs.push_back(spec);
+	}
+	Tcl_DictObjDone(&search);
+	for (i = 0; i < run.Nodes.size(); i++) {
+		PlanNode &node = run.Nodes[i];
+		Tcl_Obj *val;
+
+		if (Tcl_DictObjGet(ip, specs[i], targets, &val) != TCL_OK || val == NULL || !selectTargets(ip, val, snap, node.Targets))
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid node specification (targets missing)");
+		if (Tcl_DictObjGet(NULL, specs[i], grace, &val) == TCL_OK && val) {
+			int ms = Int(val);
+
+			if (ms < 0)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (grace)");
+			node.Grace = ms;
+		}
+		if (Tcl_DictObjGet(NULL, specs[i], sig, &val) == TCL_OK && val)
+			node.Signal = signalValue(Tcl_GetString(val));
+	}
+	// Dependencies, all node names are known now
+	for (i = 0; i < run.Nodes.size(); i++) {
+		Tcl_Obj **deps, *val;
+		int count, k;
+
+		if (Tcl_DictObjGet(NULL, specs[i], after, &val) != TCL_OK || val == NULL)
+			continue;
+		if (Tcl_ListObjGetElements(ip, val, &count, &deps) != TCL_OK)
+			return false;
+		for (k = 0; k < count; k++) {
+			for (j = 0; j < run.Nodes.size() && run.Nodes[j].Name != Tcl_GetString(deps[k]); j++)
+				;
+			if (j == run.Nodes.size())
+				throw ValueException(ValueException::ValueExceptionLimit, "Unknown node in after list");
+			run.Nodes[j].Next.push_back(i);
+			run.Nodes[i].Pending++;
+		}
+	}
+	// Cycle check (Kahn): All nodes must be reachable from the nodes without dependencies
+	std::vector<int> pending(run.Nodes.size());
+	std::vector<size_t> ready;
+	size_t visited = 0;
+
+	for (i = 0; i < run.Nodes.size(); i++) {
+		if ((pending[i] = run.Nodes[i].Pending) == 0)
+			ready.push_back(i);
+	}
+	while (!ready.empty()) {
+		i = ready.back();
+		ready.pop_back();
+		visited++;
+		for (j = 0; j < run.Nodes[i].Next.size(); j++) {
+			if (--pending[run.Nodes[i].Next[j]] == 0)
+				ready.push_back(run.Nodes[i].Next[j]);
+		}
+	}
+	if (visited != run.Nodes.size())
+		throw ValueException(ValueException::ValueExceptionLimit, "Cyclic dependencies in plan");
+	return true;
+}
+
+/*
+	Command shutdownplan
+	Syntax:
+		shutdownplan plan ?-signal signal? ?-exitcode exitcode?
+	Function:
+		Stops groups of processes in dependency order. plan is a
+		dictionary with one node per group, the key is the node name, the
+		value a dictionary with the following keys:
+			targets	Processes to be stopped, as in command stop
+			grace	Deadline of the node in milliseconds, default 5000
+			signal	Soft signal, default as specified by -signal
+			after	List of nodes that must be finished before the node
+					will be stopped
+		All nodes whose dependencies are finished will be stopped in
+		parallel, each like command stop. Default is -signal TERM
+		-exitcode 0. The processes will be selected from one snapshot,
+		taken when the command starts.
+	Returns:
+		List with one element per node, containing node name, start and
+		end time in milliseconds since begin of the command and a list as
+		returned by command stop.
+ */
+DECLARE(shutdownplan, -1, "plan ?-signal signal? ?-exitcode exitcode?") {
+	int signal = SignalTerm, exitcode = 0, i;
+
+	if (cnt < 2 || cnt % 2 != 0) {
+		Tcl_WrongNumArgs(ip, 1, objs, "plan ?-signal signal? ?-exitcode exitcode?");
+		return TCL_ERROR;
+	}
+	for (i = 2; i < cnt; i += 2) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-signal") == 0)
+			signal = signalValue(String(objs[i + 1]));
+		else if (strcmp(opt, "-exitcode") == 0)
+			exitcode = Int(objs[i + 1]);
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-signal, -exitcode)");
+	}
+
+	ProcSnapshot snap;
+	PlanRun run;
+	size_t n, finished;
+
+	if (!snap.take(ProcSnapshot::Pid | ProcSnapshot::Name | ProcSnapshot::Start))
+		throw ValueException(ValueException::ValueExceptionLimit, "Process snapshot failed");
+	if (!parsePlan(ip, objs[1], snap, signal, run))
+		return TCL_ERROR;
+	if ((run.Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0)) == NULL)
+		throw ValueException(ValueException::ValueExceptionLimit, "Completion port not available");
+	run.Exitcode = exitcode;
+	run.Begin = nowMicros();
+	for (n = 0; n < run.Nodes.size(); n++) {
+		openTargets(run.Nodes[n].Targets);
+		if (run.Nodes[n].Pending == 0)
+			startNode(&run, n);
+	}
+	const char *error = NULL;
+
+	for (finished = 0; finished < run.Nodes.size(); finished++) {
+		DWORD bytes;
+		ULONG_PTR key;
+		LPOVERLAPPED ov;
+
+		if (!GetQueuedCompletionStatus(run.Port, &bytes, &key, &ov, INFINITE)) {
+			error = "Completion port failed, plan aborted";
+			break;
+		}
+		if (key >= run.Nodes.size()) {
+			error = "Invalid completion key, plan aborted";
+			break;
+		}
+		for (n = 0; n < run.Nodes[key].Next.size(); n++) {
+			if (--run.Nodes[run.Nodes[key].Next[n]].Pending == 0)
+				startNode(&run, run.Nodes[key].Next[n]);
+		}
+	}
+	// The threads may still be returning, the extension could be unloaded afterwards
+	for (n = 0; n < run.Threads.size(); n++) {
+		WaitForSingleObject(run.Threads[n], INFINITE);
+		CloseHandle(run.Threads[n]);
+	}
+	CloseHandle(run.Port);
+	if (error) {
+		// Nodes never started still hold the handles of their targets
+		for (n = 0; n < run.Nodes.size(); n++) {
+			for (size_t t = 0; t < run.Nodes[n].Targets.size(); t++) {
+				if (run.Nodes[n].Targets[t].Handle)
+					CloseHandle(run.Nodes[n].Targets[t].Handle);
+			}
+		}
+		throw ValueException(ValueException::ValueExceptionLimit, error);
+	}
+
+	Tcl_Obj *res = Tcl_NewListObj(0, NULL);
+
+	for (n = 0; n < run.Nodes.size(); n++) {
+		Tcl_Obj *ent[4];
+
+		ent[0] = Tcl_NewStringObj(run.Nodes[n].Name.c_str(), -1);
+		ent[1] = Tcl_NewWideIntObj((Tcl_WideInt)(run.Nodes[n].Begin / 1000));
+		ent[2] = Tcl_NewWideIntObj((Tcl_WideInt)(run.Nodes[n].End / 1000));
+		ent[3] = stopReport(run.Nodes[n].Targets);
+		Tcl_ListObjAppendElement(NULL, res, Tcl_NewListObj(4, ent));
+	}
+	Tcl_SetObjResult(ip, res);
+}
+FINISH
+static NewCmdDesc shutdownplanDesc("::VCRExt::shutdownplan", shutdownplan, NULL, NULL);
@@ -0,0 +1,57 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef STOP_H
+# define STOP_H
+# include "Snapshot.h"
+
+	/*
+	 * Struct StopTarget describes one process to be stopped by stopProcesses().
+	 * Handle will be opened by openTargets(), Outcome, Error and Micros will be
+	 * set by stopProcesses(). Micros is the time between begin of stop and
+	 * process end.
+	 */
+	struct StopTarget {
+		enum { Pending, Exited, Killed, Hung, Failed };
+		DWORD Pid;
+		ULONGLONG Start;
+		HANDLE Handle;
+		int Outcome;
+		DWORD Error;
+		ULONGLONG Micros;
+	};
+
+	/*
+	 * Soft signals to be sent by stopProcesses():
+	 *	SignalClose		WM_CLOSE to all top-level windows of the process
+	 *	SignalBreak		CTRL_BREAK_EVENT to the console process group of the process
+	 *	SignalTerm		Both
+	 */
+	enum { SignalNone = 0, SignalClose = 1, SignalBreak = 2, SignalTerm = 3 };
+
+	// Adds all processes of snap specified by ID or executable name in list to targets
+	bool selectTargets(Tcl_Interp *ip, Tcl_Obj *list, const ProcSnapshot &snap, std::vector<StopTarget> &targets);
+	// Opens handles of all targets, targets that cannot be opened will be marked as failed
+	void openTargets(std::vector<StopTarget> &targets);
+	// Sends soft signal, waits grace ms and kills the survivors. Closes all handles.
+	void stopProcesses(std::vector<StopTarget> &targets, int signal, DWORD grace, UINT exitcode);
+	// Returns signal value for signal name, throws ValueException for invalid names
+	int signalValue(const char *name);
+	// Returns outcome name
+	const char *outcomeName(int outcome);
+	// Returns list of {pid outcome ms} lists
+	Tcl_Obj *stopReport(const std::vector<StopTarget> &targets);
+#endif
@@ -0,0 +1,785 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "VCRExtMain.h"
+#include "IoPort.h"
+#include "Snapshot.h"
+#include "Metrics.h"
+#include "Stop.h"
+#include "TimerWheel.h"
+#include "Watchdog.h"
+#include <deque>
+#include <map>
+#include <new>
+#include <string>
+
+// Length of one timer wheel tick in milliseconds
+#define TICKMS 10
+// Defaults for restart intensity and backoff
+#define DEFINTENSITY 10
+#define DEFPERIOD 60000
+#define DEFMINDELAY 100
+#define DEFMAXDELAY 30000
+
+struct Supervisor;
+struct ExitEntry;
+
+// Completion key of the wait completion packet of an ExitEntry
+class ExitClient : public PortClient {
+public:
+	ExitEntry *Entry;
+	void completed(DWORD bytes, OVERLAPPED *ov);
+};
+
+/*
+	Exit notification of one incarnation of a child. Client will be
+	associated with the process as wait completion packet of the I/O
+	completion port, before Windows 8 the entry will be passed as context to
+	a thread pool wait. Either callback queues the entry. Fired tells
+	whether the entry has been queued.
+ */
+struct ExitEntry {
+	SLIST_ENTRY Link;			// Must be the first member
+	Supervisor *Owner;
+	ULONG Serial;
+	volatile LONG Fired;
+	ExitClient Client;
+};
+
+/*
+	One supervised child. Serial identifies the current incarnation, exit
+	notifications of former incarnations will be ignored.
+ */
+struct Child {
+	enum { Permanent, Transient, Temporary };
+	enum { Running, Backoff, Exited };
+	std::string Id, Cmd;
+	ULONG Serial;
+	int Policy, State, Restarts;
+	bool Job;
+	DWORD MinDelay, MaxDelay, Delay, Pid, ExitCode;
+	DWORD Heartbeat;			// Watchdog timeout in ms, 0: not watched
+	HANDLE Process, JobHandle, Wait, Packet;
+	ExitEntry *Entry;
+	ULONGLONG Started;
+	TimerNode Timer;
+};
+
+/*
+	Per-interpreter supervisor. The supervisor thread handles exit
+	notifications and restart timers, commands of the interpreter thread
+	change the children. Both hold Lock while accessing children, wheel
+	and restart history.
+ */
+struct Supervisor {
+	SLIST_HEADER Exits;			// Lock-free queue of ExitEntry, filled by wait callbacks
+	CRITICAL_SECTION Lock;
+	std::map<std::string, Child*> Children;
+	std::map<ULONG, Child*> Serials;
+	ULONG NextSerial;
+	TimerWheel Wheel;
+	ULONGLONG Base;				// Tick count at wheel tick 0
+	std::deque<ULONGLONG> Recent;	// Restart times within the intensity period
+	int Intensity;
+	DWORD Period;
+	HANDLE Wake, Thread;
+	volatile bool Closing;
+	Tcl_Interp *Ip;
+	Tcl_ThreadId Owner;
+	Tcl_Obj *Callback;			// Used by interpreter thread only
+};
+
+/*
+	Notifications passed to the interpreter thread
+ */
+enum { NoticeExited, NoticeRestarted, NoticeFailed, NoticeShutdown };
+struct NoticeEvent {
+	Tcl_Event Header;			// Must be the first member
+	Supervisor *Owner;
+	int Event;
+	std::string *Id;
+	DWORD Pid, Code;
+};
+
+static int noticeEvent(Tcl_Event *ev, int) {
+	static const char *const names[] = { "exited", "restarted", "failed", "shutdown" };
+	NoticeEvent *ne = (NoticeEvent*)ev;
+	Supervisor *sup = ne->Owner;
+
+	if (sup->Callback && !Tcl_InterpDeleted(sup->Ip)) {
+		Tcl_Obj *cmd = Tcl_DuplicateObj(sup->Callback), *info[4];
+
+		info[0] = Tcl_NewStringObj(names[ne->Event], -1);
+		info[1] = Tcl_NewStringObj(ne->Id->c_str(), -1);
+		info[2] = Tcl_NewWideIntObj(ne->Pid);
+		info[3] = Tcl_NewWideIntObj(ne->Code);
+		Tcl_IncrRefCount(cmd);
+		Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewListObj(4, info));
+		if (Tcl_EvalObjEx(sup->Ip, cmd, TCL_EVAL_GLOBAL) == TCL_ERROR)
+			Tcl_BackgroundError(sup->Ip);
+		Tcl_DecrRefCount(cmd);
+	}
+	delete ne->Id;
+	return 1;
+}
+static int dropNotice(Tcl_Event *ev, ClientData cd) {
+	if (ev->proc != noticeEvent || ((NoticeEvent*)ev)->Owner != (Supervisor*)cd)
+		return 0;
+	delete ((NoticeEvent*)ev)->Id;
+	return 1;
+}
+static void notify(Supervisor *sup, int event, const std::string &id, DWORD pid, DWORD code) {
+	NoticeEvent *ne = (NoticeEvent*)Tcl_Alloc(sizeof *ne);
+
+	ne->Header.proc = noticeEvent;
+	ne->Header.nextPtr = NULL;
+	ne->Owner = sup;
+	ne->Event = event;
+	ne->Id = new std::string(id);
+	ne->Pid = pid;
+	ne->Code = code;
+	Tcl_ThreadQueueEvent(sup->Owner, &ne->Header, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(sup->Owner);
+}
+
+/*
+	Queues ent when its child exits, invoked by the port thread or, before
+	Windows 8, by the system thread pool
+ */
+static void fire(ExitEntry *ent) {
+	Supervisor *sup = ent->Owner;
+
+	InterlockedExchange(&ent->Fired, 1);
+	InterlockedPushEntrySList(&sup->Exits, &ent->Link);
+	SetEvent(sup->Wake);
+}
+void ExitClient::completed(DWORD, OVERLAPPED*) {
+	fire(Entry);
+}
+static VOID CALLBACK exited(PVOID arg, BOOLEAN) {
+	fire((ExitEntry*)arg);
+}
+
+/*
+	One launch of a child. It will be prepared while Lock is held, the
+	process will be created without Lock and adopted by the child while
+	Lock is held again. Serial identifies the incarnation to be launched.
+ */
+struct Launch {
+	std::string Id;
+	std::vector<char> Cmd;
+	ULONG Serial;
+	bool Job;
+	DWORD Heartbeat, Rc;
+	PROCESS_INFORMATION Pi;
+	HANDLE Jhd;
+	int Slot;
+};
+
+// Current tick of the wheel of sup
+static ULONGLONG tick(Supervisor *sup) {
+	return (GetTickCount64() - sup->Base) / TICKMS;
+}
+
+// Creates the suspended process of l. Must be called without Lock.
+static void spawnChild(Launch &l) {
+	std::vector<char> env;
+
+	l.Slot = -1;
+	l.Jhd = NULL;
+	if (l.Heartbeat) {
+		if ((l.Slot = heartbeatSlot()) < 0) {
+			l.Rc = ERROR_NO_MORE_ITEMS;
+			return;
+		}
+		heartbeatEnv(l.Slot, env);
+	}
+	if ((l.Rc = spawnSuspended(&l.Cmd[0], l.Job, l.Pi, l.Jhd, l.Slot < 0 ? NULL : &env[0])) != 0 && l.Slot >= 0)
+		releaseSlot(l.Slot);
+}
+
+// Terminates the suspended process of l, which will not be adopted
+static void discard(Launch &l, UINT exitcode) {
+	TerminateProcess(l.Pi.hProcess, exitcode);
+	CloseHandle(l.Pi.hThread);
+	CloseHandle(l.Pi.hProcess);
+	if (l.Jhd)
+		CloseHandle(l.Jhd);
+	if (l.Slot >= 0)
+		releaseSlot(l.Slot);
+}
+
+/*
+	The following functions must be called while Lock is held.
+ */
+
+// Prepares the launch of a new incarnation of c
+static void prepare(Supervisor *sup, Child *c, Launch &l) {
+	l.Id = c->Id;
+	l.Cmd.assign(c->Cmd.c_str(), c->Cmd.c_str() + c->Cmd.size() + 1);
+	l.Serial = c->Serial = ++sup->NextSerial;
+	l.Job = c->Job;
+	l.Heartbeat = c->Heartbeat;
+}
+
+// Stops watching the current incarnation of c
+static void unwatch(Supervisor *sup, Child *c) {
+	if (c->Wait) {
+		// INVALID_HANDLE_VALUE: Wait until a running callback has been finished
+		UnregisterWaitEx(c->Wait, INVALID_HANDLE_VALUE);
+		c->Wait = NULL;
+	}
+	if (c->Packet) {
+		portCancel(c->Packet);
+		// completed() may be running, a fired entry belongs to the supervisor thread
+		if (c->Entry && !c->Entry->Fired)
+			portFlush();
+		c->Packet = NULL;
+	}
+	if (c->Entry) {
+		// A queued entry will be freed by the supervisor thread
+		if (!c->Entry->Fired)
+			_aligned_free(c->Entry);
+		c->Entry = NULL;
+		sup->Serials.erase(c->Serial);
+	}
+}
+
+// Makes the process of l the current incarnation of c. Returns 0 or WIN32 error code.
+static DWORD adopt(Supervisor *sup, Child *c, Launch &l) {
+	DWORD rc = l.Rc;
+	void *mem;
+
+	if (rc)
+		return rc;
+	if ((mem = _aligned_malloc(sizeof *c->Entry, MEMORY_ALLOCATION_ALIGNMENT)) == NULL)
+		rc = ERROR_NOT_ENOUGH_MEMORY;
+	else {
+		c->Entry = new (mem) ExitEntry;
+		c->Entry->Owner = sup;
+		c->Entry->Serial = l.Serial;
+		c->Entry->Fired = 0;
+		c->Entry->Client.Entry = c->Entry;
+		if ((c->Packet = portWait(l.Pi.hProcess, &c->Entry->Client)) == NULL && !RegisterWaitForSingleObject(&c->Wait, l.Pi.hProcess, exited, c->Entry, INFINITE, WT_EXECUTEONLYONCE)) {
+			rc = GetLastError();
+			_aligned_free(c->Entry);
+			c->Entry = NULL;
+			c->Wait = NULL;
+		}
+	}
+	if (rc) {
+		discard(l, rc);
+		return rc;
+	}
+	// A hung child will be killed by the watchdog and restarted like any other exited child
+	if (l.Slot >= 0)
+		watchProcess(l.Slot, l.Pi.hProcess, l.Pi.dwProcessId, c->Heartbeat, true, NULL);
+	sup->Serials[c->Serial] = c;
+	ResumeThread(l.Pi.hThread);
+	CloseHandle(l.Pi.hThread);
+	if (c->JobHandle)
+		CloseHandle(c->JobHandle);
+	c->Process = l.Pi.hProcess;
+	c->JobHandle = l.Jhd;
+	c->Pid = l.Pi.dwProcessId;
+	c->State = Child::Running;
+	c->Started = GetTickCount64();
+	return 0;
+}
+
+// Terminates the current incarnation of c, if any, and closes its handles
+static void terminateChild(Supervisor *sup, Child *c, UINT exitcode) {
+	sup->Wheel.cancel(&c->Timer);
+	unwatch(sup, c);
+	if (c->JobHandle) {
+		TerminateJobObject(c->JobHandle, exitcode);
+		CloseHandle(c->JobHandle);
+		c->JobHandle = NULL;
+	}
+	if (c->Process) {
+		if (TerminateProcess(c->Process, exitcode))
+			countMetric(extMetrics.Killed);
+		CloseHandle(c->Process);
+		c->Process = NULL;
+	}
+	c->State = Child::Exited;
+}
+
+/*
+	Restart intensity exceeded: Terminates all children
+ */
+static void shutdown(Supervisor *sup) {
+	std::map<std::string, Child*>::iterator it;
+
+	for (it = sup->Children.begin(); it != sup->Children.end(); it++)
+		terminateChild(sup, it->second, 0);
+	sup->Recent.clear();
+	notify(sup, NoticeShutdown, "", 0, 0);
+}
+
+/*
+	Schedules the restart of c after its backoff delay. The delay doubles
+	with each restart, up to the maximum delay. It will be reset if the
+	child ran longer than the maximum delay.
+ */
+static void schedule(Supervisor *sup, Child *c) {
+	ULONGLONG now = GetTickCount64();
+
+	while (!sup->Recent.empty() && sup->Recent.front() + sup->Period <= now)
+		sup->Recent.pop_front();
+	if ((int)sup->Recent.size() >= sup->Intensity) {
+		shutdown(sup);
+		return;
+	}
+	sup->Recent.push_back(now);
+	if (now - c->Started >= c->MaxDelay)
+		c->Delay = c->MinDelay;
+	c->State = Child::Backoff;
+	// The wheel may lag behind by the time spent since its last advance
+	sup->Wheel.add(&c->Timer, (c->Delay + TICKMS - 1) / TICKMS + tick(sup) - sup->Wheel.now());
+	c->Delay = c->Delay > c->MaxDelay / 2 ? c->MaxDelay : c->Delay * 2;
+}
+
+static void handleExit(Supervisor *sup, Child *c) {
+	DWORD code = 0;
+
+	GetExitCodeProcess(c->Process, &code);
+	countMetric(extMetrics.Reaped);
+	unwatch(sup, c);
+	CloseHandle(c->Process);
+	c->Process = NULL;
+	c->ExitCode = code;
+	notify(sup, NoticeExited, c->Id, c->Pid, code);
+	if (c->Policy == Child::Permanent || (c->Policy == Child::Transient && code != 0))
+		schedule(sup, c);
+	else
+		c->State = Child::Exited;
+}
+
+/*
+	Adopts the restarted incarnation of l. It will be discarded if its child
+	has been stopped or shut down while the process was created.
+ */
+static void handleLaunch(Supervisor *sup, Launch &l) {
+	std::map<std::string, Child*>::iterator it = sup->Children.find(l.Id);
+	Child *c;
+	DWORD rc;
+
+	if (it == sup->Children.end() || it->second->Serial != l.Serial || it->second->State != Child::Backoff) {
+		if (l.Rc == 0)
+			discard(l, ERROR_CANCELLED);
+		return;
+	}
+	c = it->second;
+	rc = adopt(sup, c, l);
+	c->Restarts++;
+	if (rc == 0)
+		notify(sup, NoticeRestarted, c->Id, c->Pid, c->Restarts);
+	else {
+		notify(sup, NoticeFailed, c->Id, 0, rc);
+		c->Started = GetTickCount64();
+		schedule(sup, c);
+	}
+}
+
+/*
+	Supervisor thread. Sleeps until a child exits, ticks only while restart
+	timers are pending. Each exit and each expired timer costs O(1),
+	independent of the number of children. The restarted processes will be
+	created without Lock, commands need not wait for them.
+ */
+static DWORD WINAPI supervisor(LPVOID arg) {
+	Supervisor *sup = (Supervisor*)arg;
+	std::vector<TimerNode*> expired;
+	std::vector<Launch> launches;
+
+	for (;;) {
+		ExitEntry *ent, *next;
+		DWORD timeout;
+
+		EnterCriticalSection(&sup->Lock);
+		timeout = sup->Wheel.size() ? TICKMS : INFINITE;
+		LeaveCriticalSection(&sup->Lock);
+		WaitForSingleObject(sup->Wake, timeout);
+		if (sup->Closing)
+			break;
+		EnterCriticalSection(&sup->Lock);
+		// Advance first, the wheel would be stale after a long sleep otherwise
+		expired.clear();
+		sup->Wheel.advance(tick(sup), expired);
+		for (ent = (ExitEntry*)InterlockedFlushSList(&sup->Exits); ent; ent = next) {
+			std::map<ULONG, Child*>::iterator it = sup->Serials.find(ent->Serial);
+
+			next = (ExitEntry*)ent->Link.Next;
+			if (it != sup->Serials.end())
+				handleExit(sup, it->second);
+			_aligned_free(ent);
+		}
+		launches.clear();
+		for (size_t i = 0; i < expired.size(); i++) {
+			Child *c = (Child*)expired[i]->Data;
+
+			// A shutdown caused by the exits above has terminated c
+			if (c->State == Child::Backoff) {
+				launches.push_back(Launch());
+				prepare(sup, c, launches.back());
+			}
+		}
+		LeaveCriticalSection(&sup->Lock);
+		if (launches.empty())
+			continue;
+		for (size_t i = 0; i < launches.size(); i++)
+			spawnChild(launches[i]);
+		EnterCriticalSection(&sup->Lock);
+		for (size_t i = 0; i < launches.size(); i++)
+			handleLaunch(sup, launches[i]);
+		LeaveCriticalSection(&sup->Lock);
+	}
+	return 0;
+}
+
+/*
+	Per-interpreter supervisor, created with the first child. When the
+	interpreter will be deleted, the supervisor thread ends. The children
+	keep running, but will not be supervised any longer.
+ */
+#define SUPERVISORKEY "VCRExt::supervisor"
+static AssocDataDesc supervisorData(SUPERVISORKEY);
+static void freeSupervisor(ClientData cd, Tcl_Interp *) {
+	Supervisor *sup = (Supervisor*)cd;
+	std::map<std::string, Child*>::iterator it;
+	ExitEntry *ent, *next;
+
+	sup->Closing = true;
+	SetEvent(sup->Wake);
+	WaitForSingleObject(sup->Thread, INFINITE);
+	CloseHandle(sup->Thread);
+	for (it = sup->Children.begin(); it != sup->Children.end(); it++) {
+		Child *c = it->second;
+
+		unwatch(sup, c);
+		if (c->Process)
+			CloseHandle(c->Process);
+		if (c->JobHandle)
+			CloseHandle(c->JobHandle);
+		delete c;
+	}
+	// A completed() call that has queued its entry may still signal Wake
+	portFlush();
+	for (ent = (ExitEntry*)InterlockedFlushSList(&sup->Exits); ent; ent = next) {
+		next = (ExitEntry*)ent->Link.Next;
+		_aligned_free(ent);
+	}
+	Tcl_DeleteEvents(dropNotice, sup);
+	if (sup->Callback)
+		Tcl_DecrRefCount(sup->Callback);
+	CloseHandle(sup->Wake);
+	DeleteCriticalSection(&sup->Lock);
+	delete sup;
+}
+static Supervisor *getSupervisor(Tcl_Interp *ip) {
+	Supervisor *sup = (Supervisor*)Tcl_GetAssocData(ip, SUPERVISORKEY, NULL);
+
+	if (sup == NULL) {
+		sup = new Supervisor;
+		InitializeSListHead(&sup->Exits);
+		InitializeCriticalSection(&sup->Lock);
+		sup->NextSerial = 0;
+		sup->Base = GetTickCount64();
+		sup->Intensity = DEFINTENSITY;
+		sup->Period = DEFPERIOD;
+		sup->Closing = false;
+		sup->Ip = ip;
+		sup->Owner = Tcl_GetCurrentThread();
+		sup->Callback = NULL;
+		sup->Thread = NULL;
+		if ((sup->Wake = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL || (sup->Thread = CreateThread(NULL, 0, supervisor, sup, 0, NULL)) == NULL) {
+			if (sup->Wake)
+				CloseHandle(sup->Wake);
+			DeleteCriticalSection(&sup->Lock);
+			delete sup;
+			throw ValueException(ValueException::ValueExceptionLimit, "Supervisor thread not available");
+		}
+		Tcl_SetAssocData(ip, SUPERVISORKEY, freeSupervisor, sup);
+	}
+	return sup;
+}
+
+static int policyValue(const char *name) {
+	static const char *const names[] = { "permanent", "transient", "temporary" };
+
+	for (int i = 0; i < 3; i++) {
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	throw ValueException(ValueException::ValueExceptionLimit, "Invalid restart policy (permanent, transient, temporary)");
+}
+
+/*
+	supervise start id command ?-restart policy? ?-backoff min max? ?-job? ?-heartbeat ms?
+ */
+static void superviseStart(Supervisor *sup, Tcl_Interp *ip, int cnt, Tcl_Obj *CONST objs[]) {
+	int policy = Child::Permanent, mindelay = DEFMINDELAY, maxdelay = DEFMAXDELAY, heartbeat = 0, i;
+	bool job = false;
+
+	if (cnt < 4)
+		throw ValueException(ValueException::ValueExceptionLimit, "Usage: supervise start id command ?-restart policy? ?-backoff min max? ?-job? ?-heartbeat ms?");
+	for (i = 4; i < cnt; i++) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-restart") == 0 && i + 1 < cnt)
+			policy = policyValue(String(objs[++i]));
+		else if (strcmp(opt, "-backoff") == 0 && i + 2 < cnt) {
+			mindelay = Int(objs[++i]);
+			maxdelay = Int(objs[++i]);
+		}
+		else if (strcmp(opt, "-job") == 0)
+			job = true;
+		else if (strcmp(opt, "-heartbeat") == 0 && i + 1 < cnt)
+			heartbeat = Int(objs[++i]);
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-restart, -backoff, -job, -heartbeat)");
+	}
+	if (mindelay < 0 || maxdelay < mindelay)
+		throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (backoff)");
+	if (heartbeat < 0)
+		throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (heartbeat)");
+
+	std::string id = Tcl_GetString(objs[2]);
+	Launch l;
+	Child *c;
+	DWORD rc;
+
+	EnterCriticalSection(&sup->Lock);
+	if (sup->Children.count(id)) {
+		c = sup->Children[id];
+		if (c->State != Child::Exited) {
+			LeaveCriticalSection(&sup->Lock);
+			throw ValueException(ValueException::ValueExceptionLimit, "Child already supervised");
+		}
+	}
+	else {
+		c = new Child;
+		c->Id = id;
+		c->Process = c->JobHandle = c->Wait = c->Packet = NULL;
+		c->Entry = NULL;
+		c->Timer.Data = c;
+		sup->Children[id] = c;
+	}
+	c->Cmd = (const char*)String(objs[3]);
+	c->Policy = policy;
+	c->Job = job;
+	c->Heartbeat = heartbeat;
+	c->MinDelay = c->Delay = mindelay;
+	c->MaxDelay = maxdelay;
+	c->Restarts = 0;
+	c->Pid = c->ExitCode = 0;
+	c->State = Child::Exited;
+	prepare(sup, c, l);
+	LeaveCriticalSection(&sup->Lock);
+	// Only the interpreter thread deletes children, c remains valid
+	spawnChild(l);
+	EnterCriticalSection(&sup->Lock);
+	if ((rc = adopt(sup, c, l)) != 0) {
+		// The job of a former incarnation
+		if (c->JobHandle)
+			CloseHandle(c->JobHandle);
+		sup->Children.erase(id);
+		delete c;
+	}
+	LeaveCriticalSection(&sup->Lock);
+	Tcl_SetObjResult(ip, Tcl_NewWideIntObj(rc ? -(Tcl_WideInt)rc : c->Pid));
+}
+
+/*
+	supervise stop id ?-grace ms? ?-signal signal?
+ */
+static void superviseStop(Supervisor *sup, Tcl_Interp *ip, int cnt, Tcl_Obj *CONST objs[]) {
+	int signal = SignalTerm, grace = 5000, i;
+
+	if (cnt < 3 || cnt % 2 == 0)
+		throw ValueException(ValueException::ValueExceptionLimit, "Usage: supervise stop id ?-grace ms? ?-signal signal?");
+	for (i = 3; i < cnt; i += 2) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-grace") == 0)
+			grace = Int(objs[i + 1]);
+		else if (strcmp(opt, "-signal") == 0)
+			signal = signalValue(String(objs[i + 1]));
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-grace, -signal)");
+	}
+	if (grace < 0)
+		throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (grace)");
+
+	std::string id = Tcl_GetString(objs[2]);
+	std::vector<StopTarget> targets;
+	HANDLE jhd = NULL;
+	Child *c;
+
+	EnterCriticalSection(&sup->Lock);
+	if (sup->Children.count(id) == 0) {
+		LeaveCriticalSection(&sup->Lock);
+		throw ValueException(ValueException::ValueExceptionLimit, "Child not supervised");
+	}
+	c = sup->Children[id];
+	sup->Children.erase(id);
+	sup->Wheel.cancel(&c->Timer);
+	unwatch(sup, c);
+	LeaveCriticalSection(&sup->Lock);
+	if (c->Process) {
+		StopTarget t;
+		FILETIME ct, et, kt, ut;
+
+		t.Pid = c->Pid;
+		t.Start = GetProcessTimes(c->Process, &ct, &et, &kt, &ut) ? ((ULONGLONG)ct.dwHighDateTime << 32) + ct.dwLowDateTime : 0;
+		t.Handle = c->Process;
+		t.Outcome = StopTarget::Pending;
+		t.Error = 0;
+		t.Micros = 0;
+		targets.push_back(t);
+		// Closes the process handle
+		stopProcesses(targets, signal, grace, 0);
+	}
+	if (c->JobHandle) {
+		// Remaining processes of the process tree
+		TerminateJobObject(c->JobHandle, 0);
+		CloseHandle(c->JobHandle);
+	}
+	delete c;
+	Tcl_SetObjResult(ip, stopReport(targets));
+}
+
+/*
+	supervise children
+ */
+static void superviseChildren(Supervisor *sup, Tcl_Interp *ip) {
+	static const char *const states[] = { "running", "backoff", "exited" };
+	std::map<std::string, Child*>::iterator it;
+	Tcl_Obj *res = Tcl_NewListObj(0, NULL);
+
+	EnterCriticalSection(&sup->Lock);
+	for (it = sup->Children.begin(); it != sup->Children.end(); it++) {
+		Child *c = it->second;
+		Tcl_Obj *ent[4];
+
+		ent[0] = Tcl_NewStringObj(c->Id.c_str(), -1);
+		ent[1] = Tcl_NewStringObj(states[c->State], -1);
+		ent[2] = Tcl_NewWideIntObj(c->State == Child::Running ? c->Pid : 0);
+		ent[3] = Tcl_NewWideIntObj(c->Restarts);
+		Tcl_ListObjAppendElement(NULL, res, Tcl_NewListObj(4, ent));
+	}
+	LeaveCriticalSection(&sup->Lock);
+	Tcl_SetObjResult(ip, res);
+}
+
+/*
+	supervise configure ?-intensity n? ?-period ms? ?-callback command?
+ */
+static void superviseConfigure(Supervisor *sup, Tcl_Interp *ip, int cnt, Tcl_Obj *CONST objs[]) {
+	int i;
+
+	if (cnt % 2 != 0)
+		throw ValueException(ValueException::ValueExceptionLimit, "Usage: supervise configure ?-intensity n? ?-period ms? ?-callback command?");
+	for (i = 2; i < cnt; i += 2) {
+		String opt(objs[i]);
+
+		if (strcmp(opt, "-intensity") == 0 || strcmp(opt, "-period") == 0) {
+			int val = Int(objs[i + 1]);
+
+			if (val < 1)
+				throw ValueException(ValueException::ValueExceptionLimit, "Value out of range (intensity, period)");
+			EnterCriticalSection(&sup->Lock);
+			if (strcmp(opt, "-intensity") == 0)
+				sup->Intensity = val;
+			else
+				sup->Period = val;
+			LeaveCriticalSection(&sup->Lock);
+		}
+		else if (strcmp(opt, "-callback") == 0) {
+			if (sup->Callback)
+				Tcl_DecrRefCount(sup->Callback);
+			sup->Callback = Tcl_GetCharLength(objs[i + 1]) ? objs[i + 1] : NULL;
+			if (sup->Callback)
+				Tcl_IncrRefCount(sup->Callback);
+		}
+		else
+			throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-intensity, -period, -callback)");
+	}
+
+	Tcl_Obj *res[6];
+
+	res[0] = Tcl_NewStringObj("-intensity", -1);
+	res[1] = Tcl_NewIntObj(sup->Intensity);
+	res[2] = Tcl_NewStringObj("-period", -1);
+	res[3] = Tcl_NewWideIntObj(sup->Period);
+	res[4] = Tcl_NewStringObj("-callback", -1);
+	res[5] = sup->Callback ? sup->Callback : Tcl_NewObj();
+	Tcl_SetObjResult(ip, Tcl_NewListObj(6, res));
+}
+
+/*
+	Command supervise
+	Syntax:
+		supervise start id command ?-restart policy? ?-backoff min max? ?-job? ?-heartbeat ms?
+		supervise stop id ?-grace ms? ?-signal signal?
+		supervise children
+		supervise configure ?-intensity n? ?-period ms? ?-callback command?
+	Function:
+		Supervises child processes natively. start starts command as child
+		id. Depending on policy, the child will be restarted whenever it
+		exits (permanent, default), only if it exits with an exit code other
+		than 0 (transient) or never (temporary). Restarts will be delayed
+		by min milliseconds, doubled with each restart up to max
+		milliseconds (default 100 and 30000). If more than n restarts occur
+		within ms milliseconds (default 10 within 60000), all children will
+		be terminated. With option -job, the child will be started in its
+		own job object, stop terminates its whole process tree. With
+		option -heartbeat, a child whose heartbeat stops for ms
+		milliseconds will be killed by the watchdog (exit code 258) and
+		restarted depending on policy.
+		stop stops child id like command stop and removes it.
+		callback will be invoked with a list {event id pid code} appended,
+		event is one of exited (code: exit code), restarted (code: number
+		of restarts), failed (code: WIN32 error code) and shutdown.
+	Returns:
+		start: Process ID or -WIN32 error code
+		stop: List as returned by command stop, empty if not running
+		children: List with one element {id state pid restarts} per child,
+		state is one of running, backoff and exited
+		configure: Current configuration
+ */
+DECLARE(supervise, -1, "start|stop|children|configure ?arg ...?") {
+	if (cnt < 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "start|stop|children|configure ?arg ...?");
+		return TCL_ERROR;
+	}
+	ARG(String, option, 1);
+	Supervisor *sup = getSupervisor(ip);
+
+	if (strcmp(option, "start") == 0)
+		superviseStart(sup, ip, cnt, objs);
+	else if (strcmp(option, "stop") == 0)
+		superviseStop(sup, ip, cnt, objs);
+	else if (strcmp(option, "children") == 0 && cnt == 2)
+		superviseChildren(sup, ip);
+	else if (strcmp(option, "configure") == 0)
+		superviseConfigure(sup, ip, cnt, objs);
+	else
+		throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (start, stop, children, configure)");
+}
+FINISH
+static NewCmdDesc superviseDesc("::VCRExt::supervise", supervise, NULL, NULL);
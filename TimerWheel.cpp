@@ -0,0 +1,95 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "TimerWheel.h"
+
+TimerWheel::TimerWheel() {
+	for (int l = 0; l < Levels; l++) {
+		for (int s = 0; s < Slots; s++)
+			Wheel[l][s].Prev = Wheel[l][s].Next = &Wheel[l][s];
+	}
+	Now = 0;
+	Count = 0;
+}
+/*
+	Inserts node into the slot of the lowest level whose range contains its
+	expiration tick. Timers due in the current tick will be cascaded into
+	the level 0 slot of that tick, which will be processed after cascading. Timers beyond the range of
+	the highest level will be stored in its farthest slot and re-inserted
+	when that slot cascades.
+ */
+void TimerWheel::insert(TimerNode *node) {
+	ULONGLONG due = node->Due > Now ? node->Due : Now, delta = due - Now;
+	int level;
+
+	for (level = 0; level < Levels - 1 && delta >= (ULONGLONG)1 << (Bits * (level + 1)); level++)
+		;
+	if (delta >= (ULONGLONG)1 << (Bits * Levels))
+		due = Now + ((ULONGLONG)1 << (Bits * Levels)) - 1;
+
+	TimerNode *head = &Wheel[level][(due >> (Bits * level)) & (Slots - 1)];
+
+	node->Next = head;
+	node->Prev = head->Prev;
+	head->Prev->Next = node;
+	head->Prev = node;
+}
+void TimerWheel::cascade(int level) {
+	TimerNode *head = &Wheel[level][(Now >> (Bits * level)) & (Slots - 1)], *node;
+
+	while ((node = head->Next) != head) {
+		head->Next = node->Next;
+		node->Next->Prev = head;
+		insert(node);
+	}
+}
+void TimerWheel::add(TimerNode *node, ULONGLONG delay) {
+	if (node->armed())
+		cancel(node);
+	node->Due = Now + (delay ? delay : 1);
+	insert(node);
+	Count++;
+}
+void TimerWheel::cancel(TimerNode *node) {
+	if (node->armed()) {
+		node->Prev->Next = node->Next;
+		node->Next->Prev = node->Prev;
+		node->Prev = node->Next = NULL;
+		Count--;
+	}
+}
+void TimerWheel::advance(ULONGLONG now, std::vector<TimerNode*> &expired) {
+	while (Now < now) {
+		TimerNode *head, *node;
+		int level;
+
+		Now++;
+		// Higher levels first, their timers may expire in this tick
+		for (level = 1; level < Levels && (Now & (((ULONGLONG)1 << (Bits * level)) - 1)) == 0; level++)
+			;
+		while (--level > 0)
+			cascade(level);
+		head = &Wheel[0][Now & (Slots - 1)];
+		while ((node = head->Next) != head) {
+			cancel(node);
+			expired.push_back(node);
+		}
+		if (Count == 0) {
+			// Nothing left to expire, skip the remaining ticks
+			Now = now;
+		}
+	}
+}
@@ -0,0 +1,68 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef TIMERWHEEL_H
+# define TIMERWHEEL_H
+# include <windows.h>
+# include <vector>
+
+	/*
+	 * Struct TimerNode is one timer of a TimerWheel. It will be embedded in the
+	 * object to be notified, Data can be used to find that object.
+	 */
+	struct TimerNode {
+		TimerNode *Prev, *Next;		// NULL while not armed
+		ULONGLONG Due;				// Expiration tick
+		void *Data;
+		TimerNode() {
+			Prev = Next = NULL;
+			Due = 0;
+			Data = NULL;
+		}
+		bool armed() const {
+			return Next != NULL;
+		}
+	};
+
+	/*
+	 * Class TimerWheel is a hierarchical timer wheel with Levels levels of Slots
+	 * slots each. Adding and cancelling a timer costs O(1), each tick costs O(1)
+	 * plus the number of expired timers. Timers will be moved to a lower level
+	 * when the slot of their level will be reached (cascading). Delays longer than
+	 * the wheel's range will be cascaded until they are due. The object is not
+	 * thread-safe.
+	 */
+	class TimerWheel {
+		enum { Bits = 8, Slots = 1 << Bits, Levels = 3 };
+		TimerNode Wheel[Levels][Slots];		// Sentinels of circular lists
+		ULONGLONG Now;						// Current tick
+		size_t Count;
+		void insert(TimerNode *node);
+		void cascade(int level);
+	public:
+		TimerWheel();
+		void add(TimerNode *node, ULONGLONG delay);	// delay in ticks, re-arms armed node
+		void cancel(TimerNode *node);
+		// Advances wheel to tick now and appends all expired timers to expired
+		void advance(ULONGLONG now, std::vector<TimerNode*> &expired);
+		size_t size() const {
+			return Count;
+		}
+		ULONGLONG now() const {
+			return Now;
+		}
+	};
+#endif
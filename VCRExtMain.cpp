@@ -16,6 +16,7 @@
 */
 #define DEFINEGLOBALS
 #include "VCRExtMain.h"
+#include <mutex>
 /***************************
  * Change value of EXTENTRY to the resulting dll name + _Init
  * and value of EXTEXIT to the resulting dll name + _Unload,
@@ -32,12 +33,14 @@ static int initTclStubs(Tcl_Interp *pi) {
 	struct HeadOfInterp : public Tcl_Interp {
 		TclStubs *stubTable;
 	} *hoi = (HeadOfInterp*) pi;
-	if (hoi->stubTable == NULL || hoi->stubTable->magic != TCL_STUB_MAGIC) {
-		pi->result = "This extension requires Tcl stubs support.";
-		pi->freeProc = TCL_STATIC;
+	// Without any stub table, not even the error message can be set
+	if ((tclStubsPtr = hoi->stubTable) == NULL)
+		return 0;
+	if (tclStubsPtr->magic != TCL_STUB_MAGIC) {
+		Tcl_SetResult(pi, "This extension requires Tcl stubs support.", TCL_STATIC);
+		tclStubsPtr = NULL;
 		return 0;
 	}
-	tclStubsPtr = hoi->stubTable;
 	if (Tcl_PkgRequire(pi, "Tcl", "8.5", 0) == NULL) {
 		tclStubsPtr = NULL;
 		return 0;
@@ -70,18 +73,54 @@ static int initTkStubs(Tcl_Interp *pi) {
 	return 1;
 }
 
+/**
+ * The command list has been built during static initialization and will
+ * not be changed afterwards, therefore the extension can be loaded into
+ * interpreters of several threads at the same time.
+ */
 extern "C" DLLEXPORT int EXTENTRY(Tcl_Interp *pi) {
-	NewCmdDesc *act;
+	const NewCmdDesc *act;
+	int major, minor;
 	if (!initTclStubs(pi) || !initTkStubs(pi))
 		return TCL_ERROR;
-	for (act = NewCmdDesc::Head; act; act = act->Next)
-		Tcl_CreateObjCommand(pi, act->Name, act->Entry, act->Data, act->Cleanup);
+	Tcl_GetVersion(&major, &minor, NULL, NULL);
+	for (act = NewCmdDesc::Head; act; act = act->Next) {
+		if (act->NreEntry && (major > 8 || (major == 8 && minor >= 6)))
+			Tcl_NRCreateCommand(pi, act->Name, act->Entry, act->NreEntry, act->Data, act->Cleanup);
+		else
+			Tcl_CreateObjCommand(pi, act->Name, act->Entry, act->Data, act->Cleanup);
+	}
 	return TCL_OK;
 }
 
+/**
+ * Threads of the extension must not outlive its code: Unloading from the process
+ * will be refused while the extension is busy, otherwise its threads will be
+ * stopped after the state of the last interpreter has been deleted.
+ */
 extern "C" DLLEXPORT int EXTEXIT(Tcl_Interp *pi, int flags) {
-	for (NewCmdDesc *act = NewCmdDesc::Head; act; act = act->Next)
+	const ExitDesc *ext;
+
+	if (flags == TCL_UNLOAD_DETACH_FROM_PROCESS) {
+		for (ext = ExitDesc::Head; ext; ext = ext->Next) {
+			const char *msg = ext->Busy ? ext->Busy() : NULL;
+
+			if (msg) {
+				Tcl_SetResult(pi, (char*)msg, TCL_STATIC);
+				return TCL_ERROR;
+			}
+		}
+	}
+	for (const NewCmdDesc *act = NewCmdDesc::Head; act; act = act->Next)
 		Tcl_DeleteCommand(pi, act->Name);
+	for (const AssocDataDesc *ad = AssocDataDesc::Head; ad; ad = ad->Next)
+		Tcl_DeleteAssocData(pi, ad->Key);
+	if (flags == TCL_UNLOAD_DETACH_FROM_PROCESS) {
+		for (ext = ExitDesc::Head; ext; ext = ext->Next) {
+			if (ext->Stop)
+				ext->Stop();
+		}
+	}
 	return TCL_OK;
 }
 
@@ -135,6 +174,12 @@ ParamList& ParamList::operator,(Tcl_Obj* obj) {
 	return *this;
 }
 
+// Type lookup, invoked once per type via std::call_once
+
+static void lookupType(Tcl_ObjType **type, const char *name) {
+	*type = Tcl_GetObjType(name);
+}
+
 // Implementation Value class
 
 Tcl_ObjType *Value::getTypeObj() {
@@ -170,10 +215,10 @@ Value::operator Tcl_Obj*() const {
 // Implementation Int class
 
 Tcl_ObjType *Int::getTypeObj() {
-	static Tcl_ObjType *myType = (Tcl_ObjType*)~0;
+	static Tcl_ObjType *myType = NULL;
+	static std::once_flag once;
 
-	if (myType == (Tcl_ObjType*)~0)
-		myType = Tcl_GetObjType("int");
+	std::call_once(once, lookupType, &myType, "int");
 	return myType;
 }
 Int::Int(int v) {
@@ -300,10 +345,10 @@ Int operator%(Int s1, Int s2) {
 }
 
 Tcl_ObjType *String::getTypeObj() {
-	static Tcl_ObjType *myType = (Tcl_ObjType*)~0;
+	static Tcl_ObjType *myType = NULL;
+	static std::once_flag once;
 
-	if (myType == (Tcl_ObjType*)~0)
-		myType = Tcl_GetObjType("string");
+	std::call_once(once, lookupType, &myType, "string");
 	return myType;
 }
 String::String(const char *v) {
@@ -335,10 +380,10 @@ String& String::operator+=(const String& val) {
 }
 
 Tcl_ObjType *PtrValue::getTypeObj() {
-	static Tcl_ObjType *myType = (Tcl_ObjType*)~0;
+	static Tcl_ObjType *myType = NULL;
+	static std::once_flag once;
 
-	if (myType == (Tcl_ObjType*)~0)
-		myType = Tcl_GetObjType("string");
+	std::call_once(once, lookupType, &myType, "string");
 	return myType;
 }
 PtrValue::PtrValue(Tcl_WideInt v) {
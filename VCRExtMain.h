@@ -21,52 +21,83 @@
 # include "tk.h"
 # include "tkDecls.h"
 
+	// The stub tables are const since Tcl/Tk 8.6, whose headers are needed to build
 # if USE_TCL_STUBS
 #  ifdef DEFINEGLOBALS
-	TclStubs *tclStubsPtr;
-	TclPlatStubs *tclPlatStubsPtr;
-	struct TclIntStubs *tclIntStubsPtr;
-	struct TclIntPlatStubs *tclIntPlatStubsPtr;
+	const TclStubs *tclStubsPtr;
+	const TclPlatStubs *tclPlatStubsPtr;
+	const struct TclIntStubs *tclIntStubsPtr;
+	const struct TclIntPlatStubs *tclIntPlatStubsPtr;
 #  else
-	extern TclStubs *tclStubsPtr;
-	extern TclPlatStubs *tclPlatStubsPtr;
-	extern struct TclIntStubs *tclIntStubsPtr;
-	extern struct TclIntPlatStubs *tclIntPlatStubsPtr;
+	extern const TclStubs *tclStubsPtr;
+	extern const TclPlatStubs *tclPlatStubsPtr;
+	extern const struct TclIntStubs *tclIntStubsPtr;
+	extern const struct TclIntPlatStubs *tclIntPlatStubsPtr;
 #  endif
 # endif
 # if USE_TK_STUBS
 #  ifdef DEFINEGLOBALS
-	TkStubs *tkStubsPtr;
-	struct TkPlatStubs *tkPlatStubsPtr;
-	struct TkIntStubs *tkIntStubsPtr;
-	struct TkIntPlatStubs *tkIntPlatStubsPtr;
-	struct TkIntXlibStubs *tkIntXlibStubsPtr;
+	const TkStubs *tkStubsPtr;
+	const struct TkPlatStubs *tkPlatStubsPtr;
+	const struct TkIntStubs *tkIntStubsPtr;
+	const struct TkIntPlatStubs *tkIntPlatStubsPtr;
+	const struct TkIntXlibStubs *tkIntXlibStubsPtr;
 #  else
-	extern TkStubs *tkStubsPtr;
-	extern struct TkPlatStubs *tkPlatStubsPtr;
-	extern struct TkIntStubs *tkIntStubsPtr;
-	extern struct TkIntPlatStubs *tkIntPlatStubsPtr;
-	extern struct TkIntXlibStubs *tkIntXlibStubsPtr;
+	extern const TkStubs *tkStubsPtr;
+	extern const struct TkPlatStubs *tkPlatStubsPtr;
+	extern const struct TkIntStubs *tkIntStubsPtr;
+	extern const struct TkIntPlatStubs *tkIntPlatStubsPtr;
+	extern const struct TkIntXlibStubs *tkIntXlibStubsPtr;
 #  endif
 # endif
 	// Helper struct for EXTENTRY function. For each function, one such element must be defined
-	// before EXTENTRY will be called. 
+	// before EXTENTRY will be called. The list is complete after static initialization and
+	// immutable afterwards.
+	// NreEntry is the non-recursive variant of the command, used with Tcl 8.6 or later.
 	struct NewCmdDesc {
-		NewCmdDesc(const char *name, Tcl_ObjCmdProc *entry, ClientData data, Tcl_CmdDeleteProc *cleanup) {
+		NewCmdDesc(const char *name, Tcl_ObjCmdProc *entry, ClientData data, Tcl_CmdDeleteProc *cleanup, Tcl_ObjCmdProc *nreentry = NULL) : Next(Head) {
 			Name = name;
 			Entry = entry;
+			NreEntry = nreentry;
 			Data = data;
 			Cleanup = cleanup;
-			Next = Head;
 			Head = this;
 		}
-		NewCmdDesc *Next;
+		NewCmdDesc *const Next;
 		static NewCmdDesc *Head;
 		const char *Name;
-		Tcl_ObjCmdProc *Entry;
+		Tcl_ObjCmdProc *Entry, *NreEntry;
 		Tcl_CmdDeleteProc *Cleanup;
 		ClientData Data;
 	};
+	// Helper struct for EXTEXIT function. Each assoc data key of the extension must be registered
+	// by one such element. When the extension will be unloaded from an interpreter, the assoc data
+	// will be deleted, which invokes its delete procedure.
+	struct AssocDataDesc {
+		AssocDataDesc(const char *key) : Next(Head) {
+			Key = key;
+			Head = this;
+		}
+		AssocDataDesc *const Next;
+		static AssocDataDesc *Head;
+		const char *Key;
+	};
+	// Helper struct for EXTEXIT function, for process-wide state like threads of the extension.
+	// Before the extension will be unloaded from the process, each Busy function will be invoked;
+	// if one returns a message, the extension stays loaded and the message is the error. Otherwise,
+	// each Stop function will be invoked after the assoc data of the last interpreter has been
+	// deleted. Both may be NULL.
+	struct ExitDesc {
+		ExitDesc(void (*stop)(), const char *(*busy)() = NULL) : Next(Head) {
+			Stop = stop;
+			Busy = busy;
+			Head = this;
+		}
+		ExitDesc *const Next;
+		static ExitDesc *Head;
+		void (*Stop)();
+		const char *(*Busy)();
+	};
 	/*
 	 * Class ParamList can be used to specify a parameter list for a call to an extension function.
 	 * The constructor reserves space for the given no. of Tcl_Obj values. With the comma operator,
@@ -241,5 +272,7 @@ const char *getObjTypeName(Tcl_Obj*obj);
 
 # ifdef DEFINEGLOBALS
 	NewCmdDesc *NewCmdDesc::Head = NULL;
+	AssocDataDesc *AssocDataDesc::Head = NULL;
+	ExitDesc *ExitDesc::Head = NULL;
 # endif
 #endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "Waiter.h"
+
+static LONGLONG frequency() {
+	LARGE_INTEGER freq;
+
+	QueryPerformanceFrequency(&freq);
+	return freq.QuadPart;
+}
+ULONGLONG nowMicros() {
+	static const LONGLONG freq = frequency();
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+	return (ULONGLONG)(now.QuadPart / freq * 1000000 + now.QuadPart % freq * 1000000 / freq);
+}
+
+// Implementation of HandleWaiter class
+
+HandleWaiter::HandleWaiter() {
+	Count = Needed = 0;
+	Done = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+HandleWaiter::~HandleWaiter() {
+	bool packets = false;
+
+	// INVALID_HANDLE_VALUE: Wait until running callbacks have been finished
+	for (size_t i = 0; i < Slots.size(); i++) {
+		if (Slots[i].Wait)
+			UnregisterWaitEx(Slots[i].Wait, INVALID_HANDLE_VALUE);
+		if (Slots[i].Packet) {
+			portCancel(Slots[i].Packet);
+			packets = true;
+		}
+	}
+	if (packets)
+		portFlush();
+	if (Done)
+		CloseHandle(Done);
+}
+size_t HandleWaiter::add(HANDLE hd) {
+	Slot slot;
+
+	slot.Owner = this;
+	slot.Handle = hd;
+	slot.Wait = slot.Packet = NULL;
+	slot.Signalled = 0;
+	Slots.push_back(slot);
+	return Slots.size() - 1;
+}
+VOID CALLBACK HandleWaiter::signalled(PVOID arg, BOOLEAN) {
+	Slot *slot = (Slot*)arg;
+
+	slot->Signalled = nowMicros();
+	if (InterlockedIncrement(&slot->Owner->Count) == slot->Owner->Needed)
+		SetEvent(slot->Owner->Done);
+}
+bool HandleWaiter::start(bool any) {
+	// Slots must not be moved after registration, therefore no add() after start()
+	Needed = Slots.empty() ? 0 : any ? 1 : (LONG)Slots.size();
+	if (Done == NULL)
+		return false;
+	if (Needed == 0)
+		SetEvent(Done);
+	for (size_t i = 0; i < Slots.size(); i++) {
+		if ((Slots[i].Packet = portWait(Slots[i].Handle, &Slots[i])) != NULL)
+			continue;
+		if (!RegisterWaitForSingleObject(&Slots[i].Wait, Slots[i].Handle, signalled, &Slots[i], INFINITE, WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD)) {
+			Slots[i].Wait = NULL;
+			return false;
+		}
+	}
+	return true;
+}
+bool HandleWaiter::wait(DWORD ms) {
+	return WaitForSingleObject(Done, ms) == WAIT_OBJECT_0;
+}
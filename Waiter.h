@@ -0,0 +1,67 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef WAITER_H
+# define WAITER_H
+# include "IoPort.h"
+# include <windows.h>
+# include <vector>
+
+	// Returns a monotonic time stamp in microseconds
+	ULONGLONG nowMicros();
+
+	/*
+	 * Class HandleWaiter waits for any number of handles, not limited to
+	 * MAXIMUM_WAIT_OBJECTS. Each handle will be associated once with the I/O
+	 * completion port as wait completion packet, or registered at the system
+	 * thread pool if wait completion packets are not available. The time each
+	 * handle has been signalled will be stored.
+	 * Usage: Call add() for each handle, then start() and wait() as often as
+	 * needed. The handles must remain valid until the object will be destroyed.
+	 * Each handle is waited for on its own, therefore every auto-reset event
+	 * signalled before destruction will be reset, whether reported or not.
+	 */
+	class HandleWaiter {
+		struct Slot : public PortClient {
+			HandleWaiter *Owner;
+			HANDLE Handle, Wait, Packet;
+			volatile ULONGLONG Signalled;	// Time stamp, 0 while not signalled
+			void completed(DWORD, OVERLAPPED*) {
+				HandleWaiter::signalled(this, FALSE);
+			}
+		};
+		std::vector<Slot> Slots;
+		volatile LONG Count;
+		LONG Needed;
+		HANDLE Done;
+		static VOID CALLBACK signalled(PVOID, BOOLEAN);
+	public:
+		HandleWaiter();
+		~HandleWaiter();
+		size_t add(HANDLE hd);					// Returns index of handle
+		bool start(bool any = false);			// any: wait() returns after first signalled handle
+		bool wait(DWORD ms);					// Returns true if condition has been reached
+		HANDLE event() const {					// Event set when condition has been reached
+			return Done;
+		}
+		size_t size() const {
+			return Slots.size();
+		}
+		ULONGLONG signalled(size_t i) const {	// Time stamp or 0 if not signalled
+			return Slots[i].Signalled;
+		}
+	};
+#endif
@@ -0,0 +1,463 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "Watchdog.h"
+#include "Metrics.h"
+#include <mutex>
+#include <string>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Scan interval of the watchdog thread in milliseconds
+#define SCANMS 50
+// A child must beat for the first time within STARTFACTOR times its timeout
+#define STARTFACTOR 10
+
+/*
+	One slot of the watchdog. Last is the counter value at the last check,
+	Changed the tick count when it has changed, initially the start of the
+	watch. Owner NULL: No notifications.
+ */
+struct Watch {
+	enum { Free, Reserved, Watched };
+	int State;
+	HANDLE Process;
+	DWORD Pid, Timeout;
+	bool Kill, Hung;
+	LONGLONG Last;
+	ULONGLONG Changed;
+	WatchOwner *Owner;
+};
+
+struct WatchOwner {
+	Tcl_Interp *Ip;
+	Tcl_ThreadId Thread;
+	Tcl_Obj *Callback;			// Used by interpreter thread only
+};
+
+/*
+	Process-wide watchdog: Shared heartbeat table and watchdog thread, both
+	created with the first slot. Lock protects Watches, the counters in
+	Table will be written by the children without lock. Wake interrupts the
+	sleep of the thread, with Closing set it ends. The thread holds Owners
+	shared while it queues notifications without Lock, an owner taken out
+	of Watches waits for it exclusively before it will be deleted.
+ */
+static struct WatchdogState {
+	std::once_flag Once;
+	HANDLE Mapping, Thread, Wake;
+	volatile bool Closing;
+	char *Table;
+	char Name[64];
+	CRITICAL_SECTION Lock;
+	SRWLOCK Owners;
+	Watch Watches[HEARTBEATSLOTS];
+} wd;
+
+static HeartbeatSlot *slotAt(char *table, int i) {
+	return (HeartbeatSlot*)(table + (i + 1) * HEARTBEATSTRIDE);
+}
+
+/*
+	Notifications passed to the interpreter thread
+ */
+enum { WatchHung, WatchKilled, WatchRecovered };
+struct WatchEvent {
+	Tcl_Event Header;			// Must be the first member
+	WatchOwner *Owner;
+	int Event, Slot;
+	DWORD Pid;
+};
+/*
+	Action of the watchdog thread, collected under Lock and carried out
+	after it has been released
+ */
+struct WatchAction {
+	WatchOwner *Owner;
+	HANDLE Process;				// Kill: Closed only by the watchdog thread
+	int Event, Slot;
+	DWORD Pid;
+};
+
+static int watchEvent(Tcl_Event *ev, int) {
+	static const char *const names[] = { "hung", "killed", "recovered" };
+	WatchEvent *we = (WatchEvent*)ev;
+	WatchOwner *wo = we->Owner;
+
+	if (wo->Callback && !Tcl_InterpDeleted(wo->Ip)) {
+		Tcl_Obj *cmd = Tcl_DuplicateObj(wo->Callback), *info[3];
+
+		info[0] = Tcl_NewStringObj(names[we->Event], -1);
+		info[1] = Tcl_NewWideIntObj(we->Pid);
+		info[2] = Tcl_NewIntObj(we->Slot);
+		Tcl_IncrRefCount(cmd);
+		Tcl_ListObjAppendElement(NULL, cmd, Tcl_NewListObj(3, info));
+		if (Tcl_EvalObjEx(wo->Ip, cmd, TCL_EVAL_GLOBAL) == TCL_ERROR)
+			Tcl_BackgroundError(wo->Ip);
+		Tcl_DecrRefCount(cmd);
+	}
+	return 1;
+}
+static int dropWatchEvent(Tcl_Event *ev, ClientData cd) {
+	return ev->proc == watchEvent && ((WatchEvent*)ev)->Owner == (WatchOwner*)cd;
+}
+// Must be called while Owners is held
+static void notify(const WatchAction &wa) {
+	WatchEvent *we;
+
+	if (wa.Owner == NULL)
+		return;
+	we = (WatchEvent*)Tcl_Alloc(sizeof *we);
+	we->Header.proc = watchEvent;
+	we->Header.nextPtr = NULL;
+	we->Owner = wa.Owner;
+	we->Event = wa.Event;
+	we->Slot = wa.Slot;
+	we->Pid = wa.Pid;
+	Tcl_ThreadQueueEvent(wa.Owner->Thread, &we->Header, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(wa.Owner->Thread);
+}
+
+/*
+	Thread function of the watchdog. A child whose counter advances costs
+	one memory read per scan. Only stalled counters will be checked with a
+	system call, at most once per timeout. Kills and notifications will be
+	done after Lock has been released, so they do not delay the commands.
+	Without watched slots, the thread sleeps until watchProcess wakes it.
+ */
+static DWORD WINAPI scanner(LPVOID) {
+	std::vector<WatchAction> actions;
+	DWORD timeout = INFINITE;
+
+	for (;;) {
+		WaitForSingleObject(wd.Wake, timeout);
+		if (wd.Closing)
+			break;
+
+		ULONGLONG now = GetTickCount64();
+		int watched = 0;
+
+		actions.clear();
+		EnterCriticalSection(&wd.Lock);
+		for (int i = 0; i < HEARTBEATSLOTS; i++) {
+			Watch &w = wd.Watches[i];
+			WatchAction wa = { w.Owner, NULL, WatchRecovered, i, w.Pid };
+			LONGLONG c;
+
+			if (w.State != Watch::Watched)
+				continue;
+			watched++;
+			if ((c = slotAt(wd.Table, i)->Counter) != w.Last) {
+				w.Last = c;
+				w.Changed = now;
+				if (w.Hung) {
+					w.Hung = false;
+					actions.push_back(wa);
+				}
+				continue;
+			}
+			// Until the first heartbeat, the start deadline applies
+			if (now - w.Changed < (w.Last == 0 && !w.Hung ? (ULONGLONG)w.Timeout * STARTFACTOR : w.Timeout))
+				continue;
+			w.Changed = now;
+			if (WaitForSingleObject(w.Process, 0) != WAIT_TIMEOUT) {
+				CloseHandle(w.Process);
+				w.State = Watch::Free;
+				watched--;
+				continue;
+			}
+			// Already reported
+			if (w.Hung)
+				continue;
+			w.Hung = true;
+			wa.Event = w.Kill ? WatchKilled : WatchHung;
+			wa.Process = w.Kill ? w.Process : NULL;
+			actions.push_back(wa);
+		}
+		// The owners remain valid until the notifications have been queued
+		if (!actions.empty())
+			AcquireSRWLockShared(&wd.Owners);
+		LeaveCriticalSection(&wd.Lock);
+		timeout = watched ? SCANMS : INFINITE;
+		if (actions.empty())
+			continue;
+		for (size_t i = 0; i < actions.size(); i++) {
+			if (actions[i].Process && TerminateProcess(actions[i].Process, WAIT_TIMEOUT))
+				countMetric(extMetrics.Killed);
+			notify(actions[i]);
+		}
+		ReleaseSRWLockShared(&wd.Owners);
+	}
+	return 0;
+}
+static void startWatchdog() {
+	InitializeCriticalSection(&wd.Lock);
+	InitializeSRWLock(&wd.Owners);
+	sprintf(wd.Name, "Local\\VCRExt.heartbeat.%lu", (unsigned long)GetCurrentProcessId());
+	if ((wd.Mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (HEARTBEATSLOTS + 1) * HEARTBEATSTRIDE, wd.Name)) == NULL)
+		return;
+	if ((wd.Table = (char*)MapViewOfFile(wd.Mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0)) == NULL)
+		return;
+	*(DWORD*)wd.Table = HEARTBEATSLOTS;
+	if ((wd.Wake = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL || (wd.Thread = CreateThread(NULL, 0, scanner, NULL, 0, NULL)) == NULL) {
+		UnmapViewOfFile(wd.Table);
+		wd.Table = NULL;
+		return;
+	}
+}
+/*
+	Unloading the extension: The watchdog thread ends, children still
+	running will not be watched any longer.
+ */
+static void stopWatchdog() {
+	if (wd.Thread == NULL)
+		return;
+	wd.Closing = true;
+	SetEvent(wd.Wake);
+	WaitForSingleObject(wd.Thread, INFINITE);
+	CloseHandle(wd.Thread);
+	for (int i = 0; i < HEARTBEATSLOTS; i++) {
+		if (wd.Watches[i].State == Watch::Watched)
+			CloseHandle(wd.Watches[i].Process);
+	}
+	UnmapViewOfFile(wd.Table);
+	CloseHandle(wd.Mapping);
+	CloseHandle(wd.Wake);
+	DeleteCriticalSection(&wd.Lock);
+	wd.Thread = NULL;
+}
+static ExitDesc watchdogExit(stopWatchdog);
+
+int heartbeatSlot() {
+	int i;
+
+	std::call_once(wd.Once, startWatchdog);
+	if (wd.Table == NULL)
+		return -1;
+	EnterCriticalSection(&wd.Lock);
+	for (i = 0; i < HEARTBEATSLOTS && wd.Watches[i].State != Watch::Free; i++);
+	if (i < HEARTBEATSLOTS) {
+		wd.Watches[i].State = Watch::Reserved;
+		slotAt(wd.Table, i)->Counter = 0;
+		slotAt(wd.Table, i)->Pid = 0;
+	}
+	LeaveCriticalSection(&wd.Lock);
+	return i < HEARTBEATSLOTS ? i : -1;
+}
+
+void releaseSlot(int slot) {
+	EnterCriticalSection(&wd.Lock);
+	wd.Watches[slot].State = Watch::Free;
+	LeaveCriticalSection(&wd.Lock);
+}
+
+// Environment variables will be sorted by name, case-insensitive
+static bool envLess(const std::string &a, const std::string &b) {
+	return _stricmp(a.c_str(), b.c_str()) < 0;
+}
+void heartbeatEnv(int slot, std::vector<char> &env) {
+	std::vector<std::string> vars;
+	char *block = GetEnvironmentStringsA(), buf[32];
+	size_t len = strlen(HEARTBEATVAR);
+
+	for (char *p = block; p && *p; p += strlen(p) + 1) {
+		if (_strnicmp(p, HEARTBEATVAR, len) != 0 || p[len] != '=')
+			vars.push_back(p);
+	}
+	if (block)
+		FreeEnvironmentStringsA(block);
+	sprintf(buf, ",%d", slot);
+	vars.push_back(std::string(HEARTBEATVAR "=") + wd.Name + buf);
+	std::sort(vars.begin(), vars.end(), envLess);
+	env.clear();
+	for (size_t i = 0; i < vars.size(); i++)
+		env.insert(env.end(), vars[i].c_str(), vars[i].c_str() + vars[i].size() + 1);
+	env.push_back(0);
+}
+
+void watchProcess(int slot, HANDLE process, DWORD pid, DWORD timeout, bool kill, WatchOwner *owner) {
+	Watch &w = wd.Watches[slot];
+	HANDLE hd;
+
+	if (!DuplicateHandle(GetCurrentProcess(), process, GetCurrentProcess(), &hd, SYNCHRONIZE | PROCESS_TERMINATE, FALSE, 0)) {
+		releaseSlot(slot);
+		return;
+	}
+	EnterCriticalSection(&wd.Lock);
+	slotAt(wd.Table, slot)->Pid = pid;
+	w.Process = hd;
+	w.Pid = pid;
+	w.Timeout = timeout;
+	w.Kill = kill;
+	w.Hung = false;
+	w.Last = 0;
+	w.Changed = GetTickCount64();
+	w.Owner = owner;
+	w.State = Watch::Watched;
+	LeaveCriticalSection(&wd.Lock);
+	SetEvent(wd.Wake);
+}
+
+/*
+	Per-interpreter notification target. When the interpreter will be
+	deleted, its children will still be watched, but not reported.
+ */
+#define WATCHOWNERKEY "VCRExt::watchdog"
+static AssocDataDesc watchOwnerData(WATCHOWNERKEY);
+static void freeWatchOwner(ClientData cd, Tcl_Interp *) {
+	WatchOwner *wo = (WatchOwner*)cd;
+
+	if (wd.Table) {
+		EnterCriticalSection(&wd.Lock);
+		for (int i = 0; i < HEARTBEATSLOTS; i++) {
+			if (wd.Watches[i].Owner == wo)
+				wd.Watches[i].Owner = NULL;
+		}
+		LeaveCriticalSection(&wd.Lock);
+		// Notifications for wo in progress
+		AcquireSRWLockExclusive(&wd.Owners);
+		ReleaseSRWLockExclusive(&wd.Owners);
+	}
+	Tcl_DeleteEvents(dropWatchEvent, wo);
+	if (wo->Callback)
+		Tcl_DecrRefCount(wo->Callback);
+	delete wo;
+}
+WatchOwner *watchOwner(Tcl_Interp *ip) {
+	WatchOwner *wo = (WatchOwner*)Tcl_GetAssocData(ip, WATCHOWNERKEY, NULL);
+
+	if (wo == NULL) {
+		wo = new WatchOwner;
+		wo->Ip = ip;
+		wo->Thread = Tcl_GetCurrentThread();
+		wo->Callback = NULL;
+		Tcl_SetAssocData(ip, WATCHOWNERKEY, freeWatchOwner, wo);
+	}
+	return wo;
+}
+
+/*
+	Command watchdog
+	Syntax:
+		watchdog configure ?-callback command?
+		watchdog list
+	Function:
+		Configures the notifications of the heartbeat watchdog and lists
+		the watched children of the interpreter. Children will be watched
+		if they have been started with execsuspended -heartbeat or
+		supervise start -heartbeat. command will be invoked with a list
+		{event pid slot} appended, event is one of hung, killed and
+		recovered.
+	Returns:
+		configure: Current callback
+		list: List with one element {slot pid counter state} per watched
+		child, state is one of waiting (no heartbeat yet), alive and hung
+ */
+DECLARE(watchdog, -1, "configure|list ?arg ...?") {
+	if (cnt < 2) {
+		Tcl_WrongNumArgs(ip, 1, objs, "configure|list ?arg ...?");
+		return TCL_ERROR;
+	}
+	ARG(String, option, 1);
+	WatchOwner *wo = watchOwner(ip);
+
+	if (strcmp(option, "configure") == 0 && (cnt == 2 || cnt == 4)) {
+		if (cnt == 4) {
+			if (strcmp(Tcl_GetString(objs[2]), "-callback") != 0)
+				throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (-callback)");
+			if (wo->Callback)
+				Tcl_DecrRefCount(wo->Callback);
+			wo->Callback = Tcl_GetCharLength(objs[3]) ? objs[3] : NULL;
+			if (wo->Callback)
+				Tcl_IncrRefCount(wo->Callback);
+		}
+		Tcl_SetObjResult(ip, wo->Callback ? wo->Callback : Tcl_NewObj());
+	}
+	else if (strcmp(option, "list") == 0 && cnt == 2) {
+		Tcl_Obj *res = Tcl_NewListObj(0, NULL), *ent[4];
+
+		if (wd.Table) {
+			EnterCriticalSection(&wd.Lock);
+			for (int i = 0; i < HEARTBEATSLOTS; i++) {
+				Watch &w = wd.Watches[i];
+
+				if (w.State != Watch::Watched || w.Owner != wo)
+					continue;
+				ent[0] = Tcl_NewIntObj(i);
+				ent[1] = Tcl_NewWideIntObj(w.Pid);
+				ent[2] = Tcl_NewWideIntObj(slotAt(wd.Table, i)->Counter);
+				ent[3] = Tcl_NewStringObj(w.Hung ? "hung" : w.Last ? "alive" : "waiting", -1);
+				Tcl_ListObjAppendElement(NULL, res, Tcl_NewListObj(4, ent));
+			}
+			LeaveCriticalSection(&wd.Lock);
+		}
+		Tcl_SetObjResult(ip, res);
+	}
+	else
+		throw ValueException(ValueException::ValueExceptionLimit, "Invalid option (configure, list)");
+}
+FINISH
+
+/*
+	Slot of the calling process, opened with the first heartbeat. The
+	variable will be removed from the environment, processes started later
+	would beat for the calling process otherwise.
+ */
+static volatile LONGLONG *ownCounter() {
+	char value[128], *comma;
+	HANDLE mapping;
+	char *table;
+	int slot;
+	DWORD len;
+
+	if ((len = GetEnvironmentVariableA(HEARTBEATVAR, value, sizeof value)) == 0)
+		return NULL;
+	SetEnvironmentVariableA(HEARTBEATVAR, NULL);
+	if (len >= sizeof value || (comma = strrchr(value, ',')) == NULL)
+		return NULL;
+	*comma = 0;
+	slot = atoi(comma + 1);
+	if ((mapping = OpenFileMappingA(FILE_MAP_READ | FILE_MAP_WRITE, FALSE, value)) == NULL)
+		return NULL;
+	table = (char*)MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+	CloseHandle(mapping);
+	if (table == NULL || slot < 0 || (DWORD)slot >= *(DWORD*)table)
+		return NULL;
+	return &slotAt(table, slot)->Counter;
+}
+
+/*
+	Command heartbeat
+	Syntax:
+		heartbeat
+	Function:
+		Signals the watchdog of the parent process that the calling process
+		is alive, by incrementing the counter of its heartbeat slot. No
+		system call will be made after the first invocation, which removes
+		VCREXT_HEARTBEAT from the environment.
+	Returns:
+		New counter value or -1 if the process is not watched
+ */
+DECLARE(heartbeat, 0, "") {
+	static volatile LONGLONG *counter = ownCounter();
+
+	Tcl_SetObjResult(ip, Tcl_NewWideIntObj(counter ? InterlockedIncrement64(counter) : -1));
+}
+FINISH
+static NewCmdDesc watchdogDesc("::VCRExt::watchdog", watchdog, NULL, NULL);
+static NewCmdDesc heartbeatDesc("::VCRExt::heartbeat", heartbeat, NULL, NULL);
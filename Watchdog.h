@@ -0,0 +1,66 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef WATCHDOG_H
+# define WATCHDOG_H
+# include "VCRExtMain.h"
+# include <windows.h>
+# include <vector>
+
+	/*
+	 * Heartbeat protocol: The extension process shares a table of slots in named
+	 * shared memory. A watched child finds the mapping name and its slot index in
+	 * environment variable VCREXT_HEARTBEAT ("name,index") and increments the
+	 * 64-bit counter at the start of its slot periodically, e.g. with command
+	 * heartbeat. Header and slots are HEARTBEATSTRIDE bytes each, slot i starts at
+	 * offset (i + 1) * HEARTBEATSTRIDE. Command heartbeat removes the variable
+	 * from the environment with its first call, grandchildren started before
+	 * inherit it.
+	 */
+# define HEARTBEATVAR "VCREXT_HEARTBEAT"
+# define HEARTBEATSTRIDE 64
+# define HEARTBEATSLOTS 1024
+	struct HeartbeatSlot {
+		volatile LONGLONG Counter;
+		DWORD Pid;
+	};
+
+	// Notification target of one interpreter, created on demand
+	struct WatchOwner;
+	WatchOwner *watchOwner(Tcl_Interp *ip);
+
+	// Reserves a slot, returns its index or -1 if no slot is available
+	int heartbeatSlot();
+
+	/*
+	 * Builds the environment block for a child using slot: The environment of the
+	 * calling process plus VCREXT_HEARTBEAT, sorted as needed by CreateProcess.
+	 */
+	void heartbeatEnv(int slot, std::vector<char> &env);
+
+	/*
+	 * Starts watching the process using slot. The watchdog thread checks the
+	 * counter every few milliseconds; if it has not advanced within timeout ms,
+	 * or the first heartbeat has not arrived within 10 * timeout ms, the process
+	 * will be reported as hung to owner and, with kill, terminated with exit
+	 * code WAIT_TIMEOUT. The slot will be released when the process has exited.
+	 * process will be duplicated.
+	 */
+	void watchProcess(int slot, HANDLE process, DWORD pid, DWORD timeout, bool kill, WatchOwner *owner);
+
+	// Releases a slot reserved by heartbeatSlot() that will not be watched
+	void releaseSlot(int slot);
+#endif
@@ -0,0 +1,199 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#include "Worker.h"
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <string.h>
+
+// Max. number of jobs waiting for a worker thread
+#define MAXQUEUEDJOBS 1024
+// Limits for the number of worker threads
+#define MINWORKERS 2
+#define MAXWORKERS 8
+
+/*
+	Process-wide worker pool. The worker threads will be started with the
+	first job and run until the extension will be unloaded. Jobs counts the
+	existing AsyncJob objects, queued, running or waiting for their event.
+ */
+static struct WorkerPool {
+	CRITICAL_SECTION Lock;
+	CONDITION_VARIABLE NotEmpty, NotFull;
+	std::deque<AsyncJob*> Queue;
+	std::once_flag Once;
+	int Workers;
+	HANDLE Threads[MAXWORKERS];
+	bool Quit;
+	volatile LONG Jobs;
+} pool;
+
+struct JobEvent {
+	Tcl_Event Header;			// Must be the first member
+	AsyncJob *Job;
+};
+
+// Implementation of AsyncJob class
+
+AsyncJob::AsyncJob(Tcl_Interp *ip, Tcl_Obj *callback) {
+	Ip = ip;
+	Thread = Tcl_GetCurrentThread();
+	Callback = callback;
+	Tcl_IncrRefCount(Callback);
+	Tcl_Preserve(Ip);
+	InterlockedIncrement(&pool.Jobs);
+}
+AsyncJob::~AsyncJob() {
+	Tcl_DecrRefCount(Callback);
+	Tcl_Release(Ip);
+	InterlockedDecrement(&pool.Jobs);
+}
+void AsyncJob::complete() {
+	JobEvent *ev = (JobEvent*)Tcl_Alloc(sizeof *ev);
+
+	ev->Header.proc = event;
+	ev->Header.nextPtr = NULL;
+	ev->Job = this;
+	Tcl_ThreadQueueEvent(Thread, &ev->Header, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(Thread);
+}
+/*
+	Event handler, invoked in the interpreter thread. Errors of the callback
+	will be reported as background errors.
+ */
+int AsyncJob::event(Tcl_Event *ev, int) {
+	AsyncJob *job = ((JobEvent*)ev)->Job;
+
+	if (!Tcl_InterpDeleted(job->Ip)) {
+		Tcl_Obj *cmd = Tcl_DuplicateObj(job->Callback);
+
+		Tcl_IncrRefCount(cmd);
+		Tcl_ListObjAppendElement(NULL, cmd, job->result());
+		if (Tcl_EvalObjEx(job->Ip, cmd, TCL_EVAL_GLOBAL) == TCL_ERROR)
+			Tcl_BackgroundError(job->Ip);
+		Tcl_DecrRefCount(cmd);
+	}
+	delete job;
+	return 1;
+}
+
+static DWORD WINAPI worker(LPVOID) {
+	for (;;) {
+		AsyncJob *job;
+
+		EnterCriticalSection(&pool.Lock);
+		while (pool.Queue.empty() && !pool.Quit)
+			SleepConditionVariableCS(&pool.NotEmpty, &pool.Lock, INFINITE);
+		if (pool.Queue.empty()) {
+			LeaveCriticalSection(&pool.Lock);
+			return 0;
+		}
+		job = pool.Queue.front();
+		pool.Queue.pop_front();
+		LeaveCriticalSection(&pool.Lock);
+		WakeConditionVariable(&pool.NotFull);
+		job->run();
+		job->complete();
+	}
+	return 0;
+}
+static void startPool() {
+	SYSTEM_INFO si;
+	int i, n;
+
+	InitializeCriticalSection(&pool.Lock);
+	InitializeConditionVariable(&pool.NotEmpty);
+	InitializeConditionVariable(&pool.NotFull);
+	GetSystemInfo(&si);
+	n = si.dwNumberOfProcessors < MINWORKERS ? MINWORKERS : si.dwNumberOfProcessors > MAXWORKERS ? MAXWORKERS : (int)si.dwNumberOfProcessors;
+	for (i = pool.Workers = 0; i < n; i++) {
+		HANDLE thd = CreateThread(NULL, 0, worker, NULL, 0, NULL);
+
+		if (thd)
+			pool.Threads[pool.Workers++] = thd;
+	}
+}
+/*
+	Unloading the extension: Refused while jobs exist, their threads or
+	events would run unmapped code. Otherwise the worker threads end.
+ */
+static const char *poolBusy() {
+	return pool.Jobs ? "Asynchronous operations are pending" : NULL;
+}
+static void stopPool() {
+	if (pool.Workers == 0)
+		return;
+	EnterCriticalSection(&pool.Lock);
+	pool.Quit = true;
+	LeaveCriticalSection(&pool.Lock);
+	WakeAllConditionVariable(&pool.NotEmpty);
+	WaitForMultipleObjects(pool.Workers, pool.Threads, TRUE, INFINITE);
+	for (int i = 0; i < pool.Workers; i++)
+		CloseHandle(pool.Threads[i]);
+	pool.Workers = 0;
+}
+static ExitDesc poolExit(stopPool, poolBusy);
+bool submitJob(AsyncJob *job) {
+	std::call_once(pool.Once, startPool);
+	if (pool.Workers == 0)
+		return false;
+	EnterCriticalSection(&pool.Lock);
+	while (pool.Queue.size() >= MAXQUEUEDJOBS)
+		SleepConditionVariableCS(&pool.NotFull, &pool.Lock, INFINITE);
+	pool.Queue.push_back(job);
+	LeaveCriticalSection(&pool.Lock);
+	WakeConditionVariable(&pool.NotEmpty);
+	return true;
+}
+
+Tcl_Obj *asyncOption(int &i, int cnt, Tcl_Obj *CONST objs[]) {
+	if (i + 1 >= cnt || strcmp(Tcl_GetString(objs[i]), "-async") != 0)
+		return NULL;
+	i += 2;
+	return objs[i - 1];
+}
+
+int yieldAsync(Tcl_ObjCmdProc *proc, int pos, ClientData cd, Tcl_Interp *ip, int cnt, Tcl_Obj *CONST objs[]) {
+	Tcl_Obj *coro;
+	int i, rc;
+
+	for (i = 1; i < cnt; i++) {
+		if (strcmp(Tcl_GetString(objs[i]), "-async") == 0)
+			return proc(cd, ip, cnt, objs);
+	}
+	if (Tcl_EvalEx(ip, "::info coroutine", -1, 0) != TCL_OK)
+		return TCL_ERROR;
+	coro = Tcl_GetObjResult(ip);
+	if (Tcl_GetCharLength(coro) == 0) {
+		Tcl_ResetResult(ip);
+		return proc(cd, ip, cnt, objs);
+	}
+
+	std::vector<Tcl_Obj*> args(objs, objs + cnt);
+
+	Tcl_IncrRefCount(coro);
+	args.insert(args.begin() + pos, coro);
+	args.insert(args.begin() + pos, Tcl_NewStringObj("-async", -1));
+	Tcl_IncrRefCount(args[pos]);
+	Tcl_ResetResult(ip);
+	rc = proc(cd, ip, cnt + 2, &args[0]);
+	Tcl_DecrRefCount(args[pos]);
+	Tcl_DecrRefCount(coro);
+	if (rc != TCL_OK)
+		return rc;
+	return Tcl_NREvalObj(ip, Tcl_NewStringObj("::yield", -1), 0);
+}
@@ -0,0 +1,65 @@
+/*
+* Copyright 2020 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+#ifndef WORKER_H
+# define WORKER_H
+# include "VCRExtMain.h"
+# include <windows.h>
+
+	/*
+	 * Class AsyncJob is the base of all operations performed by commands invoked
+	 * with option -async. The object will be created in the interpreter thread.
+	 * run() performs the operation in a worker thread and must not use any Tcl_Obj.
+	 * complete() may be called by any thread and queues an event to the interpreter
+	 * thread. There, result() creates the result, callback will be invoked with
+	 * the result appended and the object will be deleted.
+	 */
+	class AsyncJob {
+		Tcl_Interp *Ip;
+		Tcl_ThreadId Thread;
+		Tcl_Obj *Callback;
+		static int event(Tcl_Event *ev, int flags);
+	public:
+		AsyncJob(Tcl_Interp *ip, Tcl_Obj *callback);
+		virtual ~AsyncJob();
+		virtual void run() {}				// Worker thread
+		virtual Tcl_Obj *result() = 0;		// Interpreter thread
+		void complete();					// Any thread
+	};
+
+	/*
+	 * Queues job for one of the worker threads of the process-wide worker pool.
+	 * The queue is bounded: If MAXQUEUEDJOBS jobs are waiting, the caller will be
+	 * blocked until a worker thread takes the next job. Returns false if the pool
+	 * could not be started, the job will not be deleted in that case.
+	 */
+	bool submitJob(AsyncJob *job);
+
+	/*
+	 * Parses option -async callback at position i of objs. Returns the callback
+	 * or NULL if objs[i] is not -async. Increments i behind the option.
+	 */
+	Tcl_Obj *asyncOption(int &i, int cnt, Tcl_Obj *CONST objs[]);
+
+	/*
+	 * Non-recursive variant of a command supporting option -async. If invoked
+	 * within a coroutine without option -async, proc will be invoked with option
+	 * -async and the name of the coroutine as callback, inserted at position pos,
+	 * and the coroutine yields. The result will be passed to the coroutine when
+	 * it will be resumed. Otherwise, proc will be invoked unchanged.
+	 */
+	int yieldAsync(Tcl_ObjCmdProc *proc, int pos, ClientData cd, Tcl_Interp *ip, int cnt, Tcl_Obj *CONST objs[]);
+#endif
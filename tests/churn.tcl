@@ -0,0 +1,75 @@
+# Copyright 2020 Martin Conrad
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Churn benchmark: Creates short-lived processes in batches of up to 64,
+# reaps each batch with the wait command and reports per reaped child the
+# wall time, the processor time of this process (a measure for the system
+# calls spent on creating and reaping) and the number of wait calls.
+#
+# Usage: tclsh churn.tcl ?dll? ?count? ?batch?
+# Defaults: ../Release/VCRExt.dll relative to this script, 10000, 64
+
+set defaults [list [file join [file dirname [info script]] .. Release VCRExt.dll] 10000 64]
+lassign [concat $argv [lrange $defaults [llength $argv] end]] dll count batch
+if {$batch < 1 || $batch > 64} {
+	error "batch must be 1 - 64"
+}
+load $dll Vcrext
+
+# Processor time of this process in milliseconds
+proc owncpu {} {
+	set ps [VCRExt::ps -fields {pid cpu}]
+	return [lindex [dict get $ps cpu] [lsearch -exact [dict get $ps pid] [pid]]]
+}
+# Value of a metric from VCRExt::metrics text
+proc metric {name} {
+	regexp -line "^$name (\\S+)" [VCRExt::metrics text] -> value
+	return $value
+}
+
+set cmd "$env(ComSpec) /c exit 0"
+set waits0 [metric vcrext_wait_seconds_count]
+set cpu0 [owncpu]
+set begin [clock microseconds]
+set reaped 0
+while {$reaped < $count} {
+	set procs {}
+	for {set i 0} {$i < $batch && $reaped + $i < $count} {incr i} {
+		set res [VCRExt::execsuspended $cmd]
+		if {[llength $res] < 2} {
+			error "execsuspended failed: $res"
+		}
+		lassign $res phd thd
+		VCRExt::resume $thd
+		VCRExt::close $thd
+		lappend procs $phd
+	}
+	while {[llength $procs]} {
+		set i [VCRExt::wait $procs]
+		if {$i < 0} {
+			error "wait failed: $i"
+		}
+		VCRExt::close [lindex $procs $i]
+		set procs [lreplace $procs $i $i]
+		incr reaped
+	}
+}
+set micros [expr {[clock microseconds] - $begin}]
+set cpu [expr {[owncpu] - $cpu0}]
+set waits [expr {[metric vcrext_wait_seconds_count] - $waits0}]
+
+puts [format "children:        %d (batches of %d)" $reaped $batch]
+puts [format "wall per child:  %.1f us" [expr {double($micros) / $reaped}]]
+puts [format "cpu per child:   %.1f us" [expr {1000.0 * $cpu / $reaped}]]
+puts [format "waits per child: %.2f" [expr {double($waits) / $reaped}]]
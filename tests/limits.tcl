@@ -0,0 +1,103 @@
+# Copyright 2020 Martin Conrad
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Job limit test: Starts this script as child process with the job limits
+# -maxprocs, -maxmemory and -cputime of execsuspended and checks that the
+# child is stopped by them. The children write what they achieved into
+# files of a temporary directory, which will be deleted afterwards. The
+# children of -maxprocs and -maxmemory also run without the limit, so a
+# child failing for another reason does not count as enforced limit.
+#
+# Usage: tclsh limits.tcl ?dll?
+# Defaults: ../Release/VCRExt.dll relative to this script
+# Exit code 1 if any limit was not enforced.
+
+# Child process: tclsh limits.tcl child mode file
+if {[lindex $argv 0] eq "child"} {
+	lassign $argv - mode out
+	set f [open $out w]
+	fconfigure $f -buffering line
+	puts $f started
+	switch $mode {
+		procs {
+			puts $f [expr {[catch {exec $env(ComSpec) /c exit 0}] ? "denied" : "created"}]
+		}
+		memory {
+			# Tcl panics if the allocation fails
+			set data [string repeat x [expr {64 * 1024 * 1024}]]
+			puts $f allocated
+		}
+		cpu {
+			set end [expr {[clock seconds] + 20}]
+			while {[clock seconds] < $end} {}
+			puts $f finished
+		}
+	}
+	close $f
+	exit 0
+}
+
+set defaults [list [file join [file dirname [info script]] .. Release VCRExt.dll]]
+lassign [concat $argv [lrange $defaults [llength $argv] end]] dll
+load $dll Vcrext
+
+set script [file normalize [info script]]
+set sandbox [file join [expr {[info exists env(TEMP)] ? $env(TEMP) : [pwd]}] vcrext-limits-[pid]]
+file mkdir $sandbox
+set failed 0
+
+# Runs the child in mode with options of execsuspended, returns the lines
+# the child has written
+proc run {mode options} {
+	global script sandbox
+	set out [file join $sandbox $mode-[llength $options].txt]
+	set cmd [format {"%s" "%s" child %s "%s"} [file nativename [info nameofexecutable]] \
+		[file nativename $script] $mode [file nativename $out]]
+	set res [VCRExt::execsuspended {*}$options $cmd]
+	if {[llength $res] < 2} {
+		error "execsuspended $options failed with $res"
+	}
+	lassign $res phd thd
+	VCRExt::resume $thd
+	if {[VCRExt::wait -timeout 60000 $phd] < 0} {
+		VCRExt::terminate $phd 1
+	}
+	VCRExt::close $res
+	if {![file exists $out]} {
+		return {}
+	}
+	set f [open $out]
+	set lines [split [string trim [read $f]] \n]
+	close $f
+	return $lines
+}
+# Reports result of one check
+proc check {name ok} {
+	global failed
+	puts [format "%-45s %s" $name [expr {$ok ? "ok" : "FAILED"}]]
+	if {!$ok} {
+		incr failed
+	}
+}
+
+check "process creation without limit" [expr {[run procs {}] eq {started created}}]
+check "process creation with -maxprocs 1" [expr {[run procs {-maxprocs 1}] eq {started denied}}]
+check "allocation of 64 MB without limit" [expr {"allocated" in [run memory {}]}]
+set lines [run memory {-maxmemory 33554432}]
+check "allocation of 64 MB with -maxmemory 32 MB" [expr {"started" in $lines && "allocated" ni $lines}]
+set lines [run cpu {-cputime 1}]
+check "20 s busy loop with -cputime 1" [expr {"started" in $lines && "finished" ni $lines}]
+
+file delete -force $sandbox
+exit [expr {$failed ? 1 : 0}]
@@ -0,0 +1,51 @@
+# Copyright 2020 Martin Conrad
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Parser benchmark: Parses synthetic process tables of several sizes with
+# 1 - 8 threads via snapshot bench and prints the best parse time of some
+# runs in microseconds, followed by the number of threads snapshot take
+# would use and the speedup of the fastest over a single thread.
+#
+# Usage: tclsh parse.tcl ?dll? ?runs?
+# Defaults: ../Release/VCRExt.dll relative to this script, 20
+
+set defaults [list [file join [file dirname [info script]] .. Release VCRExt.dll] 20]
+lassign [concat $argv [lrange $defaults [llength $argv] end]] dll runs
+load $dll Vcrext
+
+# Best parse time of count records with threads threads (0: automatic)
+proc best {count threads} {
+	set min {}
+	for {set i 0} {$i < $::runs} {incr i} {
+		lassign [VCRExt::snapshot bench $count $threads] used micros
+		if {$min eq {} || $micros < $min} {
+			set min $micros
+		}
+	}
+	return [list $used $min]
+}
+
+puts [format "%8s %8s %8s %8s %8s %8s %8s %8s %8s %5s %8s" count 1 2 3 4 5 6 7 8 auto speedup]
+foreach count {256 1024 4096 16384 65536} {
+	set line [format %8d $count]
+	set times {}
+	for {set threads 1} {$threads <= 8} {incr threads} {
+		set t [lindex [best $count $threads] 1]
+		lappend times $t
+		append line [format " %8d" $t]
+	}
+	set fastest [tcl::mathfunc::min {*}$times]
+	append line [format " %5d %8.2f" [lindex [best $count 0] 0] [expr {double([lindex $times 0]) / max($fastest, 1)}]]
+	puts $line
+}
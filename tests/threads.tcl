@@ -0,0 +1,90 @@
+# Copyright 2020 Martin Conrad
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Thread stress test: Creates interpreters in several threads of the Thread
+# package at the same time, loads the extension into each and lets each run
+# snapshots, process creation, waits and metrics concurrently. The threads
+# will be released afterwards, which deletes their interpreters with all
+# per-interpreter state of the extension. The extension uses Tk stubs,
+# therefore each thread loads Tk first, which needs a thread-enabled Tk.
+#
+# Usage: tclsh threads.tcl ?dll? ?threads? ?rounds?
+# Defaults: ../Release/VCRExt.dll relative to this script, 32, 100
+# Exit code 1 if any thread failed.
+
+package require Thread
+
+set defaults [list [file join [file dirname [info script]] .. Release VCRExt.dll] 32 100]
+lassign [concat $argv [lrange $defaults [llength $argv] end]] dll count rounds
+set dll [file normalize $dll]
+
+set init {
+	proc work {dll rounds} {
+		package require Tk
+		wm withdraw .
+		load $dll Vcrext
+		set cmd "$::env(ComSpec) /c exit 0"
+		for {set i 0} {$i < $rounds} {incr i} {
+			VCRExt::snapshot take
+			VCRExt::ps -fields {pid name}
+			if {![VCRExt::validpid [pid]]} {
+				error "validpid failed"
+			}
+			set res [VCRExt::execsuspended $cmd]
+			if {[llength $res] < 2} {
+				error "execsuspended failed: $res"
+			}
+			lassign $res phd thd
+			VCRExt::resume $thd
+			VCRExt::close $thd
+			set rc [VCRExt::wait [list $phd]]
+			VCRExt::close $phd
+			if {$rc != 0} {
+				error "wait failed: $rc"
+			}
+			VCRExt::metrics text
+		}
+	}
+	thread::wait
+}
+
+set threads {}
+for {set i 0} {$i < $count} {incr i} {
+	lappend threads [thread::create -joinable $init]
+}
+set begin [clock milliseconds]
+foreach t $threads {
+	thread::send -async $t [list apply {{dll rounds} {
+		list [catch {work $dll $rounds} msg] $msg
+	}} $dll $rounds] result($t)
+}
+while {[array size result] < $count} {
+	vwait result
+}
+set millis [expr {[clock milliseconds] - $begin}]
+foreach t $threads {
+	thread::release $t
+	thread::join $t
+}
+
+set failed 0
+foreach t $threads {
+	lassign $result($t) rc msg
+	if {$rc} {
+		puts "thread $t: $msg"
+		incr failed
+	}
+}
+puts [format "threads: %d, rounds: %d, failed: %d, time: %.3f s" $count $rounds $failed [expr {$millis / 1000.0}]]
+exit [expr {$failed ? 1 : 0}]